@@ -0,0 +1,664 @@
+//
+// archive.h
+// Multi-file archives built from the block format in block.h. The input
+// files are cut into content-defined chunks with a Gear rolling hash
+// (FastCDC style, so an insertion only moves the chunk boundaries around
+// it), every chunk is identified by its 128-bit MurmurHash3 and each
+// distinct chunk is stored once as an ordinary block. Members list the
+// extents of blocks that make them up. In solid mode the files are instead
+// concatenated into shared blocks of the block size, so many small files
+// share one frequency header and tree, and identical files are stored once.
+// All integers are little-endian.
+//
+//   archive := "HUFA" version:u8 checksumKind:u8 block* index
+//   block   := as in block.h
+//   index   := 'I' blockCount:u32 (offset:u64 rawSize:u32 hash:u128)*
+//              memberCount:u32 member* indexCrc:u32 indexOffset:u64 "HUFZ"
+//   member  := nameLength:u16 name size:u64 extentCount:u32
+//              (block:u32 offset:u32 length:u32)*
+//
+// An extent is length bytes starting at offset in the decoded block, so
+// extracting one member decodes only the blocks it uses. Every block still
+// carries its own checksums, and indexCrc covers the index.
+//
+
+#pragma once
+
+#include <algorithm> // for sort
+#include <filesystem>
+#include <unordered_map>
+#include "block.h"
+using namespace std;
+
+const char ARCHIVE_MAGIC[] = "HUFA";
+const char ARCHIVE_END_MAGIC[] = "HUFZ";
+const int ARCHIVE_VERSION = 1;
+const size_t ARCHIVE_FOOTER_SIZE = 12; // indexOffset + "HUFZ"
+const size_t DEFAULT_CHUNK_SIZE = 256 << 10; // average; small chunks pay for their own header
+const size_t MAX_CHUNK_SIZE = 64 << 20;
+
+struct ArchiveOptions {
+    BlockOptions block; // how each stored block is coded
+    size_t chunkSize = DEFAULT_CHUNK_SIZE; // average chunk size, a power of two
+    bool dedup = true;
+    bool solid = false; // shared blocks of block.blockSize instead of chunks
+};
+
+struct ArchiveExtent {
+    uint32_t block;
+    uint32_t offset;
+    uint32_t length;
+};
+
+struct ArchiveMember {
+    string name;
+    uint64_t size = 0;
+    vector<ArchiveExtent> extents;
+};
+
+struct ArchiveBlock {
+    uint64_t offset;
+    uint32_t rawSize;
+    Hash128 hash;
+};
+
+struct ArchiveIndex {
+    ChecksumKind checksum = CHECKSUM_CRC32C;
+    vector<ArchiveBlock> blocks;
+    vector<ArchiveMember> members;
+};
+
+struct ArchiveStats {
+    uint64_t members = 0;
+    uint64_t rawBytes = 0;
+    uint64_t chunks = 0;
+    uint64_t uniqueChunks = 0;
+    uint64_t storedRawBytes = 0;
+    long long archiveBytes = 0;
+};
+
+//
+// _gearTable
+// The 256 random values of the Gear hash, from a fixed splitmix64 sequence
+// so chunk boundaries never change between builds.
+//
+const uint64_t* _gearTable() {
+    static uint64_t table[256];
+    static bool built = [] {
+        uint64_t state = 0x9E3779B97F4A7C15ULL;
+        for(int i = 0; i < 256; i++){
+            uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            table[i] = z ^ (z >> 31);
+        }
+        return true;
+    }();
+    (void)built;
+    return table;
+}
+
+//
+// chunkBoundary
+// Length of the next content-defined chunk at the start of p[0..n), given
+// the average chunk size (a power of two). Chunks are between a quarter and
+// eight times the average. Uses FastCDC's normalized chunking: a stricter
+// mask before the average size and a looser one after it, which keeps
+// chunk sizes close to the average. The Gear hash shifts left, so its high
+// bits depend on the most recent 64 bytes; the masks use those bits.
+//
+size_t chunkBoundary(const unsigned char* p, size_t n, size_t average) {
+    size_t minimum = average / 4, maximum = average * 8;
+    if(n <= minimum)
+        return n;
+    int bits = 0;
+    while(((size_t)1 << bits) < average)
+        bits++;
+    uint64_t strict = ~0ULL << (64 - min(bits + 2, 63));
+    uint64_t loose = ~0ULL << (64 - max(bits - 2, 1));
+    const uint64_t* gear = _gearTable();
+    uint64_t hash = 0;
+    size_t i = minimum;
+    size_t normal = min(average, n);
+    for(; i < normal; i++){
+        hash = (hash << 1) + gear[p[i]];
+        if((hash & strict) == 0)
+            return i + 1;
+    }
+    size_t end = min(maximum, n);
+    for(; i < end; i++){
+        hash = (hash << 1) + gear[p[i]];
+        if((hash & loose) == 0)
+            return i + 1;
+    }
+    return end;
+}
+
+//
+// archiveMemberName
+// The name a path is stored under: relative, with '/' separators and no
+// "." or ".." components.
+//
+string archiveMemberName(const string &path) {
+    string name;
+    for(const filesystem::path &part : filesystem::path(path).relative_path()){
+        string text = part.generic_string();
+        if(text.empty() || text == "." || text == "/")
+            continue;
+        if(text == "..")
+            throw runtime_error("refusing to archive a path with '..': " + path);
+        name += (name.empty() ? "" : "/") + text;
+    }
+    if(name.empty() || name.size() > 0xFFFF)
+        throw runtime_error("bad archive member name: " + path);
+    return name;
+}
+
+//
+// archiveInputs
+// Expands the paths given on the command line into the regular files to
+// archive, walking directories in sorted order so archives are repeatable.
+//
+vector<string> archiveInputs(const vector<string> &paths) {
+    vector<string> files;
+    for(const string &path : paths){
+        if(filesystem::is_directory(path)){
+            vector<string> found;
+            for(const filesystem::directory_entry &entry : filesystem::recursive_directory_iterator(path))
+                if(entry.is_regular_file())
+                    found.push_back(entry.path().string());
+            sort(found.begin(), found.end());
+            files.insert(files.end(), found.begin(), found.end());
+        }
+        else if(filesystem::is_regular_file(path))
+            files.push_back(path);
+        else
+            throw runtime_error("cannot archive " + path + ": not a file or directory");
+    }
+    return files;
+}
+
+//
+// ArchiveWriter
+// Writes an archive one member at a time. Chunks are hashed and encoded on
+// options.block.threads threads; chunking itself is one sequential pass.
+// Solid blocks are encoded options.block.threads at a time as they fill.
+//
+class ArchiveWriter {
+public:
+    ArchiveWriter(string path, ArchiveOptions options) : path(path), options(options) {
+        if(options.chunkSize < 64 || options.chunkSize * 8 > MAX_CHUNK_SIZE ||
+           (options.chunkSize & (options.chunkSize - 1)) != 0)
+            throw runtime_error("chunk size must be a power of two between 64 bytes and 8 MB");
+        if(options.block.blockSize == 0 || options.block.blockSize > MAX_BLOCK_SIZE)
+            throw runtime_error("block size must be between 1 byte and 1 GB");
+        output.open(path, ios::binary | ios::trunc);
+        if(!output)
+            throw runtime_error("cannot create " + path);
+        output.write(ARCHIVE_MAGIC, 4);
+        output.put((char)ARCHIVE_VERSION);
+        output.put((char)options.block.checksum);
+        index.checksum = options.block.checksum;
+    }
+
+    //
+    // addFile
+    // Chunks the file at inPath and adds it as member name.
+    //
+    void addFile(string inPath, string name) {
+        ifstream input(inPath, ios::binary);
+        if(!input)
+            throw runtime_error("cannot open " + inPath);
+        ArchiveMember member;
+        member.name = name;
+        if(options.solid){
+            _addSolid(input, member);
+            if(input.bad())
+                throw runtime_error("error reading " + inPath);
+            index.members.push_back(member);
+            stats.members++;
+            return;
+        }
+
+        // keep at least one maximum size chunk buffered so boundaries do not
+        // depend on how the file was read
+        size_t maximum = options.dedup ? options.chunkSize * 8 : options.block.blockSize;
+        size_t segment = max(maximum * 2, (size_t)8 << 20);
+        string buffer;
+        size_t start = 0;
+        bool eof = false;
+        while(true){
+            if(!eof && buffer.size() - start < maximum){
+                TraceSpan span("read");
+                buffer.erase(0, start);
+                start = 0;
+                size_t have = buffer.size();
+                buffer.resize(segment);
+                input.read(&buffer[have], segment - have);
+                buffer.resize(have + input.gcount());
+                eof = input.gcount() == 0 || !input;
+            }
+            if(start == buffer.size())
+                break;
+
+            // cut every chunk that is sure to be final before the next read
+            vector<string> chunks;
+            {
+                TraceSpan span("chunk");
+                while(start < buffer.size() && (eof || buffer.size() - start >= maximum)){
+                    const unsigned char* p = (const unsigned char*)buffer.data() + start;
+                    size_t length = options.dedup ? chunkBoundary(p, buffer.size() - start, options.chunkSize)
+                                                  : min(maximum, buffer.size() - start);
+                    chunks.push_back(buffer.substr(start, length));
+                    start += length;
+                }
+            }
+            _addChunks(chunks, member);
+        }
+        if(input.bad())
+            throw runtime_error("error reading " + inPath);
+        index.members.push_back(member);
+        stats.members++;
+    }
+
+    //
+    // finish
+    // Writes the index and closes the archive. Returns the statistics.
+    //
+    ArchiveStats finish() {
+        if(!solid.empty()){
+            pending.push_back(solid);
+            solid.clear();
+        }
+        _flushSolid();
+        uint64_t indexOffset = output.tellp();
+        string bytes = encodeArchiveIndex(index);
+        putLE(bytes, crc32c(0, bytes), 4);
+        putLE(bytes, indexOffset, 8);
+        bytes += ARCHIVE_END_MAGIC;
+        output.write(bytes.data(), bytes.size());
+        stats.archiveBytes = output.tellp();
+        output.close();
+        if(!output)
+            throw runtime_error("error writing " + path);
+        return stats;
+    }
+
+    //
+    // encodeArchiveIndex
+    // Serializes the index, from its 'I' marker up to (not including) the crc.
+    //
+    static string encodeArchiveIndex(const ArchiveIndex &index) {
+        string out = "I";
+        putLE(out, index.blocks.size(), 4);
+        for(const ArchiveBlock &block : index.blocks){
+            putLE(out, block.offset, 8);
+            putLE(out, block.rawSize, 4);
+            putLE(out, block.hash.low, 8);
+            putLE(out, block.hash.high, 8);
+        }
+        putLE(out, index.members.size(), 4);
+        for(const ArchiveMember &member : index.members){
+            putLE(out, member.name.size(), 2);
+            out += member.name;
+            putLE(out, member.size, 8);
+            putLE(out, member.extents.size(), 4);
+            for(const ArchiveExtent &extent : member.extents){
+                putLE(out, extent.block, 4);
+                putLE(out, extent.offset, 4);
+                putLE(out, extent.length, 4);
+            }
+        }
+        return out;
+    }
+
+private:
+    //
+    // _addChunks
+    // Hashes the chunks, stores the ones not seen before and appends an
+    // extent for each to member.
+    //
+    void _addChunks(const vector<string> &chunks, ArchiveMember &member) {
+        vector<Hash128> hashes(chunks.size());
+        parallelFor(chunks.size(), options.block.threads, [&](size_t i) {
+            TraceSpan span("hash");
+            hashes[i] = murmur3_128(chunks[i].data(), chunks[i].size());
+        });
+
+        vector<string> fresh;
+        vector<Hash128> freshHashes;
+        vector<uint32_t> ids(chunks.size());
+        for(size_t i = 0; i < chunks.size(); i++){
+            auto found = options.dedup ? known.find(hashes[i]) : known.end();
+            if(found != known.end()){
+                ids[i] = found->second;
+                continue;
+            }
+            // later copies in the same batch find this one
+            ids[i] = index.blocks.size() + fresh.size();
+            if(options.dedup)
+                known[hashes[i]] = ids[i];
+            fresh.push_back(chunks[i]);
+            freshHashes.push_back(hashes[i]);
+        }
+
+        _writeBlocks(fresh, freshHashes);
+        for(size_t i = 0; i < chunks.size(); i++){
+            member.extents.push_back({ids[i], 0, (uint32_t)chunks[i].size()});
+            member.size += chunks[i].size();
+            stats.rawBytes += chunks[i].size();
+        }
+        stats.chunks += chunks.size();
+    }
+
+    //
+    // _writeBlocks
+    // Encodes raws on the worker threads and writes them as the next blocks,
+    // hashing them first when hashes is empty.
+    //
+    void _writeBlocks(const vector<string> &raws, vector<Hash128> hashes) {
+        if(hashes.empty()){
+            hashes.resize(raws.size());
+            parallelFor(raws.size(), options.block.threads, [&](size_t i) {
+                hashes[i] = murmur3_128(raws[i].data(), raws[i].size());
+            });
+        }
+        vector<string> blocks(raws.size());
+        parallelFor(raws.size(), options.block.threads, [&](size_t i) {
+            blocks[i] = encodeBlock(raws[i], options.block);
+        });
+        for(size_t i = 0; i < blocks.size(); i++){
+            TraceSpan span("write");
+            index.blocks.push_back({(uint64_t)output.tellp(), (uint32_t)raws[i].size(), hashes[i]});
+            output.write(blocks[i].data(), blocks[i].size());
+            stats.storedRawBytes += raws[i].size();
+        }
+        stats.uniqueChunks += raws.size();
+    }
+
+    //
+    // _addSolid
+    // Appends the file to the solid stream. With dedup on, a file of at most
+    // one block that has the same content as an earlier member reuses its
+    // extents.
+    //
+    void _addSolid(ifstream &input, ArchiveMember &member) {
+        size_t blockSize = options.block.blockSize;
+        input.seekg(0, ios::end);
+        uint64_t size = input.tellg();
+        input.seekg(0);
+        if(options.dedup && size <= blockSize){
+            string content = readExactly(input, size, "archive input");
+            Hash128 hash = murmur3_128(content.data(), content.size());
+            auto found = knownFiles.find(hash);
+            if(found != knownFiles.end() && index.members[found->second].size == size){
+                member.extents = index.members[found->second].extents;
+                member.size = size;
+                stats.rawBytes += size;
+                return;
+            }
+            knownFiles[hash] = index.members.size();
+            _appendSolid(content.data(), content.size(), member);
+            return;
+        }
+        string buffer(blockSize, '\0');
+        while(input.read(&buffer[0], blockSize) || input.gcount() > 0)
+            _appendSolid(buffer.data(), input.gcount(), member);
+    }
+
+    //
+    // _appendSolid
+    // Adds n bytes of member to the block being filled, starting a new block
+    // whenever one is full.
+    //
+    void _appendSolid(const char* data, size_t n, ArchiveMember &member) {
+        size_t blockSize = options.block.blockSize;
+        while(n > 0){
+            size_t take = min(n, blockSize - solid.size());
+            uint32_t id = index.blocks.size() + pending.size();
+            uint32_t offset = solid.size();
+            ArchiveExtent* last = member.extents.empty() ? nullptr : &member.extents.back();
+            if(last != nullptr && last->block == id && last->offset + last->length == offset)
+                last->length += take;
+            else
+                member.extents.push_back({id, offset, (uint32_t)take});
+            solid.append(data, take);
+            member.size += take;
+            stats.rawBytes += take;
+            data += take;
+            n -= take;
+            if(solid.size() == blockSize){
+                pending.push_back(solid);
+                solid.clear();
+                if(pending.size() >= (size_t)max(1, options.block.threads))
+                    _flushSolid();
+            }
+        }
+    }
+
+    //
+    // _flushSolid
+    // Writes the full solid blocks waiting to be encoded.
+    //
+    void _flushSolid() {
+        _writeBlocks(pending, vector<Hash128>());
+        stats.chunks += pending.size();
+        pending.clear();
+    }
+
+    string path;
+    ArchiveOptions options;
+    ofstream output;
+    ArchiveIndex index;
+    unordered_map<Hash128, uint32_t, Hash128Hasher> known;
+    unordered_map<Hash128, size_t, Hash128Hasher> knownFiles; // solid mode: content to member
+    string solid; // solid mode: the block being filled
+    vector<string> pending; // solid mode: full blocks not yet written
+    ArchiveStats stats;
+};
+
+//
+// readArchiveIndex
+// Reads and checks the index of the archive open in input.
+//
+ArchiveIndex readArchiveIndex(istream &input) {
+    string header(6, '\0');
+    input.seekg(0);
+    input.read(&header[0], 6);
+    if(input.gcount() != 6 || header.compare(0, 4, ARCHIVE_MAGIC) != 0)
+        throw runtime_error("not an archive");
+    if(header[4] != ARCHIVE_VERSION)
+        throw runtime_error("unsupported archive version " + to_string((int)header[4]));
+    if(header[5] != CHECKSUM_CRC32C && header[5] != CHECKSUM_XXHASH64)
+        throw runtime_error("unknown checksum kind in archive header");
+
+    input.seekg(0, ios::end);
+    long long size = input.tellg();
+    if(size < 6 + 9 + 4 + (long long)ARCHIVE_FOOTER_SIZE)
+        throw runtime_error("archive is truncated");
+    input.seekg(size - ARCHIVE_FOOTER_SIZE);
+    string footer = readExactly(input, ARCHIVE_FOOTER_SIZE, "archive footer");
+    uint64_t indexOffset = getLE(&footer[0], 8);
+    if(footer.compare(8, 4, ARCHIVE_END_MAGIC) != 0 || indexOffset < 6 ||
+       indexOffset + 13 + ARCHIVE_FOOTER_SIZE > (uint64_t)size)
+        throw runtime_error("archive is truncated or has no index");
+    input.seekg(indexOffset);
+    string bytes = readExactly(input, size - ARCHIVE_FOOTER_SIZE - indexOffset, "archive index");
+    size_t crcPos = bytes.size() - 4;
+    if(bytes[0] != 'I' || crc32c(0, bytes.data(), crcPos) != getLE(&bytes[crcPos], 4))
+        throw runtime_error("corrupt archive index");
+
+    ArchiveIndex index;
+    index.checksum = (ChecksumKind)header[5];
+    const char* p = bytes.data() + 1;
+    const char* end = bytes.data() + crcPos;
+    auto need = [&](size_t n) {
+        if((size_t)(end - p) < n)
+            throw runtime_error("corrupt archive index");
+    };
+    need(4);
+    uint32_t blockCount = getLE(p, 4);
+    p += 4;
+    need((size_t)blockCount * 28);
+    for(uint32_t i = 0; i < blockCount; i++, p += 28){
+        Hash128 hash;
+        hash.low = getLE(p + 12, 8);
+        hash.high = getLE(p + 20, 8);
+        index.blocks.push_back({getLE(p, 8), (uint32_t)getLE(p + 8, 4), hash});
+        if(index.blocks.back().offset >= indexOffset)
+            throw runtime_error("corrupt archive index");
+    }
+    need(4);
+    uint32_t memberCount = getLE(p, 4);
+    p += 4;
+    for(uint32_t i = 0; i < memberCount; i++){
+        ArchiveMember member;
+        need(2);
+        size_t nameLength = getLE(p, 2);
+        need(2 + nameLength + 12);
+        member.name.assign(p + 2, nameLength);
+        p += 2 + nameLength;
+        member.size = getLE(p, 8);
+        uint32_t extentCount = getLE(p + 8, 4);
+        p += 12;
+        need((size_t)extentCount * 12);
+        uint64_t total = 0;
+        for(uint32_t e = 0; e < extentCount; e++, p += 12){
+            ArchiveExtent extent{(uint32_t)getLE(p, 4), (uint32_t)getLE(p + 4, 4),
+                                 (uint32_t)getLE(p + 8, 4)};
+            if(extent.block >= index.blocks.size() ||
+               (uint64_t)extent.offset + extent.length > index.blocks[extent.block].rawSize)
+                throw runtime_error("corrupt archive index: bad extent in " + member.name);
+            total += extent.length;
+            member.extents.push_back(extent);
+        }
+        if(total != member.size)
+            throw runtime_error("corrupt archive index: size mismatch for " + member.name);
+        index.members.push_back(member);
+    }
+    if(p != end)
+        throw runtime_error("corrupt archive index");
+    return index;
+}
+
+//
+// isArchive
+// True when the file at path starts with the archive magic.
+//
+bool isArchive(string path) {
+    ifstream in(path, ios::binary);
+    char magic[4];
+    in.read(magic, 4);
+    return in.gcount() == 4 && string(magic, 4) == ARCHIVE_MAGIC;
+}
+
+//
+// ArchiveReader
+// Random access to the members of an archive. The last decoded block is
+// kept, since consecutive extents usually share one.
+//
+class ArchiveReader {
+public:
+    ArchiveReader(string path) : path(path), input(path, ios::binary) {
+        if(!input)
+            throw runtime_error("cannot open " + path);
+        index = readArchiveIndex(input);
+    }
+
+    const ArchiveIndex &archiveIndex() const {
+        return index;
+    }
+
+    //
+    // block
+    // The decoded, checksum verified bytes of block id.
+    //
+    const string &block(uint32_t id) {
+        if(id != cachedId){
+            input.clear();
+            input.seekg(index.blocks.at(id).offset);
+            Block block;
+            if(!readBlock(input, block) || block.rawSize != index.blocks[id].rawSize)
+                throw runtime_error("archive block " + to_string(id) + " does not match the index");
+            cached = decodeBlock(block, index.checksum);
+            cachedId = id;
+        }
+        return cached;
+    }
+
+    //
+    // extract
+    // Hands the bytes of member to sink, one extent at a time.
+    //
+    template <typename Sink>
+    void extract(const ArchiveMember &member, Sink sink) {
+        for(const ArchiveExtent &extent : member.extents){
+            const string &raw = block(extent.block);
+            sink(raw.data() + extent.offset, extent.length);
+        }
+    }
+
+    //
+    // read
+    // The whole of member as a string.
+    //
+    string read(const ArchiveMember &member) {
+        string out;
+        out.reserve(member.size);
+        extract(member, [&](const char* data, size_t n) { out.append(data, n); });
+        return out;
+    }
+
+private:
+    string path;
+    ifstream input;
+    ArchiveIndex index;
+    string cached;
+    uint32_t cachedId = UINT32_MAX;
+};
+
+//
+// extractArchive
+// Writes the members of the archive at path (all of them when names is
+// empty) under directory destination. Returns the number written.
+//
+size_t extractArchive(string path, string destination, const vector<string> &names) {
+    ArchiveReader reader(path);
+    size_t written = 0;
+    for(const ArchiveMember &member : reader.archiveIndex().members){
+        if(!names.empty() && find(names.begin(), names.end(), member.name) == names.end())
+            continue;
+        // names come from the archive, so check them again before writing
+        filesystem::path target = filesystem::path(destination) / archiveMemberName(member.name);
+        if(target.has_parent_path())
+            filesystem::create_directories(target.parent_path());
+        ofstream output(target, ios::binary | ios::trunc);
+        if(!output)
+            throw runtime_error("cannot create " + target.string());
+        reader.extract(member, [&](const char* data, size_t n) { output.write(data, n); });
+        output.close();
+        if(!output)
+            throw runtime_error("error writing " + target.string());
+        written++;
+    }
+    return written;
+}
+
+//
+// verifyArchive
+// Decodes every block of the archive at path and checks it against the
+// index, its murmur3 hash included (the hash deduplication relies on).
+// Returns the total size of the members.
+//
+uint64_t verifyArchive(string path) {
+    ArchiveReader reader(path);
+    for(uint32_t id = 0; id < reader.archiveIndex().blocks.size(); id++){
+        const string &raw = reader.block(id);
+        if(!(murmur3_128(raw.data(), raw.size()) == reader.archiveIndex().blocks[id].hash))
+            throw runtime_error("archive block " + to_string(id) + " does not match its hash in the index");
+    }
+    uint64_t total = 0;
+    for(const ArchiveMember &member : reader.archiveIndex().members)
+        total += member.size;
+    return total;
+}
@@ -0,0 +1,149 @@
+//
+// bench.cpp
+// Driver for the benchmark suite in bench.h.
+//
+// Build: g++ -std=c++17 -O2 bench.cpp hashmap.cpp -o bench
+//
+// Usage: bench [--kinds text,json,...] [--sizes 1K,1M,...] [--seed N]
+//              [--dir corpusDir] [--out results.json] [--reps R]
+//              [--compare baseline.json] [--save-baseline baseline.json]
+//              [--threshold percent] [--trace trace.json] [--perf]
+//
+// --save-baseline records the (repeated) results as the baseline for this
+// CPU model; --compare reruns the suite and exits with status 1 when any
+// stage's throughput regressed beyond the noise-aware threshold. --trace
+// writes every stage as a Chrome trace span. --perf samples hardware
+// counters (cycles, instructions, branch and cache misses) around every
+// stage when perf_event_open is permitted.
+//
+// The default sizes stop at 1M so a run finishes quickly; pass
+// --sizes 1K,1M,64M,1G for the full 1 KB to 1 GB sweep. Every stage
+// streams the corpus from its file, so memory use stays at a few MB at
+// any size (only the 1G corpus file itself needs the disk space).
+//
+
+#include <iostream>
+#include <fstream>
+#include <unordered_map>
+#include <algorithm>
+#include <vector>
+#include <math.h>
+#include "hashmap.h"
+#include "bitstream.h"
+#include "util.h"
+#include "bench.h"
+using namespace std;
+
+//
+// splitList
+// Splits a comma separated command line value.
+//
+vector<string> splitList(string str) {
+    vector<string> items;
+    stringstream ss(str);
+    string item;
+    while(getline(ss, item, ','))
+        if(!item.empty())
+            items.push_back(item);
+    return items;
+}
+
+int main(int argc, char* argv[]) {
+    vector<string> kinds = CORPUS_KINDS;
+    vector<string> sizes = {"1K", "64K", "1M"};
+    unsigned seed = 251;
+    string dir = ".";
+    string outFile;
+    string compareFile;
+    string baselineFile;
+    int reps = 0;
+    double thresholdPct = 10.0;
+
+    PerfCounters perf;
+    bool usePerf = false;
+
+    for(int i = 1; i < argc; i++){
+        string arg = argv[i];
+        if(arg == "--perf"){
+            usePerf = true;
+            continue;
+        }
+        if(i + 1 >= argc){
+            cerr << "Missing value for " << arg << endl;
+            return 2;
+        }
+        string value = argv[++i];
+        if(arg == "--kinds")
+            kinds = splitList(value);
+        else if(arg == "--sizes")
+            sizes = splitList(value);
+        else if(arg == "--seed")
+            seed = stoul(value);
+        else if(arg == "--dir")
+            dir = value;
+        else if(arg == "--out")
+            outFile = value;
+        else if(arg == "--reps")
+            reps = stoi(value);
+        else if(arg == "--compare")
+            compareFile = value;
+        else if(arg == "--save-baseline")
+            baselineFile = value;
+        else if(arg == "--threshold")
+            thresholdPct = stod(value);
+        else if(arg == "--trace")
+            startTracing(value);
+        else {
+            cerr << "Unknown option " << arg << endl;
+            return 2;
+        }
+    }
+
+    // baselines need several runs to estimate the noise
+    if(reps <= 0)
+        reps = (compareFile.empty() && baselineFile.empty()) ? 1 : 5;
+
+    if(usePerf && !perf.open()){
+        cerr << "Hardware counters unavailable (" << perf.error << "), continuing without them" << endl;
+        usePerf = false;
+    }
+
+    vector<BenchResult> results;
+    for(string &kind : kinds){
+        if(find(CORPUS_KINDS.begin(), CORPUS_KINDS.end(), kind) == CORPUS_KINDS.end()){
+            cerr << "Unknown corpus kind " << kind << endl;
+            return 2;
+        }
+        for(string &sizeStr : sizes){
+            long long size = parseSize(sizeStr);
+            if(size <= 0){
+                cerr << "Invalid size " << sizeStr << endl;
+                return 2;
+            }
+            string path = writeCorpusFile(dir, kind, size, seed);
+            cerr << "Benchmarking " << kind << " " << formatSize(size) << "..." << endl;
+            vector<BenchResult> runs;
+            for(int r = 0; r < reps; r++)
+                runs.push_back(runBenchmark(kind, path, usePerf ? &perf : nullptr));
+            results.push_back(summarizeRuns(runs));
+            if(!results.back().roundTrip)
+                cerr << "  round trip FAILED for " << path << endl;
+        }
+    }
+
+    string json = benchResultsToJson(results);
+    if(outFile.empty())
+        cout << json;
+    else
+        ofstream(outFile) << json;
+
+    if(!baselineFile.empty()){
+        saveBaseline(baselineFile, results);
+        cerr << "Saved baseline for " << cpuModel() << " to " << baselineFile << endl;
+    }
+    if(!compareFile.empty() && !compareToBaseline(compareFile, results, thresholdPct, cerr)){
+        cerr << "Performance regression against " << compareFile << endl;
+        return 1;
+    }
+    return 0;
+}
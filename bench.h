@@ -0,0 +1,705 @@
+//
+// bench.h
+// Benchmark harness for the compression program. Generates a reproducible
+// synthetic corpus and times every stage of the Huffman pipeline
+// (buildFrequencyMap, buildEncodingTree, buildEncodingMap, encode, decode)
+// separately, reporting MB/s, compression ratio and peak RSS as JSON.
+//
+
+#pragma once
+
+#include <chrono> // for steady_clock
+#include <random> // for mt19937_64
+#include <sstream> // for building the JSON report
+#include <sys/resource.h> // for getrusage (peak RSS)
+#include "trace.h" // for TraceSpan
+#include "perfcounters.h" // for PerfCounters
+
+// every corpus kind the generator knows how to build
+const vector<string> CORPUS_KINDS = {"text", "json", "telemetry", "random", "constant"};
+
+// the pipeline stages, in the order they run
+const vector<string> BENCH_STAGES = {"buildFrequencyMap", "buildEncodingTree",
+                                     "buildEncodingMap", "encode", "decode"};
+
+struct StageTiming {
+    string stage;
+    double seconds;
+    double mbps;
+    double ciMbps = 0; // half width of the 95% confidence interval on mbps
+    long long perf[NUM_PERF_EVENTS] = {-1, -1, -1, -1, -1}; // -1 when not measured
+};
+
+struct BenchResult {
+    string corpus;
+    long long size;
+    long long compressedSize;
+    double ratio;
+    long peakRssKb;
+    bool roundTrip;
+    int reps = 1;
+    vector<StageTiming> stages;
+};
+
+//
+// secondsSince
+// Returns the wall clock time elapsed since start, in seconds.
+//
+double secondsSince(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+//
+// peakRssKb
+// Returns the peak resident set size of this process so far, in kilobytes.
+// Note this is a high-water mark for the whole process, not for one run.
+//
+long peakRssKb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+//
+// parseSize
+// Converts a size such as "64", "1K", "16M" or "1G" into a byte count.
+// Returns -1 when the string is not a valid size.
+//
+long long parseSize(string str) {
+    if(str.empty())
+        return -1;
+    long long multiplier = 1;
+    char unit = toupper(str.back());
+    if(unit == 'K' || unit == 'M' || unit == 'G'){
+        multiplier = (unit == 'K') ? 1LL << 10 : (unit == 'M') ? 1LL << 20 : 1LL << 30;
+        str.pop_back();
+    }
+    if(str.empty() || str.find_first_not_of("0123456789") != string::npos)
+        return -1;
+    return stoll(str) * multiplier;
+}
+
+//
+// formatSize
+// Inverse of parseSize, used to name corpus files ("1K", "16M", ...).
+//
+string formatSize(long long size) {
+    if(size >= (1LL << 30) && size % (1LL << 30) == 0)
+        return to_string(size >> 30) + "G";
+    if(size >= (1LL << 20) && size % (1LL << 20) == 0)
+        return to_string(size >> 20) + "M";
+    if(size >= (1LL << 10) && size % (1LL << 10) == 0)
+        return to_string(size >> 10) + "K";
+    return to_string(size);
+}
+
+//
+// _zipfIndex
+// Draws an index in [0, n) with a roughly Zipfian distribution, so a few
+// entries are very common and most are rare (like words in English text).
+//
+int _zipfIndex(mt19937_64 &rng, int n) {
+    // inverse transform of a 1/x density over [1, n + 1)
+    double u = (rng() >> 11) * (1.0 / (1ULL << 53));
+    int index = (int)(exp(u * log(n + 1.0))) - 1;
+    return index < 0 ? 0 : (index >= n ? n - 1 : index);
+}
+
+//
+// generateCorpus
+// Builds size bytes of the given corpus kind. The output depends only on
+// kind, size and seed, so every run (and every machine) sees the same data.
+//   text      - English-like prose drawn from a Zipfian vocabulary
+//   json      - one JSON log record per line
+//   telemetry - little-endian 16 bit sensor readings doing a random walk
+//   random    - uniformly random bytes (incompressible)
+//   constant  - a single byte value repeated (best case)
+// The corpus is written to out a megabyte at a time, so a 1G corpus does
+// not have to fit in memory.
+//
+void generateCorpus(string kind, long long size, unsigned seed, ostream &out) {
+    static const vector<string> words = {
+        "the", "of", "and", "to", "a", "in", "is", "that", "it", "was", "for",
+        "on", "are", "as", "with", "his", "they", "at", "be", "this", "from",
+        "have", "or", "by", "one", "had", "not", "but", "what", "all", "were",
+        "when", "we", "there", "can", "an", "your", "which", "their", "said",
+        "if", "do", "will", "each", "about", "how", "up", "out", "them", "then",
+        "she", "many", "some", "so", "these", "would", "other", "into", "has",
+        "more", "her", "two", "like", "him", "see", "time", "could", "no",
+        "make", "than", "first", "been", "its", "who", "now", "people", "my",
+        "made", "over", "did", "down", "only", "way", "find", "use", "may",
+        "water", "long", "little", "very", "after", "words", "called", "just",
+        "where", "most", "know", "compression", "tree", "frequency", "encoding"};
+    static const vector<string> levels = {"INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR"};
+    static const vector<string> services = {"auth", "billing", "gateway", "search", "storage"};
+
+    mt19937_64 rng(seed);
+    string data;
+    long long written = 0;
+    // hands the full part of data to out, keeping at most size bytes in all
+    auto spill = [&](bool last) {
+        if(!last && data.size() < (1 << 20))
+            return;
+        long long keep = min((long long)data.size(), size - written);
+        out.write(data.data(), keep);
+        written += keep;
+        data.clear();
+    };
+
+    if(kind == "text"){
+        bool startSentence = true;
+        while(written + (long long)data.size() < size){
+            string word = words[_zipfIndex(rng, words.size())];
+            if(startSentence)
+                word[0] = toupper(word[0]);
+            data += word;
+            startSentence = false;
+            int r = rng() % 100;
+            if(r < 6){
+                data += (r < 1) ? ".\n" : ". ";
+                startSentence = true;
+            }
+            else if(r < 10)
+                data += ", ";
+            else
+                data += " ";
+            spill(false);
+        }
+    }
+    else if(kind == "json"){
+        long long timestamp = 1667000000000LL;
+        while(written + (long long)data.size() < size){
+            timestamp += rng() % 250;
+            data += "{\"ts\":" + to_string(timestamp);
+            data += ",\"level\":\"" + levels[rng() % levels.size()] + "\"";
+            data += ",\"service\":\"" + services[_zipfIndex(rng, services.size())] + "\"";
+            data += ",\"latency_ms\":" + to_string(_zipfIndex(rng, 2000));
+            data += ",\"msg\":\"";
+            int nWords = 3 + rng() % 6;
+            for(int i = 0; i < nWords; i++){
+                if(i > 0)
+                    data += " ";
+                data += words[_zipfIndex(rng, words.size())];
+            }
+            data += "\"}\n";
+            spill(false);
+        }
+    }
+    else if(kind == "telemetry"){
+        int reading = 20000;
+        while(written + (long long)data.size() < size){
+            // small steps are far more likely than large ones
+            int step = (int)(rng() % 7) - 3;
+            if(rng() % 64 == 0)
+                step *= 40;
+            reading = max(0, min(65535, reading + step));
+            data += (char)(reading & 0xFF);
+            data += (char)((reading >> 8) & 0xFF);
+            spill(false);
+        }
+    }
+    else if(kind == "random"){
+        while(written + (long long)data.size() < size){
+            unsigned long long r = rng();
+            for(int i = 0; i < 8; i++)
+                data += (char)((r >> (8 * i)) & 0xFF);
+            spill(false);
+        }
+    }
+    else if(kind == "constant"){
+        while(written + (long long)data.size() < size){
+            data.assign(1 << 20, '\0');
+            spill(false);
+        }
+    }
+    spill(true);
+}
+
+//
+// generateCorpus
+// Same corpus, returned as a string.
+//
+string generateCorpus(string kind, long long size, unsigned seed) {
+    ostringstream out;
+    generateCorpus(kind, size, seed, out);
+    return out.str();
+}
+
+//
+// writeCorpusFile
+// Writes the corpus to dir/kind_size.bin, reusing the file when a previous
+// run already generated it with the right size. Returns the path.
+//
+string writeCorpusFile(string dir, string kind, long long size, unsigned seed) {
+    string path = dir + "/" + kind + "_" + formatSize(size) + "_" + to_string(seed) + ".bin";
+    ifstream existing(path, ios::binary | ios::ate);
+    if(existing && (long long)existing.tellg() == size)
+        return path;
+
+    ofstream output(path, ios::binary);
+    generateCorpus(kind, size, seed, output);
+    return path;
+}
+
+//
+// fileSize
+// Returns the size of the file in bytes, or -1 if it cannot be opened.
+//
+long long fileSize(string path) {
+    ifstream file(path, ios::binary | ios::ate);
+    if(!file)
+        return -1;
+    return file.tellg();
+}
+
+//
+// sameContents
+// Returns true when both files exist and hold identical bytes. Compares a
+// megabyte at a time.
+//
+bool sameContents(string pathA, string pathB) {
+    ifstream a(pathA, ios::binary), b(pathB, ios::binary);
+    if(!a || !b)
+        return false;
+    string bufferA(1 << 20, '\0'), bufferB(1 << 20, '\0');
+    while(a && b){
+        a.read(&bufferA[0], bufferA.size());
+        b.read(&bufferB[0], bufferB.size());
+        if(a.gcount() != b.gcount() || bufferA.compare(0, a.gcount(), bufferB, 0, b.gcount()) != 0)
+            return false;
+    }
+    return !a && !b;
+}
+
+//
+// runBenchmark
+// Runs each stage of the pipeline once on the file at path, timing every
+// stage on its own, and checks the decoded output against the input. When
+// perf is given, hardware counters are also sampled around every stage.
+//
+BenchResult runBenchmark(string kind, string path, PerfCounters* perf = nullptr) {
+    BenchResult result;
+    result.corpus = kind;
+    result.size = fileSize(path);
+    double megabytes = result.size / (1024.0 * 1024.0);
+
+    auto record = [&](string stage, double seconds) {
+        result.stages.push_back({stage, seconds, seconds > 0 ? megabytes / seconds : 0});
+        if(perf != nullptr){
+            perf->stop();
+            for(int e = 0; e < NUM_PERF_EVENTS; e++)
+                result.stages.back().perf[e] = perf->value((PerfEvent)e);
+        }
+    };
+
+    // each stage is also recorded as a trace span when --trace is on
+    hashmapF frequencyMap;
+    {
+        TraceSpan span("buildFrequencyMap");
+        if(perf != nullptr)
+            perf->start();
+        auto start = chrono::steady_clock::now();
+        buildFrequencyMap(path, true, frequencyMap);
+        record("buildFrequencyMap", secondsSince(start));
+    }
+
+    HuffmanNode* encodingTree;
+    {
+        TraceSpan span("buildEncodingTree");
+        if(perf != nullptr)
+            perf->start();
+        auto start = chrono::steady_clock::now();
+        encodingTree = buildEncodingTree(frequencyMap);
+        record("buildEncodingTree", secondsSince(start));
+    }
+
+    hashmapE encodingMap;
+    {
+        TraceSpan span("buildEncodingMap");
+        if(perf != nullptr)
+            perf->start();
+        auto start = chrono::steady_clock::now();
+        encodingMap = buildEncodingMap(encodingTree);
+        record("buildEncodingMap", secondsSince(start));
+    }
+
+    // the frequency header is not part of the encode stage; encodeStream and
+    // decodeStream are what encode() and decode() run, minus their test strings
+    string huffPath = path + ".huf";
+    {
+        ifstream input(path);
+        ofbitstream output(huffPath);
+        output << frequencyMap;
+        TraceSpan span("encode");
+        if(perf != nullptr)
+            perf->start();
+        auto start = chrono::steady_clock::now();
+        encodeStream(input, encodingMap, output);
+        output.close();
+        record("encode", secondsSince(start));
+    }
+
+    string uncPath = path + ".unc";
+    {
+        ifbitstream input(huffPath);
+        hashmapF dump;
+        input >> dump;
+        ofstream output(uncPath);
+        TraceSpan span("decode");
+        if(perf != nullptr)
+            perf->start();
+        auto start = chrono::steady_clock::now();
+        decodeStream(input, encodingTree, output);
+        output.close();
+        record("decode", secondsSince(start));
+    }
+    freeTree(encodingTree);
+
+    result.compressedSize = fileSize(huffPath);
+    result.ratio = result.size > 0 ? (double)result.compressedSize / result.size : 0;
+    result.roundTrip = sameContents(path, uncPath);
+    result.peakRssKb = peakRssKb();
+    remove(huffPath.c_str());
+    remove(uncPath.c_str());
+    return result;
+}
+
+//
+// cpuModel
+// Returns the CPU model name from /proc/cpuinfo, or "unknown".
+//
+string cpuModel() {
+    ifstream cpuinfo("/proc/cpuinfo");
+    string line;
+    while(getline(cpuinfo, line)){
+        if(line.rfind("model name", 0) == 0){
+            size_t pos = line.find(':');
+            if(pos != string::npos && pos + 2 <= line.size())
+                return line.substr(pos + 2);
+        }
+    }
+    return "unknown";
+}
+
+//
+// _perfJson
+// Hardware counter fields for one stage (empty when none were measured):
+// the raw counts, IPC, and each miss counter per input byte.
+//
+string _perfJson(StageTiming &stage, long long size) {
+    stringstream json;
+    for(int e = 0; e < NUM_PERF_EVENTS; e++)
+        if(stage.perf[e] >= 0)
+            json << ", \"" << PERF_EVENT_NAMES[e] << "\": " << stage.perf[e];
+    long long cycles = stage.perf[PERF_EV_CYCLES];
+    long long instructions = stage.perf[PERF_EV_INSTRUCTIONS];
+    if(cycles > 0 && instructions >= 0)
+        json << ", \"ipc\": " << (double)instructions / cycles;
+    for(int e = PERF_EV_BRANCH_MISSES; e < NUM_PERF_EVENTS; e++)
+        if(stage.perf[e] >= 0 && size > 0)
+            json << ", \"" << PERF_EVENT_NAMES[e] << "_per_byte\": " << (double)stage.perf[e] / size;
+    return json.str();
+}
+
+//
+// benchResultsToJson
+// Serializes a whole run of results as a JSON document.
+//
+string benchResultsToJson(vector<BenchResult> &results) {
+    stringstream json;
+    json << "{\n  \"cpu\": \"" << jsonEscape(cpuModel()) << "\",\n  \"results\": [";
+    for(size_t i = 0; i < results.size(); i++){
+        BenchResult &r = results[i];
+        json << (i > 0 ? "," : "") << "\n    {\"corpus\": \"" << r.corpus << "\""
+             << ", \"size\": " << r.size
+             << ", \"compressed_size\": " << r.compressedSize
+             << ", \"ratio\": " << r.ratio
+             << ", \"peak_rss_kb\": " << r.peakRssKb
+             << ", \"round_trip\": " << (r.roundTrip ? "true" : "false")
+             << ", \"reps\": " << r.reps
+             << ",\n     \"stages\": {";
+        for(size_t j = 0; j < r.stages.size(); j++){
+            json << (j > 0 ? ", " : "") << "\"" << r.stages[j].stage << "\": {\"seconds\": "
+                 << r.stages[j].seconds << ", \"mbps\": " << r.stages[j].mbps
+                 << ", \"ci_mbps\": " << r.stages[j].ciMbps << _perfJson(r.stages[j], r.size) << "}";
+        }
+        json << "}}";
+    }
+    json << "\n  ]\n}\n";
+    return json.str();
+}
+
+//
+// tCritical95
+// Two sided 95% critical value of Student's t distribution for the given
+// degrees of freedom (normal approximation past 30).
+//
+double tCritical95(int df) {
+    static const double table[] = {0, 12.706, 4.303, 3.182, 2.776, 2.571, 2.447,
+        2.365, 2.306, 2.262, 2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120,
+        2.110, 2.101, 2.093, 2.086, 2.080, 2.074, 2.069, 2.064, 2.060, 2.056,
+        2.052, 2.048, 2.045, 2.042};
+    if(df <= 0)
+        return 0;
+    return df <= 30 ? table[df] : 1.960;
+}
+
+//
+// summarizeRuns
+// Folds repeated runs of the same benchmark into one result whose stage
+// throughput is the mean over the runs, with a 95% confidence interval.
+//
+BenchResult summarizeRuns(vector<BenchResult> &runs) {
+    BenchResult summary = runs.back();
+    summary.reps = runs.size();
+    for(BenchResult &run : runs)
+        summary.roundTrip = summary.roundTrip && run.roundTrip;
+
+    for(size_t s = 0; s < summary.stages.size(); s++){
+        double sumMbps = 0, sumSeconds = 0;
+        for(BenchResult &run : runs){
+            sumMbps += run.stages[s].mbps;
+            sumSeconds += run.stages[s].seconds;
+        }
+        double mean = sumMbps / runs.size();
+        double variance = 0;
+        for(BenchResult &run : runs)
+            variance += (run.stages[s].mbps - mean) * (run.stages[s].mbps - mean);
+        int n = runs.size();
+        double stddev = n > 1 ? sqrt(variance / (n - 1)) : 0;
+
+        summary.stages[s].mbps = mean;
+        summary.stages[s].seconds = sumSeconds / runs.size();
+        summary.stages[s].ciMbps = n > 1 ? tCritical95(n - 1) * stddev / sqrt(n) : 0;
+
+        for(int e = 0; e < NUM_PERF_EVENTS; e++){
+            long long total = 0;
+            for(BenchResult &run : runs)
+                total += run.stages[s].perf[e];
+            summary.stages[s].perf[e] = summary.stages[s].perf[e] < 0 ? -1 : total / n;
+        }
+    }
+    return summary;
+}
+
+//
+// JsonValue
+// Just enough of a JSON reader to load the baseline files this harness
+// writes: objects, arrays, strings, numbers and booleans.
+//
+struct JsonValue {
+    enum Kind { NUL, BOOL, NUMBER, STRING, ARRAY, OBJECT } kind = NUL;
+    double number = 0;
+    string str;
+    vector<JsonValue> items;
+    vector<pair<string, JsonValue>> fields;
+
+    const JsonValue* find(string key) const {
+        for(auto &field : fields)
+            if(field.first == key)
+                return &field.second;
+        return nullptr;
+    }
+};
+
+//
+// _parseJson
+// Recursive descent helper for parseJson. Throws runtime_error on bad input.
+//
+JsonValue _parseJson(const string &text, size_t &pos) {
+    auto skipSpace = [&]() {
+        while(pos < text.size() && isspace((unsigned char)text[pos]))
+            pos++;
+    };
+    auto parseString = [&]() {
+        string str;
+        pos++; // opening quote
+        while(pos < text.size() && text[pos] != '"'){
+            if(text[pos] == '\\' && pos + 1 < text.size())
+                pos++;
+            str += text[pos++];
+        }
+        if(pos >= text.size())
+            throw runtime_error("unterminated string in JSON");
+        pos++; // closing quote
+        return str;
+    };
+
+    skipSpace();
+    if(pos >= text.size())
+        throw runtime_error("unexpected end of JSON");
+
+    JsonValue value;
+    char ch = text[pos];
+    if(ch == '{' || ch == '['){
+        value.kind = (ch == '{') ? JsonValue::OBJECT : JsonValue::ARRAY;
+        char close = (ch == '{') ? '}' : ']';
+        pos++;
+        skipSpace();
+        while(pos < text.size() && text[pos] != close){
+            if(value.kind == JsonValue::OBJECT){
+                if(text[pos] != '"')
+                    throw runtime_error("expected key in JSON object");
+                string key = parseString();
+                skipSpace();
+                if(pos >= text.size() || text[pos] != ':')
+                    throw runtime_error("expected ':' in JSON object");
+                pos++;
+                value.fields.push_back({key, _parseJson(text, pos)});
+            }
+            else
+                value.items.push_back(_parseJson(text, pos));
+            skipSpace();
+            if(pos < text.size() && text[pos] == ','){
+                pos++;
+                skipSpace();
+            }
+        }
+        if(pos >= text.size())
+            throw runtime_error("unterminated JSON container");
+        pos++;
+    }
+    else if(ch == '"'){
+        value.kind = JsonValue::STRING;
+        value.str = parseString();
+    }
+    else if(text.compare(pos, 4, "true") == 0 || text.compare(pos, 5, "false") == 0){
+        value.kind = JsonValue::BOOL;
+        value.number = (ch == 't');
+        pos += (ch == 't') ? 4 : 5;
+    }
+    else if(text.compare(pos, 4, "null") == 0){
+        pos += 4;
+    }
+    else {
+        size_t used = 0;
+        value.kind = JsonValue::NUMBER;
+        value.number = stod(text.substr(pos, 32), &used);
+        pos += used;
+    }
+    return value;
+}
+
+//
+// parseJson
+// Parses a whole JSON document.
+//
+JsonValue parseJson(const string &text) {
+    size_t pos = 0;
+    return _parseJson(text, pos);
+}
+
+//
+// _baselineKey
+// Key used for one stage of one benchmark inside a baseline file.
+//
+string _baselineKey(BenchResult &result, StageTiming &stage) {
+    return result.corpus + "/" + formatSize(result.size) + "/" + stage.stage;
+}
+
+//
+// saveBaseline
+// Stores the results as the baseline for this machine's CPU model in path.
+// Baselines recorded on other CPU models in the same file are kept.
+//
+void saveBaseline(string path, vector<BenchResult> &results) {
+    string cpu = cpuModel();
+    vector<pair<string, string>> entries; // cpu model -> serialized object
+
+    ifstream existing(path);
+    if(existing){
+        string text((istreambuf_iterator<char>(existing)), {});
+        JsonValue root = parseJson(text);
+        for(auto &machine : root.fields){
+            if(machine.first == cpu)
+                continue;
+            stringstream ss;
+            ss << "{";
+            for(size_t i = 0; i < machine.second.fields.size(); i++){
+                auto &entry = machine.second.fields[i];
+                const JsonValue* mean = entry.second.find("mbps");
+                const JsonValue* ci = entry.second.find("ci_mbps");
+                const JsonValue* reps = entry.second.find("reps");
+                ss << (i > 0 ? "," : "") << "\n    \"" << jsonEscape(entry.first) << "\": {\"mbps\": "
+                   << (mean ? mean->number : 0) << ", \"ci_mbps\": " << (ci ? ci->number : 0)
+                   << ", \"reps\": " << (reps ? reps->number : 1) << "}";
+            }
+            ss << "\n  }";
+            entries.push_back({machine.first, ss.str()});
+        }
+    }
+
+    stringstream ss;
+    ss << "{";
+    bool first = true;
+    for(BenchResult &result : results){
+        for(StageTiming &stage : result.stages){
+            ss << (first ? "" : ",") << "\n    \"" << _baselineKey(result, stage) << "\": {\"mbps\": "
+               << stage.mbps << ", \"ci_mbps\": " << stage.ciMbps << ", \"reps\": " << result.reps << "}";
+            first = false;
+        }
+    }
+    ss << "\n  }";
+    entries.push_back({cpu, ss.str()});
+
+    ofstream output(path);
+    output << "{";
+    for(size_t i = 0; i < entries.size(); i++)
+        output << (i > 0 ? "," : "") << "\n  \"" << jsonEscape(entries[i].first) << "\": " << entries[i].second;
+    output << "\n}\n";
+}
+
+//
+// compareToBaseline
+// Compares the results against the baseline stored for this CPU model and
+// prints a table of every stage to out. A stage regresses when its mean
+// throughput drops by more than both thresholdPct percent of the baseline
+// and the combined width of the two confidence intervals, so noisy stages
+// need a larger drop before they fail. Returns false on any regression, or
+// when the baseline has no entry for this CPU.
+//
+bool compareToBaseline(string path, vector<BenchResult> &results, double thresholdPct, ostream &out) {
+    ifstream input(path);
+    if(!input){
+        out << "Cannot open baseline " << path << endl;
+        return false;
+    }
+    string text((istreambuf_iterator<char>(input)), {});
+    JsonValue root = parseJson(text);
+    string cpu = cpuModel();
+    const JsonValue* machine = root.find(cpu);
+    if(machine == nullptr){
+        out << "Baseline " << path << " has no entry for CPU \"" << cpu << "\"" << endl;
+        out << "Record one with --save-baseline " << path << endl;
+        return false;
+    }
+
+    bool ok = true;
+    char line[256];
+    snprintf(line, sizeof(line), "%-32s %14s %14s %9s  %s\n", "benchmark", "baseline MB/s",
+             "current MB/s", "change", "status");
+    out << line;
+    for(BenchResult &result : results){
+        for(StageTiming &stage : result.stages){
+            string key = _baselineKey(result, stage);
+            const JsonValue* entry = machine->find(key);
+            if(entry == nullptr || entry->find("mbps") == nullptr){
+                snprintf(line, sizeof(line), "%-32s %14s %14.3f %9s  %s\n", key.c_str(), "-",
+                         stage.mbps, "-", "new");
+                out << line;
+                continue;
+            }
+            double baseMbps = entry->find("mbps")->number;
+            const JsonValue* baseCi = entry->find("ci_mbps");
+            double noise = (baseCi ? baseCi->number : 0) + stage.ciMbps;
+            double allowed = max(baseMbps * thresholdPct / 100.0, noise);
+            double change = baseMbps > 0 ? (stage.mbps - baseMbps) / baseMbps * 100.0 : 0;
+            bool regressed = baseMbps - stage.mbps > allowed;
+            ok = ok && !regressed;
+            snprintf(line, sizeof(line), "%-32s %14.3f %14.3f %+8.1f%%  %s\n", key.c_str(), baseMbps,
+                     stage.mbps, change, regressed ? "REGRESSED" : "ok");
+            out << line;
+        }
+    }
+    return ok;
+}
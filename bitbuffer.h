@@ -0,0 +1,178 @@
+//
+// bitbuffer.h
+// In-memory bit writer and reader that work on a 64 bit accumulator and
+// move whole words to and from the byte buffer, instead of touching the
+// stream once per bit like ofbitstream/ifbitstream. Bits are packed least
+// significant bit first within each byte.
+//
+
+#pragma once
+
+#include <cstdint> // for uint64_t
+#include <cstring> // for memcpy
+#include <string>
+using namespace std;
+
+class BitWriter {
+public:
+    //
+    // writeBit
+    // Appends a single bit (0 or 1).
+    //
+    void writeBit(int bit) {
+        writeBits(bit & 1, 1);
+    }
+
+    //
+    // writeBits
+    // Appends the low count bits of bits, lowest bit first. count <= 32.
+    //
+    void writeBits(uint64_t bits, int count) {
+        accum |= (bits & ((1ULL << count) - 1)) << nBits;
+        nBits += count;
+        totalBits += count;
+        if(nBits >= 32){
+            char word[4];
+            for(int i = 0; i < 4; i++)
+                word[i] = (char)((accum >> (8 * i)) & 0xFF);
+            buffer.append(word, 4);
+            accum >>= 32;
+            nBits -= 32;
+        }
+    }
+
+    //
+    // writeCode
+    // Appends a code from an encoding map, given as a string of '0'/'1'.
+    //
+    void writeCode(const string &code) {
+        for(char bit : code)
+            writeBits(bit == '1', 1);
+    }
+
+    //
+    // flush
+    // Pads the pending bits with zeros up to a byte boundary and moves them
+    // into the byte buffer.
+    //
+    void flush() {
+        while(nBits > 0){
+            buffer += (char)(accum & 0xFF);
+            accum >>= 8;
+            nBits = nBits > 8 ? nBits - 8 : 0;
+        }
+        accum = 0;
+        totalBits = (long long)buffer.size() * 8;
+    }
+
+    //
+    // bytes
+    // Returns the flushed bytes. Call flush() first to include pending bits.
+    //
+    const string &bytes() const {
+        return buffer;
+    }
+
+    //
+    // bitCount
+    // Returns the number of bits written so far (including padding from flush).
+    //
+    long long bitCount() const {
+        return totalBits;
+    }
+
+private:
+    string buffer;
+    uint64_t accum = 0;
+    int nBits = 0;
+    long long totalBits = 0;
+};
+
+class BitReader {
+public:
+    BitReader(const char* data, size_t size) : data(data), size(size) {}
+
+    //
+    // readBit
+    // Returns the next bit, or -1 once every bit has been consumed.
+    //
+    int readBit() {
+        if(nBits == 0 && !refill())
+            return -1;
+        int bit = accum & 1;
+        accum >>= 1;
+        nBits--;
+        consumed++;
+        return bit;
+    }
+
+    //
+    // peekBits
+    // Returns the next count bits without consuming them, lowest bit first.
+    // Bits past the end of the buffer read as zero. count <= 56.
+    //
+    uint64_t peekBits(int count) {
+        if(nBits < count)
+            refill();
+        return accum & ((1ULL << count) - 1);
+    }
+
+    //
+    // skipBits
+    // Consumes count bits previously examined with peekBits.
+    //
+    void skipBits(int count) {
+        accum >>= count;
+        nBits = nBits > count ? nBits - count : 0;
+        consumed += count;
+    }
+
+    //
+    // alignToByte
+    // Drops the remaining bits of the current byte.
+    //
+    void alignToByte() {
+        skipBits((8 - consumed % 8) % 8);
+    }
+
+    //
+    // bitsLeft
+    // Returns how many bits remain in the buffer.
+    //
+    long long bitsLeft() const {
+        return (long long)size * 8 - consumed;
+    }
+
+    //
+    // bitPosition
+    // Returns the number of bits consumed so far.
+    //
+    long long bitPosition() const {
+        return consumed;
+    }
+
+private:
+    // loads whole bytes into the accumulator until it holds at least 57 bits
+    bool refill() {
+        if(pos + 8 <= size && nBits <= 0){
+            uint64_t word;
+            memcpy(&word, data + pos, 8); // assumes a little-endian host
+            accum = word;
+            nBits = 64;
+            pos += 8;
+            return true;
+        }
+        while(nBits <= 56 && pos < size){
+            accum |= (uint64_t)(unsigned char)data[pos++] << nBits;
+            nBits += 8;
+        }
+        return nBits > 0;
+    }
+
+    const char* data;
+    size_t size;
+    size_t pos = 0;
+    uint64_t accum = 0;
+    int nBits = 0;
+    long long consumed = 0;
+};
@@ -0,0 +1,1354 @@
+//
+// block.h
+// Block container format. The input is cut into blocks (1 MB by default)
+// and every block is Huffman coded on its own, with its own frequency
+// header, so a damaged block can be detected and reported without walking
+// garbage through decode(). All integers are little-endian.
+//
+//   container := "HUFB" version:u8 checksumKind:u8 (block* trailer)+
+//   block     := 'B' flags:u8 rawSize:u32 checksum:u64 streamBytes:u32
+//                streamCrc:u32 headerCrc:u32 stream+
+//   stream    := frequencyMap ("{k:v, ...}" as written by hashmap's <<)
+//                symbolCount:u32 payloadBytes:u32 payload
+//   trailer   := ('T' | 'U' previousTrailer:u64 totalBlocks:u64
+//                stateLength:u8 checksumState) blockCount:u32
+//                (offset:u64 rawSize:u32)* totalRaw:u64 fileChecksum:u64
+//                trailerCrc:u32 trailerOffset:u64 "HUFE"
+//
+// checksum is crc32c or xxHash64 (per container) of the block's raw bytes,
+// streamCrc and headerCrc are always crc32c and are checked before anything
+// is decoded. fileChecksum is the running checksum over every block's
+// checksum, which catches missing, repeated or reordered blocks once each
+// block has verified its own bytes. The payload is packed least significant
+// bit first (see bitbuffer.h) and always ends with the PSEUDO_EOF code.
+// A block holds one stream, or one per byte plane for the plane-split
+// filters in transform.h, or for column blocks (columns.h) the delimiter
+// byte followed by the row shape stream and one stream per column
+// (streamBytes covers all of them), or for log blocks (logs.h) one stream
+// per log field. Column and log streams are decoded in parallel.
+//
+// appendBlocks adds blocks to an existing container without touching what
+// is already there: the new blocks and a new trailer go after the old
+// footer, so the file stays readable at every point until the new footer
+// is complete. An appended trailer is a 'U' trailer: its index lists only
+// the blocks since previousTrailer, while totalRaw and fileChecksum still
+// cover the whole file, and it carries the block count and the running
+// state of fileChecksum (Checksum::state), so the next append reads only
+// the last trailer and the header of the last block, however many blocks
+// came before. Readers walk blocks in order and check each superseded
+// trailer on the way past it. Readers stop at the last complete trailer:
+// bytes after it are what an interrupted append left behind, reported
+// rather than fatal, and appendBlocks cuts them off (recoverContainer).
+//
+
+#pragma once
+
+#include <algorithm> // for max_element
+#include <atomic>
+#include <exception> // for exception_ptr
+#include <filesystem> // for resize_file
+#include <fstream>
+#include <sstream>
+#include <stdexcept> // for runtime_error
+#include <thread>
+#include <vector>
+#include "bitbuffer.h"
+#include "checksum.h"
+#include "columns.h"
+#include "logs.h"
+#include "scheduler.h"
+#include "tablecache.h"
+#include "trace.h"
+#include "transform.h"
+
+const char CONTAINER_MAGIC[] = "HUFB";
+const char CONTAINER_END_MAGIC[] = "HUFE";
+const int CONTAINER_VERSION = 1;
+const size_t DEFAULT_BLOCK_SIZE = 1 << 20;
+const size_t MAX_BLOCK_SIZE = 1 << 30;
+const int MAX_SYMBOL = 1 << 16; // largest symbol a stream may carry
+const int BLOCK_HEADER_SIZE = 26; // 'B' through headerCrc
+const int CONTAINER_FOOTER_SIZE = 12; // trailerOffset + "HUFE"
+
+struct BlockOptions {
+    size_t blockSize = DEFAULT_BLOCK_SIZE;
+    ChecksumKind checksum = CHECKSUM_CRC32C;
+    bool rle = false; // run-length pre-pass, see transform.h
+    uint8_t filter = 0; // byte filter flags from parseFilter, see transform.h
+    bool autoFilter = false; // pick the filter per block with chooseFilter
+    char delimiter = 0; // nonzero: column blocks for delimited text, see columns.h
+    bool logs = false; // log line blocks, see logs.h
+    int threads = 1; // blocks encoded at once by compressBlocks
+    BufferPool* pool = nullptr; // memory budget shared with other compressions, see scheduler.h
+};
+
+struct Block {
+    uint8_t flags = 0;
+    uint32_t rawSize = 0;
+    uint64_t checksum = 0;
+    string stream;
+    long long offset = 0; // file offset of the 'B' marker
+};
+
+struct BlockIndexEntry {
+    uint64_t offset;
+    uint32_t rawSize;
+};
+
+struct Trailer {
+    uint64_t previous = 0; // 'U' trailers: offset of the trailer before; index starts after it
+    uint64_t totalBlocks = 0; // 'U' trailers: blocks in the whole container
+    string checksumState; // 'U' trailers: running state of checksum
+    vector<BlockIndexEntry> index;
+    uint64_t totalRaw = 0;
+    uint64_t checksum = 0;
+};
+
+struct HuffmanCode {
+    uint64_t bits; // first bit to write is bit 0
+    int length;
+};
+
+//
+// putLE
+// Appends the low bytes of value to out, least significant byte first.
+//
+void putLE(string &out, uint64_t value, int bytes) {
+    for(int i = 0; i < bytes; i++)
+        out += (char)((value >> (8 * i)) & 0xFF);
+}
+
+//
+// getLE
+// Reads a little-endian integer of the given width from p.
+//
+uint64_t getLE(const char* p, int bytes) {
+    uint64_t value = 0;
+    for(int i = 0; i < bytes; i++)
+        value |= (uint64_t)(unsigned char)p[i] << (8 * i);
+    return value;
+}
+
+//
+// readExactly
+// Reads n bytes from in, throwing when the stream ends first.
+//
+string readExactly(istream &in, size_t n, const char* what) {
+    string bytes(n, '\0');
+    in.read(&bytes[0], n);
+    if((size_t)in.gcount() != n)
+        throw runtime_error(string("unexpected end of file reading ") + what);
+    return bytes;
+}
+
+//
+// _buildCodeTable
+// Recursive helper for buildCodeTable.
+//
+void _buildCodeTable(HuffmanNode* node, uint64_t bits, int length, vector<HuffmanCode> &table) {
+    if(node->character != NOT_A_CHAR){
+        table[node->character] = {bits, length};
+        return;
+    }
+    _buildCodeTable(node->zero, bits, length + 1, table);
+    _buildCodeTable(node->one, bits | (1ULL << length), length + 1, table);
+}
+
+//
+// buildCodeTable
+// The bit-packed equivalent of buildEncodingMap: codes indexed by symbol.
+//
+vector<HuffmanCode> buildCodeTable(HuffmanNode* tree, int maxSymbol) {
+    vector<HuffmanCode> table(maxSymbol + 1, {0, 0});
+    _buildCodeTable(tree, 0, 0, table);
+    return table;
+}
+
+//
+// writeCode
+// Appends one code to the writer (codes longer than 32 bits take two writes).
+//
+void writeCode(BitWriter &writer, const HuffmanCode &code) {
+    if(code.length <= 32)
+        writer.writeBits(code.bits, code.length);
+    else {
+        writer.writeBits(code.bits, 32);
+        writer.writeBits(code.bits >> 32, code.length - 32);
+    }
+}
+
+//
+// scaledFrequencyMap
+// The frequency map for counts[symbol]: every symbol with a nonzero count,
+// all scaled down by the same factor so the largest fits hashmap's int
+// counts (none drops to zero), and PSEUDO_EOF once.
+//
+hashmapF scaledFrequencyMap(const vector<long long> &counts) {
+    long long most = counts.empty() ? 0 : *max_element(counts.begin(), counts.end());
+    long long scale = most / (1 << 24) + 1;
+    hashmapF map;
+    for(int symbol = 0; symbol < max((int)counts.size(), PSEUDO_EOF + 1); symbol++){
+        if(symbol == PSEUDO_EOF)
+            map.put(PSEUDO_EOF, 1);
+        else if(symbol < (int)counts.size() && counts[symbol] > 0)
+            map.put(symbol, (int)max(1LL, counts[symbol] / scale));
+    }
+    return map;
+}
+
+//
+// writeStream
+// Huffman codes a sequence of symbols (0 <= symbol <= MAX_SYMBOL, never
+// PSEUDO_EOF or NOT_A_CHAR) with its own frequency map and appends it to
+// out in the stream layout described at the top of this file. Throws
+// runtime_error for any other symbol.
+//
+void writeStream(string &out, const vector<int> &symbols) {
+    hashmapF map;
+    int maxSymbol = PSEUDO_EOF;
+    {
+        TraceSpan span("histogram");
+        vector<int> counts(PSEUDO_EOF, 0);
+        for(int symbol : symbols){
+            if(symbol < 0 || symbol > MAX_SYMBOL || symbol == PSEUDO_EOF || symbol == NOT_A_CHAR)
+                throw runtime_error("symbol " + to_string(symbol) + " cannot be coded in a stream");
+            if(symbol >= (int)counts.size())
+                counts.resize(symbol + 1, 0);
+            counts[symbol]++;
+        }
+        for(int symbol = 0; symbol < (int)counts.size(); symbol++){
+            if(counts[symbol] > 0){
+                map.put(symbol, counts[symbol]);
+                maxSymbol = max(maxSymbol, symbol);
+            }
+        }
+        map.put(PSEUDO_EOF, 1);
+    }
+
+    vector<HuffmanCode> table;
+    {
+        TraceSpan span("tree build");
+        HuffmanNode* root = buildEncodingTree(map);
+        table = buildCodeTable(root, maxSymbol);
+        freeTree(root);
+    }
+
+    BitWriter writer;
+    {
+        TraceSpan span("encode");
+        for(int symbol : symbols)
+            writeCode(writer, table[symbol]);
+        writeCode(writer, table[PSEUDO_EOF]);
+        writer.flush();
+    }
+
+    stringstream header;
+    header << map;
+    out += header.str();
+    putLE(out, symbols.size(), 4);
+    putLE(out, writer.bytes().size(), 4);
+    out += writer.bytes();
+}
+
+//
+// buildDecodeTable
+// Parses a stream's frequency header ("{k:v, ...}") and builds its tree.
+// Throws runtime_error when the header is malformed.
+//
+shared_ptr<const DecodeTable> buildDecodeTable(const string &text) {
+    hashmapF map;
+    stringstream header(text);
+    header >> map;
+    bool hasEof = false;
+    for(int key : map.keys()){
+        if(key < 0 || key > MAX_SYMBOL || key == NOT_A_CHAR || map.get(key) <= 0)
+            throw runtime_error("corrupt stream: bad frequency header entry");
+        hasEof = hasEof || key == PSEUDO_EOF;
+    }
+    if(!hasEof)
+        throw runtime_error("corrupt stream: frequency header has no EOF");
+    return make_shared<const DecodeTable>(buildEncodingTree(map));
+}
+
+//
+// decodeTableFor
+// buildDecodeTable through decodeTableCache and then persistentTableCache,
+// for whichever of them are set.
+//
+shared_ptr<const DecodeTable> decodeTableFor(const string &header) {
+    shared_ptr<const DecodeTable> table;
+    if(decodeTableCache != nullptr && (table = decodeTableCache->find(header)) != nullptr)
+        return table;
+    if(persistentTableCache != nullptr)
+        table = persistentTableCache->find(header);
+    if(table == nullptr){
+        table = buildDecodeTable(header);
+        if(persistentTableCache != nullptr)
+            persistentTableCache->insert(header, *table);
+    }
+    if(decodeTableCache != nullptr)
+        decodeTableCache->insert(header, table);
+    return table;
+}
+
+//
+// readStream
+// Decodes one stream starting at p (which must end before end) and moves p
+// past it. Throws runtime_error when the stream is malformed.
+//
+vector<int> readStream(const char* &p, const char* end) {
+    const char* close = p;
+    while(close < end && *close != '}')
+        close++;
+    if(p >= end || *p != '{' || close >= end)
+        throw runtime_error("corrupt stream: bad frequency header");
+    shared_ptr<const DecodeTable> tree = decodeTableFor(string(p, close + 1));
+    p = close + 1;
+
+    if(end - p < 8)
+        throw runtime_error("corrupt stream: truncated stream header");
+    uint32_t count = getLE(p, 4);
+    uint32_t payloadBytes = getLE(p + 4, 4);
+    p += 8;
+    if((size_t)(end - p) < payloadBytes)
+        throw runtime_error("corrupt stream: truncated payload");
+    if(count > (uint64_t)payloadBytes * 8)
+        throw runtime_error("corrupt stream: symbol count exceeds payload");
+
+    vector<int> symbols;
+    symbols.reserve(count);
+    BitReader reader(p, payloadBytes);
+    HuffmanNode* node = tree->root;
+    while(true){
+        if(node->character != NOT_A_CHAR){
+            if(node->character == PSEUDO_EOF)
+                break;
+            if(symbols.size() == count)
+                throw runtime_error("corrupt stream: more symbols than expected");
+            symbols.push_back(node->character);
+            node = tree->root;
+            continue;
+        }
+        int bit = reader.readBit();
+        if(bit < 0)
+            throw runtime_error("corrupt stream: payload ends before EOF code");
+        node = bit ? node->one : node->zero;
+        if(node == nullptr)
+            throw runtime_error("corrupt stream: code leaves the encoding tree");
+    }
+    if(symbols.size() != count)
+        throw runtime_error("corrupt stream: fewer symbols than expected");
+    p += payloadBytes;
+    return symbols;
+}
+
+//
+// skipStream
+// Moves p past one stream without decoding it. Only the framing is checked;
+// readStream checks the rest.
+//
+void skipStream(const char* &p, const char* end) {
+    const char* close = p;
+    while(close < end && *close != '}')
+        close++;
+    if(end - close < 9)
+        throw runtime_error("corrupt stream: truncated stream header");
+    uint32_t payloadBytes = getLE(close + 5, 4);
+    if((size_t)(end - close - 9) < payloadBytes)
+        throw runtime_error("corrupt stream: truncated payload");
+    p = close + 9 + payloadBytes;
+}
+
+//
+// parallelFor
+// Calls work(i) for every i in [0, count) on up to maxThreads threads (the
+// calling thread is one of them). The first exception thrown by any call
+// is rethrown once every thread has finished.
+//
+template <typename Work>
+void parallelFor(size_t count, size_t maxThreads, Work work) {
+    vector<exception_ptr> errors(count);
+    atomic<size_t> next(0);
+    auto run = [&]() {
+        for(size_t i = next++; i < count; i = next++){
+            try {
+                work(i);
+            }
+            catch(...) {
+                errors[i] = current_exception();
+            }
+        }
+    };
+    vector<thread> workers;
+    for(size_t t = 1; t < min(maxThreads, count); t++)
+        workers.emplace_back([&]() {
+            setTraceThreadName("parallelFor worker");
+            run();
+        });
+    run();
+    for(thread &worker : workers)
+        worker.join();
+    for(exception_ptr &error : errors)
+        if(error)
+            rethrow_exception(error);
+}
+
+//
+// _decodeStreamsParallel
+// Decodes the streams starting at starts[i] (each ending where the next one
+// starts, the last at end) on up to maxThreads threads. Streams whose
+// wanted entry is false are left empty.
+//
+vector<vector<int>> _decodeStreamsParallel(const vector<const char*> &starts, const char* end,
+                                           const vector<bool> &wanted, size_t maxThreads) {
+    vector<vector<int>> streams(starts.size());
+    parallelFor(starts.size(), maxThreads, [&](size_t i) {
+        if(!wanted[i])
+            return;
+        const char* p = starts[i];
+        streams[i] = readStream(p, i + 1 < starts.size() ? starts[i + 1] : end);
+    });
+    return streams;
+}
+
+//
+// _decodeThreads
+// Threads worth using for the streams of one block: starting threads costs
+// more than decoding a small block.
+//
+size_t _decodeThreads(const Block &block) {
+    return block.rawSize < (64 << 10) ? 1 : max(1u, thread::hardware_concurrency());
+}
+
+//
+// _decodeLogs
+// Decodes the field streams of a log block and joins them into lines.
+//
+string _decodeLogs(const Block &block) {
+    const char* p = block.stream.data();
+    const char* end = p + block.stream.size();
+    vector<const char*> starts;
+    for(const char* q = p; q < end; skipStream(q, end))
+        starts.push_back(q);
+    vector<vector<int>> streams = _decodeStreamsParallel(starts, end, vector<bool>(starts.size(), true),
+                                                         _decodeThreads(block));
+    return joinLogLines(streams, block.rawSize);
+}
+
+//
+// _encodeColumns
+// The stream area of a column block: delimiter, shape stream and one
+// stream per column.
+//
+string _encodeColumns(const string &raw, char delimiter) {
+    ColumnSplit split;
+    {
+        TraceSpan span("split columns");
+        split = splitColumns(raw, delimiter);
+    }
+    string stream(1, delimiter);
+    writeStream(stream, split.shape);
+    for(const vector<int> &column : split.columns)
+        writeStream(stream, column);
+    return stream;
+}
+
+//
+// _decodeColumns
+// Inverse of _encodeColumns; see joinColumns for selection.
+//
+string _decodeColumns(const Block &block, const vector<int> &selection) {
+    const char* p = block.stream.data();
+    const char* end = p + block.stream.size();
+    if(p == end)
+        throw runtime_error("corrupt column block: no delimiter");
+    char delimiter = *p++;
+    vector<const char*> starts;
+    for(const char* q = p; q < end; skipStream(q, end))
+        starts.push_back(q);
+    if(starts.empty())
+        throw runtime_error("corrupt column block: no shape stream");
+
+    vector<bool> wanted(starts.size(), selection.empty());
+    wanted[0] = true;
+    for(int j : selection)
+        if((size_t)j + 1 < starts.size())
+            wanted[j + 1] = true;
+    vector<vector<int>> streams = _decodeStreamsParallel(starts, end, wanted, _decodeThreads(block));
+    vector<int> shape = move(streams[0]);
+    streams.erase(streams.begin());
+    return joinColumns(shape, streams, delimiter, selection, block.rawSize);
+}
+
+//
+// _blockRecord
+// Serializes a block header followed by its stream area.
+//
+string _blockRecord(uint8_t flags, size_t rawSize, uint64_t checksum, const string &stream) {
+    string block;
+    block += 'B';
+    block += (char)flags;
+    putLE(block, rawSize, 4);
+    putLE(block, checksum, 8);
+    putLE(block, stream.size(), 4);
+    putLE(block, crc32c(0, stream), 4);
+    putLE(block, crc32c(0, block), 4);
+    block += stream;
+    return block;
+}
+
+//
+// encodeBlock
+// Compresses one block of raw bytes and returns the serialized block.
+//
+string encodeBlock(const string &raw, const BlockOptions &options) {
+    uint64_t checksum;
+    {
+        TraceSpan span("checksum");
+        Checksum sum(options.checksum);
+        sum.update(raw);
+        checksum = sum.value();
+    }
+
+    if(options.delimiter != 0){
+        string stream = _encodeColumns(raw, options.delimiter);
+        return _blockRecord(BLOCK_COLUMNS, raw.size(), checksum, stream);
+    }
+    if(options.logs){
+        vector<vector<int>> fields;
+        {
+            TraceSpan span("split log lines");
+            fields = splitLogLines(raw);
+        }
+        string stream;
+        for(const vector<int> &field : fields)
+            writeStream(stream, field);
+        return _blockRecord(BLOCK_LOGS, raw.size(), checksum, stream);
+    }
+
+    uint8_t flags = options.autoFilter ? chooseFilter(raw) : options.filter;
+    string filtered;
+    if(flags != 0){
+        TraceSpan span("filter");
+        filtered = applyFilter(raw, flags);
+    }
+    const string &bytes = (flags != 0) ? filtered : raw;
+
+    if(options.rle)
+        flags |= BLOCK_RLE;
+
+    // plane-split filters code every byte plane as its own stream
+    string stream;
+    size_t offset = 0;
+    for(size_t size : planeSizes(bytes.size(), flags)){
+        const unsigned char* part = (const unsigned char*)bytes.data() + offset;
+        vector<int> symbols;
+        if(options.rle){
+            TraceSpan span("rle");
+            symbols = rleEncode(string((const char*)part, size));
+        }
+        else
+            symbols.assign(part, part + size);
+        writeStream(stream, symbols);
+        offset += size;
+    }
+
+    return _blockRecord(flags, raw.size(), checksum, stream);
+}
+
+//
+// readBlock
+// Reads the next block from in. Returns false when the next record is a
+// trailer, which is left for readTrailer. The header and stream crcs are
+// checked here, so a block that comes back is safe to decode.
+//
+bool readBlock(istream &in, Block &block) {
+    block.offset = in.tellg();
+    int marker = in.peek();
+    if(marker == 'T' || marker == 'U')
+        return false;
+    in.get();
+    if(marker != 'B')
+        throw runtime_error(marker == EOF ? "container is truncated (no trailer)"
+                                          : "corrupt container: bad block marker");
+
+    string header = "B" + readExactly(in, BLOCK_HEADER_SIZE - 1, "block header");
+    if(crc32c(0, header.data(), BLOCK_HEADER_SIZE - 4) != getLE(&header[22], 4))
+        throw runtime_error("corrupt block header at offset " + to_string(block.offset));
+    block.flags = header[1];
+    block.rawSize = getLE(&header[2], 4);
+    block.checksum = getLE(&header[6], 8);
+    uint32_t streamBytes = getLE(&header[14], 4);
+    if(block.rawSize > MAX_BLOCK_SIZE || streamBytes > 2 * MAX_BLOCK_SIZE)
+        throw runtime_error("corrupt block header at offset " + to_string(block.offset));
+
+    block.stream = readExactly(in, streamBytes, "block");
+    if(crc32c(0, block.stream) != getLE(&header[18], 4))
+        throw runtime_error("corrupt block data at offset " + to_string(block.offset));
+    return true;
+}
+
+//
+// decodeBlock
+// Decodes a block read by readBlock and checks its raw checksum. A column
+// selection (see joinColumns) only applies to column blocks; the projected
+// output cannot be checked against the raw checksum, but the stream crc
+// has already been checked by readBlock.
+//
+string decodeBlock(const Block &block, ChecksumKind kind,
+                   const vector<int> &selection = vector<int>()) {
+    TraceSpan span("decode");
+    const char* p = block.stream.data();
+    if(!selection.empty() && block.flags != BLOCK_COLUMNS)
+        throw runtime_error("column selection needs a container compressed with --csv");
+    if(block.flags == BLOCK_COLUMNS || block.flags == BLOCK_LOGS){
+        string raw = block.flags == BLOCK_LOGS ? _decodeLogs(block) : _decodeColumns(block, selection);
+        if(!selection.empty())
+            return raw;
+        Checksum sum(kind);
+        sum.update(raw);
+        if(raw.size() != block.rawSize || sum.value() != block.checksum)
+            throw runtime_error("checksum mismatch in block at offset " + to_string(block.offset));
+        return raw;
+    }
+    if((block.flags & ~(BLOCK_RLE | BLOCK_FILTER_MASK | BLOCK_STRIDE_MASK)) != 0 ||
+       filterKind(block.flags) > FILTER_FLOAT_SPLIT)
+        throw runtime_error("block at offset " + to_string(block.offset) + " uses unknown flags");
+    const char* end = p + block.stream.size();
+
+    string raw;
+    raw.reserve(block.rawSize);
+    for(size_t size : planeSizes(block.rawSize, block.flags)){
+        vector<int> symbols = readStream(p, end);
+        size_t start = raw.size();
+        if(block.flags & BLOCK_RLE)
+            raw += rleDecode(symbols, size);
+        else {
+            raw.resize(start + symbols.size());
+            for(size_t i = 0; i < symbols.size(); i++){
+                if(symbols[i] > 0xFF)
+                    throw runtime_error("corrupt block: symbol out of range");
+                raw[start + i] = (char)symbols[i];
+            }
+        }
+        if(raw.size() - start != size)
+            throw runtime_error("corrupt block: stream size does not match the block");
+    }
+    if(filterKind(block.flags) != FILTER_NONE)
+        raw = undoFilter(raw, block.flags);
+    Checksum sum(kind);
+    sum.update(raw);
+    if(raw.size() != block.rawSize || sum.value() != block.checksum)
+        throw runtime_error("checksum mismatch in block at offset " + to_string(block.offset));
+    return raw;
+}
+
+//
+// writeContainerHeader
+// Writes the magic, version and checksum kind that open every container.
+//
+void writeContainerHeader(ostream &out, ChecksumKind kind) {
+    out.write(CONTAINER_MAGIC, 4);
+    out.put((char)CONTAINER_VERSION);
+    out.put((char)kind);
+}
+
+//
+// readContainerHeader
+// Checks the magic and version and returns the container's checksum kind.
+//
+ChecksumKind readContainerHeader(istream &in) {
+    string header(6, '\0');
+    in.read(&header[0], 6);
+    if(in.gcount() != 6 || header.compare(0, 4, CONTAINER_MAGIC) != 0)
+        throw runtime_error("not a block container");
+    if(header[4] != CONTAINER_VERSION)
+        throw runtime_error("unsupported container version " + to_string((int)header[4]));
+    if(header[5] != CHECKSUM_CRC32C && header[5] != CHECKSUM_XXHASH64)
+        throw runtime_error("unknown checksum kind in container header");
+    return (ChecksumKind)header[5];
+}
+
+//
+// isBlockContainer
+// True when the file at path starts with the container magic.
+//
+bool isBlockContainer(string path) {
+    ifstream in(path, ios::binary);
+    char magic[4];
+    in.read(magic, 4);
+    return in.gcount() == 4 && string(magic, 4) == CONTAINER_MAGIC;
+}
+
+//
+// addBlockChecksum / fileChecksum
+// The whole-file checksum: a running checksum over each block's checksum.
+//
+void addBlockChecksum(Checksum &fileSum, uint64_t blockChecksum) {
+    string bytes;
+    putLE(bytes, blockChecksum, 8);
+    fileSum.update(bytes);
+}
+
+uint64_t fileChecksum(const vector<uint64_t> &blockChecksums, ChecksumKind kind) {
+    Checksum sum(kind);
+    for(uint64_t checksum : blockChecksums)
+        addBlockChecksum(sum, checksum);
+    return sum.value();
+}
+
+//
+// encodeTrailer
+// Serializes the trailer (starting with its 'T' or 'U' marker) and footer,
+// for a trailer that will be written at file offset trailerOffset.
+//
+string encodeTrailer(const Trailer &trailer, uint64_t trailerOffset) {
+    string out = trailer.previous != 0 ? "U" : "T";
+    if(trailer.previous != 0){
+        putLE(out, trailer.previous, 8);
+        putLE(out, trailer.totalBlocks, 8);
+        out += (char)trailer.checksumState.size();
+        out += trailer.checksumState;
+    }
+    putLE(out, trailer.index.size(), 4);
+    for(const BlockIndexEntry &entry : trailer.index){
+        putLE(out, entry.offset, 8);
+        putLE(out, entry.rawSize, 4);
+    }
+    putLE(out, trailer.totalRaw, 8);
+    putLE(out, trailer.checksum, 8);
+    putLE(out, crc32c(0, out), 4);
+    putLE(out, trailerOffset, 8);
+    out += CONTAINER_END_MAGIC;
+    return out;
+}
+
+//
+// readTrailer
+// Reads the trailer at trailerOffset, where in is positioned (readBlock
+// stops in front of it). A trailer that would run past end (the file
+// size, when the caller knows it) is corrupt without being read.
+//
+Trailer readTrailer(istream &in, uint64_t trailerOffset, uint64_t end = UINT64_MAX) {
+    string bytes = readExactly(in, 1, "trailer");
+    if(bytes[0] != 'T' && bytes[0] != 'U')
+        throw runtime_error("corrupt trailer");
+    Trailer trailer;
+    if(bytes[0] == 'U'){
+        bytes += readExactly(in, 17, "trailer");
+        trailer.previous = getLE(&bytes[1], 8);
+        trailer.totalBlocks = getLE(&bytes[9], 8);
+        if(trailer.previous < 6 || trailer.previous >= trailerOffset)
+            throw runtime_error("corrupt trailer");
+        trailer.checksumState = readExactly(in, (unsigned char)bytes[17], "trailer");
+        bytes += trailer.checksumState;
+    }
+    size_t start = bytes.size() + 4;
+    bytes += readExactly(in, 4, "trailer");
+    uint32_t count = getLE(&bytes[start - 4], 4);
+    if(count > (1u << 28) ||
+       trailerOffset + start + (uint64_t)count * 12 + 20 + CONTAINER_FOOTER_SIZE > end)
+        throw runtime_error("corrupt trailer");
+    bytes += readExactly(in, (size_t)count * 12 + 20 + CONTAINER_FOOTER_SIZE, "trailer");
+
+    size_t crcPos = start + (size_t)count * 12 + 16;
+    if(crc32c(0, bytes.data(), crcPos) != getLE(&bytes[crcPos], 4) ||
+       getLE(&bytes[crcPos + 4], 8) != trailerOffset ||
+       bytes.compare(crcPos + 12, 4, CONTAINER_END_MAGIC) != 0)
+        throw runtime_error("corrupt trailer");
+
+    for(uint32_t i = 0; i < count; i++){
+        const char* entry = &bytes[start + i * 12];
+        trailer.index.push_back({getLE(entry, 8), (uint32_t)getLE(entry + 8, 4)});
+    }
+    trailer.totalRaw = getLE(&bytes[crcPos - 16], 8);
+    trailer.checksum = getLE(&bytes[crcPos - 8], 8);
+    return trailer;
+}
+
+//
+// verifyTrailer
+// Checks the trailer against the blocks actually read from the container:
+// blocks are the ones since the trailer before ('U') or since the start
+// ('T'), and totalBlocks, totalRaw and fileSum cover the whole file.
+//
+void verifyTrailer(const Trailer &trailer, const vector<BlockIndexEntry> &blocks, uint64_t totalBlocks,
+                   uint64_t totalRaw, const Checksum &fileSum) {
+    bool sameIndex = trailer.index.size() == blocks.size();
+    for(size_t i = 0; sameIndex && i < trailer.index.size(); i++)
+        sameIndex = trailer.index[i].offset == blocks[i].offset &&
+                    trailer.index[i].rawSize == blocks[i].rawSize;
+    if(!sameIndex || trailer.totalRaw != totalRaw ||
+       (trailer.previous != 0 && trailer.totalBlocks != totalBlocks))
+        throw runtime_error("trailer index does not match the blocks in the container");
+    if(trailer.checksum != fileSum.value() ||
+       (trailer.previous != 0 && trailer.checksumState != fileSum.state()))
+        throw runtime_error("whole-file checksum mismatch");
+}
+
+//
+// readBlockInput
+// Reads the raw bytes of the next block into raw, which is left empty at
+// the end of the input. Column and log blocks end after their last
+// complete row or line when there is one; the rest is kept in carry for
+// the next call.
+//
+void readBlockInput(istream &input, const BlockOptions &options, string &carry, string &raw) {
+    TraceSpan span("read");
+    raw.resize(options.blockSize);
+    size_t got = carry.size();
+    copy(carry.begin(), carry.end(), raw.begin());
+    input.read(&raw[got], options.blockSize - got);
+    got += input.gcount();
+    carry.clear();
+    if(got == options.blockSize && (options.delimiter != 0 || options.logs)){
+        size_t end = 0;
+        if(options.delimiter != 0)
+            end = lastRowEnd(raw.data(), got, options.delimiter);
+        else if(raw.find_last_of('\n') != string::npos)
+            end = raw.find_last_of('\n') + 1;
+        if(end > 0){
+            carry = raw.substr(end);
+            got = end;
+        }
+    }
+    raw.resize(got);
+}
+
+//
+// encodeBlocks
+// Encodes several blocks at once, one per thread.
+//
+vector<string> encodeBlocks(const vector<string> &raws, const BlockOptions &options) {
+    vector<string> blocks(raws.size());
+    parallelFor(raws.size(), raws.size(), [&](size_t i) {
+        blocks[i] = encodeBlock(raws[i], options);
+    });
+    return blocks;
+}
+
+//
+// blockWorkingSet
+// Peak memory for reading and encoding one block: the raw bytes, their
+// int symbols, the coded stream and the record around it. Measured at
+// about 6.5 times the block size, 10 times for column blocks.
+//
+size_t blockWorkingSet(const BlockOptions &options) {
+    return options.blockSize * (options.delimiter != 0 ? 10 : 7);
+}
+
+//
+// _writeBlocks
+// Compresses the rest of input into blocks written at output's position,
+// adding them to trailer and checksums, and calls afterBatch() after each
+// batch of blocks is written. Returns the raw bytes consumed.
+//
+template <typename AfterBatch>
+long long _writeBlocks(istream &input, ostream &output, const BlockOptions &options,
+                       Trailer &trailer, vector<uint64_t> &checksums, AfterBatch afterBatch) {
+    long long total = 0;
+    string carry;
+    vector<string> raws;
+    bool started = false;
+    while(true){
+        raws.resize(max(1, options.threads));
+        // with a pool, only the first block of the batch waits for memory
+        size_t batch = raws.size();
+        PoolLease lease;
+        if(options.pool != nullptr){
+            size_t need = blockWorkingSet(options);
+            lease.pool = options.pool;
+            lease.bytes = options.pool->acquire(need, started);
+            for(batch = 1; batch < raws.size() && options.pool->tryAcquire(need); batch++)
+                lease.bytes += need;
+        }
+        started = true;
+        size_t count = 0;
+        while(count < batch){
+            readBlockInput(input, options, carry, raws[count]);
+            if(raws[count].empty())
+                break;
+            count++;
+        }
+        if(count == 0)
+            return total;
+        raws.resize(count);
+        vector<string> blocks = encodeBlocks(raws, options);
+
+        TraceSpan span("write");
+        for(size_t i = 0; i < count; i++){
+            trailer.index.push_back({(uint64_t)output.tellp(), (uint32_t)raws[i].size()});
+            trailer.totalRaw += raws[i].size();
+            total += raws[i].size();
+            checksums.push_back(getLE(&blocks[i][6], 8));
+            output.write(blocks[i].data(), blocks[i].size());
+            if(options.pool != nullptr)
+                string().swap(raws[i]);
+        }
+        afterBatch();
+    }
+}
+
+long long _writeBlocks(istream &input, ostream &output, const BlockOptions &options,
+                       Trailer &trailer, vector<uint64_t> &checksums) {
+    return _writeBlocks(input, output, options, trailer, checksums, []() {});
+}
+
+//
+// compressBlocks
+// Compresses the file inPath into a block container at outPath and returns
+// the container size in bytes. With options.threads > 1 that many blocks
+// are read and encoded at once, so memory use grows with the thread count.
+// Throws runtime_error on I/O failure.
+//
+long long compressBlocks(string inPath, string outPath, BlockOptions options = BlockOptions()) {
+    if(options.blockSize == 0 || options.blockSize > MAX_BLOCK_SIZE)
+        throw runtime_error("block size must be between 1 byte and 1 GB");
+    ifstream input(inPath, ios::binary);
+    if(!input)
+        throw runtime_error("cannot open " + inPath);
+    ofstream output(outPath, ios::binary | ios::trunc);
+    if(!output)
+        throw runtime_error("cannot create " + outPath);
+
+    writeContainerHeader(output, options.checksum);
+    Trailer trailer;
+    vector<uint64_t> checksums;
+    _writeBlocks(input, output, options, trailer, checksums);
+    trailer.checksum = fileChecksum(checksums, options.checksum);
+    output << encodeTrailer(trailer, output.tellp());
+    long long size = output.tellp();
+    output.close();
+    if(!output)
+        throw runtime_error("error writing " + outPath);
+    return size;
+}
+
+//
+// ContainerState
+// What appendBlocks needs to know about an existing container.
+//
+struct ContainerState {
+    ChecksumKind kind = CHECKSUM_CRC32C;
+    Trailer trailer; // the last trailer; a 'U' index lists only its own blocks
+    uint64_t trailerOffset = 0; // of the last trailer
+    uint64_t blocks = 0; // in the whole container
+    Checksum fileSum; // running fileChecksum over every block
+    uint64_t lastChecksum = 0; // of the last block, when there is one
+    uint64_t end = 0; // file offset just past the footer
+};
+
+//
+// _blockChecksumAt
+// The raw checksum from the header of the block at offset, which must
+// have rawSize bytes.
+//
+uint64_t _blockChecksumAt(istream &input, uint64_t offset, uint32_t rawSize) {
+    input.seekg(offset);
+    string header = readExactly(input, BLOCK_HEADER_SIZE, "block header");
+    if(header[0] != 'B' || crc32c(0, header.data(), BLOCK_HEADER_SIZE - 4) != getLE(&header[22], 4) ||
+       getLE(&header[2], 4) != rawSize)
+        throw runtime_error("corrupt block header at offset " + to_string(offset));
+    return getLE(&header[6], 8);
+}
+
+//
+// readContainerState
+// Reads the header, the trailer the footer points to and the header of
+// the last block, without decoding anything. A 'U' trailer carries the
+// running file checksum; so does a 'T' trailer of a crc32c container,
+// where the state is the value. Only the first append to an xxHash64
+// container made by compressBlocks reads every block header to rebuild it.
+//
+ContainerState readContainerState(istream &input) {
+    ContainerState state;
+    input.seekg(0);
+    state.kind = readContainerHeader(input);
+    state.fileSum = Checksum(state.kind);
+    input.seekg(0, ios::end);
+    state.end = input.tellg();
+    if(state.end < 6 + 1 + CONTAINER_FOOTER_SIZE)
+        throw runtime_error("container is truncated (no trailer)");
+    input.seekg(state.end - CONTAINER_FOOTER_SIZE);
+    string footer = readExactly(input, CONTAINER_FOOTER_SIZE, "footer");
+    uint64_t trailerOffset = getLE(&footer[0], 8);
+    if(footer.compare(8, 4, CONTAINER_END_MAGIC) != 0 || trailerOffset < 6 ||
+       trailerOffset >= state.end)
+        throw runtime_error("container has no valid footer (interrupted append?)");
+    input.seekg(trailerOffset);
+    state.trailerOffset = trailerOffset;
+    state.trailer = readTrailer(input, trailerOffset, state.end);
+
+    if(state.trailer.previous != 0){
+        state.blocks = state.trailer.totalBlocks;
+        state.fileSum.restore(state.trailer.checksumState);
+    }
+    else {
+        state.blocks = state.trailer.index.size();
+        if(state.kind == CHECKSUM_CRC32C){
+            string crc;
+            putLE(crc, state.trailer.checksum, 4);
+            state.fileSum.restore(crc);
+        }
+        else
+            for(const BlockIndexEntry &entry : state.trailer.index)
+                addBlockChecksum(state.fileSum, _blockChecksumAt(input, entry.offset, entry.rawSize));
+    }
+    if(state.fileSum.value() != state.trailer.checksum)
+        throw runtime_error("whole-file checksum mismatch");
+    if(!state.trailer.index.empty()){
+        const BlockIndexEntry &last = state.trailer.index.back();
+        state.lastChecksum = _blockChecksumAt(input, last.offset, last.rawSize);
+    }
+    return state;
+}
+
+//
+// _footerAt
+// True when a complete trailer ends at end: the footer in front of end
+// points at a trailer that reads back whole and ends exactly there.
+//
+bool _footerAt(istream &input, uint64_t end) {
+    if(end < 6 + 1 + CONTAINER_FOOTER_SIZE)
+        return false;
+    input.clear();
+    input.seekg(end - CONTAINER_FOOTER_SIZE);
+    string footer(CONTAINER_FOOTER_SIZE, '\0');
+    input.read(&footer[0], CONTAINER_FOOTER_SIZE);
+    uint64_t trailerOffset = getLE(&footer[0], 8);
+    if(input.gcount() != CONTAINER_FOOTER_SIZE || footer.compare(8, 4, CONTAINER_END_MAGIC) != 0 ||
+       trailerOffset < 6 || trailerOffset >= end)
+        return false;
+    try {
+        input.seekg(trailerOffset);
+        readTrailer(input, trailerOffset, end);
+        return (uint64_t)input.tellg() == end;
+    }
+    catch(exception &) {
+        input.clear();
+        return false;
+    }
+}
+
+//
+// containerEnd
+// The offset just past the last complete trailer of the container in
+// input: the file size for a whole container, less after an interrupted
+// append, 0 when there is no complete trailer at all. Searches back from
+// the end of the file for the footer magic, so it reads only the bytes
+// the interrupted append left behind.
+//
+uint64_t containerEnd(istream &input) {
+    input.clear();
+    input.seekg(0, ios::end);
+    uint64_t size = input.tellg();
+    // the usual case: the footer at the end points at a trailer
+    input.seekg(max<uint64_t>(size, CONTAINER_FOOTER_SIZE) - CONTAINER_FOOTER_SIZE);
+    string footer(CONTAINER_FOOTER_SIZE, '\0');
+    input.read(&footer[0], CONTAINER_FOOTER_SIZE);
+    uint64_t trailerOffset = getLE(&footer[0], 8);
+    if(size >= 6 + 1 + CONTAINER_FOOTER_SIZE && footer.compare(8, 4, CONTAINER_END_MAGIC) == 0 &&
+       trailerOffset >= 6 && trailerOffset < size){
+        input.seekg(trailerOffset);
+        int marker = input.get();
+        if(marker == 'T' || marker == 'U'){
+            input.clear();
+            return size;
+        }
+    }
+
+    const size_t window = 64 * 1024;
+    uint64_t high = size;
+    while(high > 6){
+        uint64_t low = high > window ? high - window : 0;
+        // overlap by three bytes so a magic across windows is found
+        uint64_t readEnd = min(size, high + 3);
+        string bytes(readEnd - low, '\0');
+        input.clear();
+        input.seekg(low);
+        input.read(&bytes[0], bytes.size());
+        for(size_t at = bytes.rfind(CONTAINER_END_MAGIC); at != string::npos;
+            at = at > 0 ? bytes.rfind(CONTAINER_END_MAGIC, at - 1) : string::npos)
+            if(low + at < high && _footerAt(input, low + at + 4)){
+                input.clear();
+                return low + at + 4;
+            }
+        high = low;
+    }
+    input.clear();
+    return 0;
+}
+
+//
+// hasValidFooter
+// True when the container at path ends with a footer pointing at a
+// trailer, which is false after an interrupted append.
+//
+bool hasValidFooter(string path) {
+    ifstream input(path, ios::binary);
+    input.seekg(0, ios::end);
+    long long size = input.tellg();
+    if(!input || size < 6 + 1 + CONTAINER_FOOTER_SIZE)
+        return false;
+    input.seekg(size - CONTAINER_FOOTER_SIZE);
+    string footer(CONTAINER_FOOTER_SIZE, '\0');
+    input.read(&footer[0], CONTAINER_FOOTER_SIZE);
+    uint64_t trailerOffset = getLE(&footer[0], 8);
+    if(footer.compare(8, 4, CONTAINER_END_MAGIC) != 0 || trailerOffset < 6 ||
+       trailerOffset >= (uint64_t)size)
+        return false;
+    input.seekg(trailerOffset);
+    int marker = input.get();
+    return marker == 'T' || marker == 'U';
+}
+
+//
+// recoverContainer
+// Cuts off anything after the last complete trailer of the container at
+// path (see containerEnd), which is what an interrupted append leaves
+// behind. Returns the number of bytes removed.
+//
+long long recoverContainer(string path) {
+    uint64_t good = 0, size = 0;
+    {
+        ifstream input(path, ios::binary);
+        if(!input)
+            throw runtime_error("cannot open " + path);
+        readContainerHeader(input);
+        input.seekg(0, ios::end);
+        size = input.tellg();
+        good = containerEnd(input);
+    }
+    if(good == 0)
+        throw runtime_error(path + " has no complete trailer to recover to");
+    if(good < size)
+        filesystem::resize_file(path, good);
+    return size - good;
+}
+
+//
+// checkAppendSource
+// Makes sure source can continue the container described by state: it is
+// at least as long as what the container holds, and its bytes under the
+// last block match that block's checksum, which catches a source that was
+// rotated or rewritten.
+//
+void checkAppendSource(istream &input, const ContainerState &state, string source, string path) {
+    input.seekg(0, ios::end);
+    uint64_t sourceSize = input.tellg();
+    if(sourceSize < state.trailer.totalRaw)
+        throw runtime_error(source + " is shorter than the data already in " + path);
+    if(!state.trailer.index.empty()){
+        uint32_t lastSize = state.trailer.index.back().rawSize;
+        input.seekg(state.trailer.totalRaw - lastSize);
+        Checksum sum(state.kind);
+        sum.update(readExactly(input, lastSize, "source"));
+        if(sum.value() != state.lastChecksum)
+            throw runtime_error(source + " does not start with the data already in " + path);
+    }
+}
+
+//
+// appendToContainer
+// Compresses the rest of input into new blocks at state.end, followed by
+// a 'U' trailer for them, and updates state to match. Returns the number
+// of raw bytes appended; nothing is written when input is empty.
+//
+long long appendToContainer(istream &input, ostream &container, ContainerState &state,
+                            const BlockOptions &options) {
+    Trailer next;
+    next.previous = state.trailerOffset;
+    next.totalRaw = state.trailer.totalRaw;
+    vector<uint64_t> checksums;
+    container.seekp(state.end);
+    long long appended = _writeBlocks(input, container, options, next, checksums);
+    if(appended == 0)
+        return 0;
+    for(uint64_t checksum : checksums)
+        addBlockChecksum(state.fileSum, checksum);
+    state.blocks += checksums.size();
+    state.lastChecksum = checksums.back();
+    next.totalBlocks = state.blocks;
+    next.checksumState = state.fileSum.state();
+    next.checksum = state.fileSum.value();
+    state.trailerOffset = container.tellp();
+    container << encodeTrailer(next, state.trailerOffset);
+    state.end = container.tellp();
+    state.trailer = next;
+    return appended;
+}
+
+//
+// appendBlocks
+// Compresses source from the first byte the container at path does not
+// hold yet (its total raw size) and appends those blocks, so a growing
+// file costs only its new tail. source is checked with checkAppendSource
+// first. Returns the number of raw bytes appended. The options' checksum
+// kind is ignored in favour of the container's.
+//
+long long appendBlocks(string path, string source, BlockOptions options = BlockOptions()) {
+    if(options.blockSize == 0 || options.blockSize > MAX_BLOCK_SIZE)
+        throw runtime_error("block size must be between 1 byte and 1 GB");
+    fstream container(path, ios::binary | ios::in | ios::out);
+    if(!container)
+        throw runtime_error("cannot open " + path);
+    ContainerState state = readContainerState(container);
+    options.checksum = state.kind;
+
+    ifstream input(source, ios::binary);
+    if(!input)
+        throw runtime_error("cannot open " + source);
+    checkAppendSource(input, state, source, path);
+    input.seekg(state.trailer.totalRaw);
+
+    long long appended = appendToContainer(input, container, state, options);
+    if(appended == 0)
+        return 0;
+    container.close();
+    if(!container)
+        throw runtime_error("error writing " + path);
+    return appended;
+}
+
+//
+// ContainerReader
+// Reads a container from input one block at a time, decoding and
+// verifying every block and every trailer on the way. Reading ends at the
+// last complete trailer (see containerEnd); the bytes after it, left by an
+// interrupted append, are not read but counted in interruptedBytes().
+//
+class ContainerReader {
+public:
+    ContainerReader(istream &input, const vector<int> &selection = vector<int>())
+        : input(input), selection(selection) {
+        kind = readContainerHeader(input);
+        fileSum = Checksum(kind);
+        input.seekg(0, ios::end);
+        uint64_t size = input.tellg();
+        limit = containerEnd(input);
+        // with no complete trailer at all the walk reports what is wrong
+        if(limit == 0)
+            limit = size;
+        interrupted = size - limit;
+        input.seekg(6);
+    }
+
+    //
+    // next
+    // Decodes the next block into raw. Returns false once the last
+    // trailer has been read and checked.
+    //
+    bool next(string &raw) {
+        while(!finished){
+            if(readBlock(input, block)){
+                raw = decodeBlock(block, kind, selection);
+                blocks.push_back({(uint64_t)block.offset, block.rawSize});
+                addBlockChecksum(fileSum, block.checksum);
+                totalBlocks++;
+                total += block.rawSize;
+                return true;
+            }
+            // every trailer must match the blocks before it; the last one ends the file
+            Trailer trailer = readTrailer(input, block.offset, limit);
+            if(trailer.previous != 0 && trailer.previous != lastTrailer)
+                throw runtime_error("trailer does not follow the one before it");
+            if(trailer.previous == 0 && lastTrailer != 0)
+                throw runtime_error("corrupt container: a second full trailer");
+            verifyTrailer(trailer, blocks, totalBlocks, total, fileSum);
+            lastTrailer = block.offset;
+            blocks.clear();
+            finished = (uint64_t)input.tellg() >= limit;
+        }
+        return false;
+    }
+
+    //
+    // totalRaw
+    // Raw bytes decoded so far.
+    //
+    long long totalRaw() const {
+        return total;
+    }
+
+    //
+    // interruptedBytes
+    // Bytes after the last complete trailer, which are ignored.
+    //
+    long long interruptedBytes() const {
+        return interrupted;
+    }
+
+private:
+    istream &input;
+    vector<int> selection;
+    ChecksumKind kind;
+    vector<BlockIndexEntry> blocks; // since the last trailer
+    Checksum fileSum;
+    uint64_t totalBlocks = 0;
+    long long total = 0;
+    uint64_t limit = 0;
+    long long interrupted = 0;
+    uint64_t lastTrailer = 0;
+    Block block;
+    bool finished = false;
+};
+
+//
+// _readContainer
+// Reads a whole container from input with ContainerReader and hands each
+// block's raw bytes to sink. Returns the total number of raw bytes, and
+// sets interrupted (when given) to the bytes an interrupted append left
+// after the last complete trailer.
+//
+template <typename Sink>
+long long _readContainer(istream &input, Sink sink, const vector<int> &selection = vector<int>(),
+                         long long* interrupted = nullptr) {
+    ContainerReader reader(input, selection);
+    string raw;
+    while(reader.next(raw))
+        sink(raw);
+    if(interrupted != nullptr)
+        *interrupted = reader.interruptedBytes();
+    return reader.totalRaw();
+}
+
+//
+// decompressBlocks
+// Decompresses the block container inPath into outPath, verifying every
+// checksum along the way. Returns the number of bytes written. A column
+// selection writes only those columns of a --csv container. interrupted
+// is set as by _readContainer.
+//
+long long decompressBlocks(string inPath, string outPath,
+                           const vector<int> &selection = vector<int>(), long long* interrupted = nullptr) {
+    ifstream input(inPath, ios::binary);
+    if(!input)
+        throw runtime_error("cannot open " + inPath);
+    ofstream output(outPath, ios::binary | ios::trunc);
+    if(!output)
+        throw runtime_error("cannot create " + outPath);
+
+    long long total = 0;
+    _readContainer(input, [&](const string &raw) {
+        output.write(raw.data(), raw.size());
+        total += raw.size();
+    }, selection, interrupted);
+    output.close();
+    if(!output)
+        throw runtime_error("error writing " + outPath);
+    return total;
+}
+
+//
+// verifyBlocks
+// Decodes the block container at path and checks every block checksum,
+// symbol count and the trailer without writing anything. Returns the
+// number of raw bytes it would decompress to; throws on any problem.
+// interrupted is set as by _readContainer.
+//
+long long verifyBlocks(string path, long long* interrupted = nullptr) {
+    ifstream input(path, ios::binary);
+    if(!input)
+        throw runtime_error("cannot open " + path);
+    return _readContainer(input, [](const string &) {}, vector<int>(), interrupted);
+}
@@ -0,0 +1,233 @@
+//
+// checkpoint.h
+// Checkpoints for long block compressions (huf compress --checkpoint), so
+// a job that is killed or crashes resumes where it was instead of starting
+// again. Every interval seconds, between batches of blocks, the output is
+// fsynced and then a checkpoint is written next to it (out.huf.ckpt, via a
+// temporary file, fsync and rename):
+//
+//   checkpoint := "HUFK" version:u8 inputSize:u64 inputMtime:u64
+//                 optionsLength:u16 options outputLength:u64 blockCount:u32
+//                 (offset:u64 rawSize:u32 checksum:u64)* crc:u32
+//
+// options is blockOptionsKey(), and with inputSize and inputMtime it ties
+// the checkpoint to one input and one set of options. outputLength is
+// where the blocks it lists end; the input offset to resume from is the
+// sum of their raw sizes. Resuming truncates the output to outputLength,
+// re-reads the input from there and carries on. Block boundaries only
+// depend on where reading starts, so the finished container is byte for
+// byte what an uninterrupted run writes. The checkpoint is removed once
+// the trailer is written.
+//
+
+#pragma once
+
+#include <chrono>
+#include <cstdio> // for rename
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "block.h"
+#include "incremental.h" // for blockOptionsKey and fileMtime
+using namespace std;
+
+const char CHECKPOINT_MAGIC[] = "HUFK";
+const int CHECKPOINT_VERSION = 1;
+
+struct Checkpoint {
+    uint64_t inputSize = 0;
+    long long inputMtime = 0;
+    string options;
+    uint64_t outputLength = 0;
+    Trailer trailer; // index and totalRaw of the blocks written so far
+    vector<uint64_t> checksums;
+};
+
+//
+// syncFile
+// Flushes path's data to stable storage.
+//
+void syncFile(const string &path) {
+#ifdef __linux__
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    bool synced = fd >= 0 && fsync(fd) == 0;
+    if(fd >= 0)
+        close(fd);
+    if(!synced)
+        throw runtime_error("cannot sync " + path);
+#endif
+}
+
+//
+// encodeCheckpoint
+// Serializes a checkpoint in the layout at the top of this file.
+//
+string encodeCheckpoint(const Checkpoint &checkpoint) {
+    string out = CHECKPOINT_MAGIC;
+    out += (char)CHECKPOINT_VERSION;
+    putLE(out, checkpoint.inputSize, 8);
+    putLE(out, checkpoint.inputMtime, 8);
+    putLE(out, checkpoint.options.size(), 2);
+    out += checkpoint.options;
+    putLE(out, checkpoint.outputLength, 8);
+    putLE(out, checkpoint.trailer.index.size(), 4);
+    for(size_t i = 0; i < checkpoint.trailer.index.size(); i++){
+        putLE(out, checkpoint.trailer.index[i].offset, 8);
+        putLE(out, checkpoint.trailer.index[i].rawSize, 4);
+        putLE(out, checkpoint.checksums[i], 8);
+    }
+    putLE(out, crc32c(0, out), 4);
+    return out;
+}
+
+//
+// loadCheckpoint
+// Reads the checkpoint at path. Returns false when there is none or it is
+// damaged (for example cut short by a crash), which means starting over.
+//
+bool loadCheckpoint(const string &path, Checkpoint &checkpoint) {
+    ifstream input(path, ios::binary);
+    if(!input)
+        return false;
+    string bytes((istreambuf_iterator<char>(input)), istreambuf_iterator<char>());
+    if(bytes.size() < 39 || bytes.compare(0, 4, CHECKPOINT_MAGIC) != 0 ||
+       bytes[4] != CHECKPOINT_VERSION ||
+       crc32c(0, bytes.data(), bytes.size() - 4) != getLE(&bytes[bytes.size() - 4], 4))
+        return false;
+    const char* p = &bytes[5];
+    checkpoint.inputSize = getLE(p, 8);
+    checkpoint.inputMtime = getLE(p + 8, 8);
+    size_t optionsLength = getLE(p + 16, 2);
+    p += 18;
+    if(bytes.size() < 39 + optionsLength ||
+       bytes.size() != 39 + optionsLength + (size_t)getLE(p + optionsLength + 8, 4) * 20)
+        return false;
+    checkpoint.options.assign(p, optionsLength);
+    p += optionsLength;
+    checkpoint.outputLength = getLE(p, 8);
+    uint32_t count = getLE(p + 8, 4);
+    p += 12;
+    checkpoint.trailer = Trailer();
+    checkpoint.checksums.clear();
+    for(uint32_t i = 0; i < count; i++, p += 20){
+        checkpoint.trailer.index.push_back({getLE(p, 8), (uint32_t)getLE(p + 8, 4)});
+        checkpoint.trailer.totalRaw += checkpoint.trailer.index.back().rawSize;
+        checkpoint.checksums.push_back(getLE(p + 12, 8));
+    }
+    return true;
+}
+
+//
+// saveCheckpoint
+// Writes the checkpoint so that path always holds a complete one.
+//
+void saveCheckpoint(const string &path, const Checkpoint &checkpoint) {
+    string temporary = path + ".tmp";
+    {
+        ofstream output(temporary, ios::binary | ios::trunc);
+        output << encodeCheckpoint(checkpoint);
+        output.close();
+        if(!output)
+            throw runtime_error("error writing " + temporary);
+    }
+    syncFile(temporary);
+    if(rename(temporary.c_str(), path.c_str()) != 0)
+        throw runtime_error("cannot replace " + path);
+}
+
+//
+// _resumable
+// True when checkpoint belongs to this input and these options and the
+// output still holds every block it lists.
+//
+bool _resumable(const Checkpoint &checkpoint, const Checkpoint &current, const string &outPath) {
+    error_code error;
+    uint64_t outputSize = filesystem::file_size(outPath, error);
+    if(error || checkpoint.inputSize != current.inputSize ||
+       checkpoint.inputMtime != current.inputMtime || checkpoint.options != current.options ||
+       outputSize < checkpoint.outputLength || checkpoint.trailer.totalRaw > current.inputSize)
+        return false;
+    if(checkpoint.trailer.index.empty())
+        return true;
+    // the last block's header must be where the checkpoint says
+    ifstream output(outPath, ios::binary);
+    output.seekg(checkpoint.trailer.index.back().offset);
+    string header(BLOCK_HEADER_SIZE, '\0');
+    output.read(&header[0], BLOCK_HEADER_SIZE);
+    return output.gcount() == BLOCK_HEADER_SIZE && header[0] == 'B' &&
+           crc32c(0, header.data(), BLOCK_HEADER_SIZE - 4) == getLE(&header[22], 4) &&
+           getLE(&header[6], 8) == checkpoint.checksums.back() &&
+           checkpoint.trailer.index.back().offset + BLOCK_HEADER_SIZE +
+                   getLE(&header[14], 4) == checkpoint.outputLength;
+}
+
+//
+// compressWithCheckpoints
+// compressBlocks with a checkpoint every interval seconds (0: after every
+// batch of blocks). When outPath already has a matching checkpoint the
+// compression resumes from it and resumedAt is set to the input offset it
+// resumed from (otherwise 0). Returns the container size in bytes.
+//
+long long compressWithCheckpoints(string inPath, string outPath, BlockOptions options,
+                                  double interval, uint64_t &resumedAt) {
+    if(options.blockSize == 0 || options.blockSize > MAX_BLOCK_SIZE)
+        throw runtime_error("block size must be between 1 byte and 1 GB");
+    string checkpointPath = outPath + ".ckpt";
+    Checkpoint current;
+    current.inputSize = filesystem::file_size(inPath);
+    current.inputMtime = fileMtime(inPath);
+    current.options = blockOptionsKey(options);
+    ifstream input(inPath, ios::binary);
+    if(!input)
+        throw runtime_error("cannot open " + inPath);
+
+    Checkpoint saved;
+    resumedAt = 0;
+    if(loadCheckpoint(checkpointPath, saved) && _resumable(saved, current, outPath)){
+        filesystem::resize_file(outPath, saved.outputLength);
+        current.trailer = saved.trailer;
+        current.checksums = saved.checksums;
+        resumedAt = saved.trailer.totalRaw;
+    }
+    fstream output;
+    if(resumedAt > 0){
+        output.open(outPath, ios::binary | ios::in | ios::out);
+        output.seekp(0, ios::end);
+    }
+    else {
+        output.open(outPath, ios::binary | ios::out | ios::trunc);
+        writeContainerHeader(output, options.checksum);
+    }
+    if(!output)
+        throw runtime_error("cannot create " + outPath);
+    input.seekg(resumedAt);
+
+    auto last = chrono::steady_clock::now();
+    _writeBlocks(input, output, options, current.trailer, current.checksums, [&]() {
+        auto now = chrono::steady_clock::now();
+        if(chrono::duration<double>(now - last).count() < interval)
+            return;
+        // the blocks must be on disk before a checkpoint points at them
+        current.outputLength = output.tellp();
+        output.flush();
+        if(!output)
+            throw runtime_error("error writing " + outPath);
+        syncFile(outPath);
+        saveCheckpoint(checkpointPath, current);
+        last = now;
+    });
+    current.trailer.checksum = fileChecksum(current.checksums, options.checksum);
+    output << encodeTrailer(current.trailer, output.tellp());
+    long long size = output.tellp();
+    output.close();
+    if(!output)
+        throw runtime_error("error writing " + outPath);
+    syncFile(outPath);
+    filesystem::remove(checkpointPath);
+    return size;
+}
@@ -0,0 +1,381 @@
+//
+// checksum.h
+// Checksums for the block container (block.h):
+//   crc32c   - CRC-32C (Castagnoli). Uses the SSE4.2 crc32 instruction when
+//              the CPU has it and slicing-by-8 tables otherwise.
+//   XXHash64 - streaming xxHash64, selectable per container.
+// Both can be fed incrementally, so a whole-file value is just the running
+// value over every block, and both can save and restore their running
+// state, so a whole-file value can be carried on without the data before.
+//   murmur3_128 - 128-bit MurmurHash3 (x64 variant), the chunk identity
+//                 used for deduplication in archives (archive.h).
+//
+
+#pragma once
+
+#include <cstdint>
+#include <cstring> // for memcpy
+#include <stdexcept>
+#include <string>
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h> // for _mm_crc32_u64 / _mm_crc32_u8
+#endif
+using namespace std;
+
+enum ChecksumKind {
+    CHECKSUM_CRC32C = 0,
+    CHECKSUM_XXHASH64 = 1
+};
+
+//
+// _crc32cTables
+// The eight 256 entry tables for slicing-by-8, built on first use.
+//
+const uint32_t (&_crc32cTables())[8][256] {
+    static uint32_t tables[8][256];
+    static bool built = [] {
+        for(uint32_t i = 0; i < 256; i++){
+            uint32_t crc = i;
+            for(int bit = 0; bit < 8; bit++)
+                crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+            tables[0][i] = crc;
+        }
+        for(uint32_t i = 0; i < 256; i++)
+            for(int t = 1; t < 8; t++)
+                tables[t][i] = (tables[t - 1][i] >> 8) ^ tables[0][tables[t - 1][i] & 0xFF];
+        return true;
+    }();
+    (void)built;
+    return tables;
+}
+
+//
+// _crc32cSoftware
+// Slicing-by-8 CRC-32C over n bytes, on the raw (non inverted) register.
+//
+uint32_t _crc32cSoftware(uint32_t crc, const unsigned char* p, size_t n) {
+    const uint32_t (&t)[8][256] = _crc32cTables();
+    while(n >= 8){
+        uint64_t word;
+        memcpy(&word, p, 8); // assumes a little-endian host
+        word ^= crc;
+        crc = t[7][word & 0xFF] ^ t[6][(word >> 8) & 0xFF] ^
+              t[5][(word >> 16) & 0xFF] ^ t[4][(word >> 24) & 0xFF] ^
+              t[3][(word >> 32) & 0xFF] ^ t[2][(word >> 40) & 0xFF] ^
+              t[1][(word >> 48) & 0xFF] ^ t[0][word >> 56];
+        p += 8;
+        n -= 8;
+    }
+    while(n-- > 0)
+        crc = t[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+//
+// _crc32cHardware
+// CRC-32C with the SSE4.2 crc32 instruction, eight bytes at a time.
+//
+__attribute__((target("sse4.2")))
+uint32_t _crc32cHardware(uint32_t crc, const unsigned char* p, size_t n) {
+    uint64_t c = crc;
+    while(n >= 8){
+        uint64_t word;
+        memcpy(&word, p, 8);
+        c = _mm_crc32_u64(c, word);
+        p += 8;
+        n -= 8;
+    }
+    while(n-- > 0)
+        c = _mm_crc32_u8((uint32_t)c, *p++);
+    return (uint32_t)c;
+}
+#endif
+
+//
+// crc32c
+// Extends crc (the result of a previous call, or 0 to start) with n bytes.
+//
+uint32_t crc32c(uint32_t crc, const void* data, size_t n) {
+    const unsigned char* p = (const unsigned char*)data;
+#if defined(__x86_64__)
+    static const bool hardware = __builtin_cpu_supports("sse4.2");
+    if(hardware)
+        return ~_crc32cHardware(~crc, p, n);
+#endif
+    return ~_crc32cSoftware(~crc, p, n);
+}
+
+uint32_t crc32c(uint32_t crc, const string &data) {
+    return crc32c(crc, data.data(), data.size());
+}
+
+//
+// XXHash64
+// Streaming xxHash64. update() may be called any number of times.
+//
+class XXHash64 {
+public:
+    XXHash64(uint64_t seed = 0) : seed(seed) {
+        acc[0] = seed + P1 + P2;
+        acc[1] = seed + P2;
+        acc[2] = seed;
+        acc[3] = seed - P1;
+    }
+
+    void update(const void* data, size_t n) {
+        const unsigned char* p = (const unsigned char*)data;
+        total += n;
+        if(buffered + n < 32){
+            memcpy(buffer + buffered, p, n);
+            buffered += n;
+            return;
+        }
+        if(buffered > 0){
+            size_t fill = 32 - buffered;
+            memcpy(buffer + buffered, p, fill);
+            _consumeStripe(buffer);
+            p += fill;
+            n -= fill;
+            buffered = 0;
+        }
+        while(n >= 32){
+            _consumeStripe(p);
+            p += 32;
+            n -= 32;
+        }
+        memcpy(buffer, p, n);
+        buffered = n;
+    }
+
+    uint64_t digest() const {
+        uint64_t h;
+        if(total >= 32){
+            h = _rotl(acc[0], 1) + _rotl(acc[1], 7) + _rotl(acc[2], 12) + _rotl(acc[3], 18);
+            for(int i = 0; i < 4; i++){
+                h ^= _round(0, acc[i]);
+                h = h * P1 + P4;
+            }
+        }
+        else
+            h = seed + P5;
+        h += total;
+
+        const unsigned char* p = buffer;
+        size_t n = buffered;
+        while(n >= 8){
+            h ^= _round(0, _read64(p));
+            h = _rotl(h, 27) * P1 + P4;
+            p += 8;
+            n -= 8;
+        }
+        if(n >= 4){
+            uint32_t word;
+            memcpy(&word, p, 4);
+            h ^= (uint64_t)word * P1;
+            h = _rotl(h, 23) * P2 + P3;
+            p += 4;
+            n -= 4;
+        }
+        while(n-- > 0){
+            h ^= (*p++) * P5;
+            h = _rotl(h, 11) * P1;
+        }
+        h ^= h >> 33;
+        h *= P2;
+        h ^= h >> 29;
+        h *= P3;
+        h ^= h >> 32;
+        return h;
+    }
+
+    //
+    // state / restore
+    // The running state as bytes (seed, accumulators, length and the
+    // buffered tail, host byte order), and back. restore throws
+    // runtime_error on bytes that are not a state.
+    //
+    string state() const {
+        string out((const char*)&seed, 8);
+        out.append((const char*)acc, 32);
+        out.append((const char*)&total, 8);
+        out += (char)buffered;
+        out.append((const char*)buffer, buffered);
+        return out;
+    }
+
+    void restore(const string &bytes) {
+        if(bytes.size() < 49 || (unsigned char)bytes[48] >= 32 || bytes.size() != 49u + (unsigned char)bytes[48])
+            throw runtime_error("bad xxHash64 state");
+        memcpy(&seed, &bytes[0], 8);
+        memcpy(acc, &bytes[8], 32);
+        memcpy(&total, &bytes[40], 8);
+        buffered = (unsigned char)bytes[48];
+        memcpy(buffer, &bytes[49], buffered);
+    }
+
+private:
+    static const uint64_t P1 = 11400714785074694791ULL;
+    static const uint64_t P2 = 14029467366897019727ULL;
+    static const uint64_t P3 = 1609587929392839161ULL;
+    static const uint64_t P4 = 9650029242287828579ULL;
+    static const uint64_t P5 = 2870177450012600261ULL;
+
+    static uint64_t _rotl(uint64_t x, int r) {
+        return (x << r) | (x >> (64 - r));
+    }
+    static uint64_t _read64(const unsigned char* p) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        return word;
+    }
+    static uint64_t _round(uint64_t acc, uint64_t input) {
+        acc += input * P2;
+        return _rotl(acc, 31) * P1;
+    }
+    void _consumeStripe(const unsigned char* p) {
+        for(int i = 0; i < 4; i++)
+            acc[i] = _round(acc[i], _read64(p + 8 * i));
+    }
+
+    uint64_t seed;
+    uint64_t acc[4];
+    unsigned char buffer[32];
+    size_t buffered = 0;
+    uint64_t total = 0;
+};
+
+//
+// Checksum
+// Running checksum of either kind, so callers do not care which one a
+// container uses.
+//
+class Checksum {
+public:
+    Checksum(ChecksumKind kind = CHECKSUM_CRC32C) : kind(kind) {}
+
+    void update(const void* data, size_t n) {
+        if(kind == CHECKSUM_CRC32C)
+            crc = crc32c(crc, data, n);
+        else
+            xxhash.update(data, n);
+    }
+
+    void update(const string &data) {
+        update(data.data(), data.size());
+    }
+
+    uint64_t value() const {
+        return kind == CHECKSUM_CRC32C ? crc : xxhash.digest();
+    }
+
+    //
+    // state / restore
+    // The running state as bytes, and back; for crc32c that is just the
+    // value so far.
+    //
+    string state() const {
+        return kind == CHECKSUM_CRC32C ? string((const char*)&crc, 4) : xxhash.state();
+    }
+
+    void restore(const string &bytes) {
+        if(kind == CHECKSUM_XXHASH64)
+            xxhash.restore(bytes);
+        else if(bytes.size() == 4)
+            memcpy(&crc, bytes.data(), 4);
+        else
+            throw runtime_error("bad crc32c state");
+    }
+
+private:
+    ChecksumKind kind;
+    uint32_t crc = 0;
+    XXHash64 xxhash;
+};
+
+struct Hash128 {
+    uint64_t low = 0;
+    uint64_t high = 0;
+
+    bool operator==(const Hash128 &other) const {
+        return low == other.low && high == other.high;
+    }
+};
+
+// for unordered_map keys; the hash is already uniformly distributed
+struct Hash128Hasher {
+    size_t operator()(const Hash128 &hash) const {
+        return (size_t)hash.low;
+    }
+};
+
+//
+// _fmix64
+// MurmurHash3's final avalanche step.
+//
+uint64_t _fmix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+//
+// murmur3_128
+// MurmurHash3_x64_128 of n bytes.
+//
+Hash128 murmur3_128(const void* data, size_t n, uint32_t seed = 0) {
+    const unsigned char* p = (const unsigned char*)data;
+    const uint64_t c1 = 0x87c37b91114253d5ULL, c2 = 0x4cf5ad432745937fULL;
+    uint64_t h1 = seed, h2 = seed;
+    auto rotl = [](uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+
+    size_t blocks = n / 16;
+    for(size_t i = 0; i < blocks; i++){
+        uint64_t k1, k2;
+        memcpy(&k1, p + i * 16, 8); // assumes a little-endian host
+        memcpy(&k2, p + i * 16 + 8, 8);
+        k1 *= c1; k1 = rotl(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = rotl(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+        k2 *= c2; k2 = rotl(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = rotl(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    const unsigned char* tail = p + blocks * 16;
+    uint64_t k1 = 0, k2 = 0;
+    switch(n & 15){
+        case 15: k2 ^= (uint64_t)tail[14] << 48; // fall through
+        case 14: k2 ^= (uint64_t)tail[13] << 40; // fall through
+        case 13: k2 ^= (uint64_t)tail[12] << 32; // fall through
+        case 12: k2 ^= (uint64_t)tail[11] << 24; // fall through
+        case 11: k2 ^= (uint64_t)tail[10] << 16; // fall through
+        case 10: k2 ^= (uint64_t)tail[9] << 8; // fall through
+        case 9: k2 ^= (uint64_t)tail[8];
+            k2 *= c2; k2 = rotl(k2, 33); k2 *= c1; h2 ^= k2;
+            // fall through
+        case 8: k1 ^= (uint64_t)tail[7] << 56; // fall through
+        case 7: k1 ^= (uint64_t)tail[6] << 48; // fall through
+        case 6: k1 ^= (uint64_t)tail[5] << 40; // fall through
+        case 5: k1 ^= (uint64_t)tail[4] << 32; // fall through
+        case 4: k1 ^= (uint64_t)tail[3] << 24; // fall through
+        case 3: k1 ^= (uint64_t)tail[2] << 16; // fall through
+        case 2: k1 ^= (uint64_t)tail[1] << 8; // fall through
+        case 1: k1 ^= (uint64_t)tail[0];
+            k1 *= c1; k1 = rotl(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+
+    h1 ^= n;
+    h2 ^= n;
+    h1 += h2;
+    h2 += h1;
+    h1 = _fmix64(h1);
+    h2 = _fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+    Hash128 hash;
+    hash.low = h1;
+    hash.high = h2;
+    return hash;
+}
@@ -0,0 +1,300 @@
+//
+// columns.h
+// Column transposition for delimited text (CSV, TSV). One histogram over
+// a whole CSV block mixes columns with very different statistics (ids,
+// timestamps, enums, free text), so a column block (BLOCK_COLUMNS) is cut
+// into rows and fields and coded as:
+//   shape    - the field count of every row as LEB128 bytes, with a 0 after
+//              the last row when that row has no newline
+//   column j - the j-th field of every row that has one, each followed by
+//              CSV_FIELD_END
+// CSV_FIELD_END sits above the RLE digit symbols in the int alphabet, so a
+// field boundary gets its own Huffman code instead of sharing one with the
+// delimiter byte. Delimiters and newlines inside double quotes are part of
+// the field. Nothing here assumes the input is well formed: any bytes go
+// through unchanged, they just compress less well.
+//
+
+#pragma once
+
+#include <algorithm> // for find
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#if defined(__x86_64__)
+#include <immintrin.h> // for the AVX2 delimiter scanner
+#endif
+#include "transform.h" // for RLE_DIGIT_BASE
+using namespace std;
+
+// block flags
+const uint8_t BLOCK_COLUMNS = 0x40;
+
+const int CSV_FIELD_END = RLE_DIGIT_BASE + 256;
+// fields past this many in a row stay in the last column, delimiters and all
+const size_t MAX_COLUMNS = 4096;
+
+struct ColumnSplit {
+    vector<int> shape;
+    vector<vector<int>> columns;
+};
+
+//
+// parseDelimiter
+// Accepts a single character or one of the names "comma", "tab", "pipe"
+// and "semicolon".
+//
+char parseDelimiter(string spec) {
+    if(spec == "comma")
+        return ',';
+    if(spec == "tab" || spec == "\\t")
+        return '\t';
+    if(spec == "pipe")
+        return '|';
+    if(spec == "semicolon")
+        return ';';
+    if(spec.size() != 1 || spec[0] == '\n' || spec[0] == '"')
+        throw runtime_error("delimiter must be a single character other than newline or quote");
+    return spec[0];
+}
+
+//
+// _nextSpecialPortable
+// Index of the first delimiter, newline or quote in p[0..n), or n.
+//
+size_t _nextSpecialPortable(const unsigned char* p, size_t n, unsigned char delimiter) {
+    for(size_t i = 0; i < n; i++)
+        if(p[i] == delimiter || p[i] == '\n' || p[i] == '"')
+            return i;
+    return n;
+}
+
+#if defined(__x86_64__)
+//
+// _nextSpecialAvx2
+// Same as _nextSpecialPortable, checking 32 bytes per step.
+//
+__attribute__((target("avx2")))
+size_t _nextSpecialAvx2(const unsigned char* p, size_t n, unsigned char delimiter) {
+    __m256i delim = _mm256_set1_epi8((char)delimiter);
+    __m256i newline = _mm256_set1_epi8('\n');
+    __m256i quote = _mm256_set1_epi8('"');
+    size_t i = 0;
+    while(i + 32 <= n){
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)(p + i));
+        __m256i hits = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, delim),
+                                       _mm256_or_si256(_mm256_cmpeq_epi8(chunk, newline),
+                                                       _mm256_cmpeq_epi8(chunk, quote)));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(hits);
+        if(mask != 0)
+            return i + __builtin_ctz(mask);
+        i += 32;
+    }
+    return i + _nextSpecialPortable(p + i, n - i, delimiter);
+}
+#endif
+
+//
+// nextSpecial
+// Index of the first delimiter, newline or quote in data[0..n), or n.
+//
+size_t nextSpecial(const char* data, size_t n, char delimiter) {
+    const unsigned char* p = (const unsigned char*)data;
+#if defined(__x86_64__)
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    if(avx2)
+        return _nextSpecialAvx2(p, n, (unsigned char)delimiter);
+#endif
+    return _nextSpecialPortable(p, n, (unsigned char)delimiter);
+}
+
+//
+// _putVarint
+// Appends value as LEB128 byte symbols.
+//
+void _putVarint(vector<int> &out, size_t value) {
+    while(value >= 0x80){
+        out.push_back((int)(value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    out.push_back((int)value);
+}
+
+//
+// splitColumns
+// Cuts raw into rows and fields and transposes them into the shape and
+// column symbol streams described at the top of this file.
+//
+ColumnSplit splitColumns(const string &raw, char delimiter) {
+    ColumnSplit split;
+    const char* data = raw.data();
+    size_t n = raw.size();
+    size_t fieldStart = 0;
+    size_t field = 0;
+    bool quoted = false;
+
+    auto endField = [&](size_t end) {
+        if(field == split.columns.size())
+            split.columns.emplace_back();
+        vector<int> &column = split.columns[field];
+        column.insert(column.end(), (const unsigned char*)data + fieldStart,
+                      (const unsigned char*)data + end);
+        column.push_back(CSV_FIELD_END);
+        field++;
+    };
+
+    size_t i = 0;
+    while(i < n){
+        size_t k = i + nextSpecial(data + i, n - i, delimiter);
+        if(k == n)
+            break;
+        char ch = data[k];
+        if(ch == '"')
+            quoted = !quoted;
+        else if(!quoted && ch == delimiter && field + 1 < MAX_COLUMNS){
+            endField(k);
+            fieldStart = k + 1;
+        }
+        else if(!quoted && ch == '\n'){
+            endField(k);
+            _putVarint(split.shape, field);
+            field = 0;
+            fieldStart = k + 1;
+        }
+        i = k + 1;
+    }
+    if(fieldStart < n || field > 0){
+        endField(n);
+        _putVarint(split.shape, field);
+        split.shape.push_back(0);
+    }
+    return split;
+}
+
+//
+// lastRowEnd
+// Offset just past the last newline outside quotes in raw[0..n), or 0 when
+// there is none. Cutting blocks there keeps every row, and the quote state,
+// inside one block.
+//
+size_t lastRowEnd(const char* data, size_t n, char delimiter) {
+    size_t end = 0;
+    bool quoted = false;
+    size_t i = 0;
+    while(i < n){
+        size_t k = i + nextSpecial(data + i, n - i, delimiter);
+        if(k == n)
+            break;
+        if(data[k] == '"')
+            quoted = !quoted;
+        else if(!quoted && data[k] == '\n')
+            end = k + 1;
+        i = k + 1;
+    }
+    return end;
+}
+
+//
+// joinColumns
+// Inverse of splitColumns. With a non-empty selection only those columns
+// are written, in the order given, joined by the delimiter, and only those
+// columns need to have been decoded.
+//
+string joinColumns(const vector<int> &shape, const vector<vector<int>> &columns,
+                   char delimiter, const vector<int> &selection, size_t sizeHint) {
+    string raw;
+    raw.reserve(sizeHint);
+    vector<size_t> cursor(columns.size(), 0);
+    vector<size_t> start(columns.size(), 0);
+    // every selected column is read once per row, even if listed twice
+    vector<int> unique;
+    for(int j : selection)
+        if((size_t)j < columns.size() && find(unique.begin(), unique.end(), j) == unique.end())
+            unique.push_back(j);
+
+    auto copyField = [&](size_t j, bool write) {
+        const vector<int> &column = columns[j];
+        size_t &i = cursor[j];
+        while(i < column.size() && column[i] != CSV_FIELD_END){
+            if(column[i] > 0xFF)
+                throw runtime_error("corrupt column block: symbol out of range");
+            if(write)
+                raw += (char)column[i];
+            i++;
+        }
+        if(i == column.size())
+            throw runtime_error("corrupt column block: column ends early");
+        i++;
+    };
+
+    size_t s = 0;
+    while(s < shape.size()){
+        size_t fields = 0;
+        int shift = 0;
+        while(true){
+            if(s == shape.size() || shift > 28 || shape[s] > 0xFF)
+                throw runtime_error("corrupt column block: bad row shape");
+            fields |= (size_t)(shape[s] & 0x7F) << shift;
+            shift += 7;
+            if((shape[s++] & 0x80) == 0)
+                break;
+        }
+        if(fields == 0 || fields > columns.size())
+            throw runtime_error("corrupt column block: bad row shape");
+        bool newline = !(s < shape.size() && shape[s] == 0);
+        if(!newline && ++s != shape.size())
+            throw runtime_error("corrupt column block: bad row shape");
+
+        if(selection.empty()){
+            for(size_t j = 0; j < fields; j++){
+                if(j > 0)
+                    raw += delimiter;
+                copyField(j, true);
+            }
+        }
+        else {
+            for(int j : unique)
+                if((size_t)j < fields){
+                    start[j] = cursor[j];
+                    copyField(j, false);
+                }
+            for(size_t k = 0; k < selection.size(); k++){
+                if(k > 0)
+                    raw += delimiter;
+                size_t j = selection[k];
+                if(j < fields)
+                    for(size_t i = start[j]; columns[j][i] != CSV_FIELD_END; i++)
+                        raw += (char)columns[j][i];
+            }
+        }
+        if(newline)
+            raw += '\n';
+    }
+    for(size_t j = 0; j < columns.size(); j++)
+        if((selection.empty() || find(unique.begin(), unique.end(), (int)j) != unique.end()) &&
+           cursor[j] != columns[j].size())
+            throw runtime_error("corrupt column block: column has extra fields");
+    return raw;
+}
+
+//
+// parseColumnList
+// Parses a comma separated list of zero based column numbers.
+//
+vector<int> parseColumnList(string spec) {
+    vector<int> columns;
+    size_t start = 0;
+    while(start <= spec.size()){
+        size_t comma = spec.find(',', start);
+        string item = spec.substr(start, comma == string::npos ? string::npos : comma - start);
+        if(item.empty() || item.find_first_not_of("0123456789") != string::npos ||
+           item.size() > 5 || stoul(item) >= MAX_COLUMNS)
+            throw runtime_error("invalid column list " + spec);
+        columns.push_back(stoi(item));
+        if(comma == string::npos)
+            break;
+        start = comma + 1;
+    }
+    return columns;
+}
@@ -0,0 +1,229 @@
+//
+// follow.h
+// Live compression of a file that is still being written, like tail -f
+// (huf follow). The source is watched with inotify and its new bytes are
+// appended to a block container (see appendToContainer in block.h) in
+// flushes:
+//   - as soon as flushBytes are waiting, as whole blocks (the remainder
+//     keeps waiting, so a busy file still gets full sized blocks), or
+//   - once the oldest waiting byte is latencyMs old, everything waiting.
+// A backlog larger than flushBytes (a follow that starts far behind) is
+// read and flushed flushBytes of whole blocks at a time.
+// Every flush ends with a trailer and is fsynced before the next wait, so
+// the container is always decodable up to the last flush (a follow killed
+// part way through a flush leaves bytes that readers ignore and the next
+// append or follow removes) and a write
+// reaches durable compressed output within about latencyMs plus the time
+// to encode it. With nothing waiting the loop sleeps in poll() until
+// inotify reports a change.
+//
+// Following stops when stop is set (checked at least every
+// FOLLOW_IDLE_CHECK_MS) or when the source is renamed or deleted, for
+// example by log rotation; whatever was written to it until then is
+// flushed first. A source that shrinks below what was already compressed
+// is an error.
+//
+
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring> // for strerror
+#include <filesystem>
+#include <fstream>
+#include <streambuf>
+#include <stdexcept>
+#include <string>
+#ifdef __linux__
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "block.h"
+using namespace std;
+
+// how often a follow with nothing waiting looks at its stop flag
+const int FOLLOW_IDLE_CHECK_MS = 1000;
+
+struct FollowOptions {
+    BlockOptions block;
+    size_t flushBytes = 0; // waiting bytes that force a flush; 0 means one block
+    int latencyMs = 1000;  // longest a written byte waits for a flush
+};
+
+struct FollowStats {
+    long long flushes = 0;
+    long long rawBytes = 0; // appended while following
+    bool rotated = false;   // stopped because the source was renamed or deleted
+};
+
+#ifdef __linux__
+//
+// _FileDescriptor
+// Closes a POSIX file descriptor when it goes out of scope.
+//
+struct _FileDescriptor {
+    int fd;
+    explicit _FileDescriptor(int fd) : fd(fd) {}
+    ~_FileDescriptor() {
+        if(fd >= 0)
+            close(fd);
+    }
+    _FileDescriptor(const _FileDescriptor&) = delete;
+    _FileDescriptor& operator=(const _FileDescriptor&) = delete;
+};
+
+//
+// _SourceWindow
+// A stream buffer over the next limit bytes of input, read a piece at a
+// time, so a flush of a large backlog holds one batch of blocks in memory
+// rather than the whole backlog.
+//
+class _SourceWindow : public streambuf {
+public:
+    _SourceWindow(istream &input, uint64_t limit) : input(input), left(limit) {}
+
+protected:
+    int_type underflow() override {
+        if(gptr() < egptr())
+            return traits_type::to_int_type(*gptr());
+        size_t want = (size_t)min<uint64_t>(left, sizeof(buffer));
+        input.read(buffer, want);
+        size_t got = input.gcount();
+        if(got == 0)
+            return traits_type::eof();
+        left -= got;
+        setg(buffer, buffer, buffer + got);
+        return traits_type::to_int_type(*gptr());
+    }
+
+private:
+    istream &input;
+    uint64_t left;
+    char buffer[64 * 1024];
+};
+
+//
+// _sourceGone
+// Drains the inotify events on fd and returns true when one says the
+// watched file was renamed or deleted.
+//
+bool _sourceGone(int fd) {
+    alignas(inotify_event) char buffer[4096];
+    bool gone = false;
+    while(true){
+        ssize_t got = read(fd, buffer, sizeof(buffer));
+        if(got <= 0)
+            return gone;
+        for(char* p = buffer; p < buffer + got;){
+            const inotify_event* event = (const inotify_event*)p;
+            gone = gone || (event->mask & (IN_MOVE_SELF | IN_DELETE_SELF)) != 0;
+            p += sizeof(inotify_event) + event->len;
+        }
+    }
+}
+#endif
+
+//
+// followFile
+// Follows source into the container at path until stop is set or source
+// goes away, as described at the top of this file. A missing or empty
+// container is created from what source already holds; an existing one is
+// recovered if an earlier run was interrupted and then continued.
+//
+FollowStats followFile(string source, string path, const FollowOptions &options,
+                       const atomic<bool> &stop) {
+#ifndef __linux__
+    throw runtime_error("follow needs inotify (Linux)");
+#else
+    BlockOptions block = options.block;
+    if(block.blockSize == 0 || block.blockSize > MAX_BLOCK_SIZE)
+        throw runtime_error("block size must be between 1 byte and 1 GB");
+    size_t flushBytes = options.flushBytes > 0 ? options.flushBytes : block.blockSize;
+    chrono::milliseconds latency(max(1, options.latencyMs));
+
+    // watch before looking at the size so no write goes unnoticed
+    _FileDescriptor watch(inotify_init1(IN_NONBLOCK | IN_CLOEXEC));
+    if(watch.fd < 0 ||
+       inotify_add_watch(watch.fd, source.c_str(), IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF) < 0)
+        throw runtime_error("cannot watch " + source + ": " + strerror(errno));
+    // sizes come from the open file, which stays valid after a rename or delete
+    _FileDescriptor sourceFd(open(source.c_str(), O_RDONLY | O_CLOEXEC));
+    ifstream input(source, ios::binary);
+    if(sourceFd.fd < 0 || !input)
+        throw runtime_error("cannot open " + source);
+
+    error_code error;
+    if(filesystem::file_size(path, error) == 0 || error)
+        compressBlocks(source, path, block);
+    else if(!hasValidFooter(path))
+        recoverContainer(path);
+    fstream container(path, ios::binary | ios::in | ios::out);
+    _FileDescriptor containerFd(open(path.c_str(), O_RDWR | O_CLOEXEC));
+    if(!container || containerFd.fd < 0)
+        throw runtime_error("cannot open " + path);
+    ContainerState state = readContainerState(container);
+    block.checksum = state.kind;
+    checkAppendSource(input, state, source, path);
+    if(fsync(containerFd.fd) != 0)
+        throw runtime_error("cannot sync " + path);
+
+    FollowStats stats;
+    auto deadline = chrono::steady_clock::time_point::max();
+    while(true){
+        bool finishing = stop || stats.rotated;
+        struct stat status;
+        if(fstat(sourceFd.fd, &status) != 0)
+            throw runtime_error("cannot stat " + source);
+        if((uint64_t)status.st_size < state.trailer.totalRaw)
+            throw runtime_error(source + " was truncated while following it");
+        uint64_t waiting = status.st_size - state.trailer.totalRaw;
+        auto now = chrono::steady_clock::now();
+        if(waiting > 0 && deadline == chrono::steady_clock::time_point::max())
+            deadline = now + latency;
+
+        bool late = now >= deadline || finishing;
+        if(waiting > 0 && (late || waiting >= flushBytes)){
+            // a size flush takes whole blocks when there are any, and a
+            // backlog goes in pieces of about flushBytes, each one synced
+            // before the next is read
+            uint64_t piece = max<uint64_t>(flushBytes - flushBytes % block.blockSize, block.blockSize);
+            uint64_t count = waiting;
+            if(count > piece)
+                count = piece;
+            else if(!late && waiting >= block.blockSize)
+                count -= waiting % block.blockSize;
+            input.clear();
+            input.seekg(state.trailer.totalRaw);
+            _SourceWindow window(input, count);
+            istream pending(&window);
+            long long appended = appendToContainer(pending, container, state, block);
+            if((uint64_t)appended != count)
+                throw runtime_error("unexpected end of file reading " + source);
+            stats.rawBytes += appended;
+            container.flush();
+            if(!container || fsync(containerFd.fd) != 0)
+                throw runtime_error("error writing " + path);
+            stats.flushes++;
+            if(count == waiting)
+                deadline = chrono::steady_clock::time_point::max();
+            continue;
+        }
+        if(finishing)
+            return stats;
+
+        int timeout = FOLLOW_IDLE_CHECK_MS;
+        if(waiting > 0)
+            timeout = (int)min<long long>(timeout, chrono::ceil<chrono::milliseconds>(deadline - now).count());
+        pollfd events = {watch.fd, POLLIN, 0};
+        int ready = poll(&events, 1, timeout);
+        if(ready < 0 && errno != EINTR)
+            throw runtime_error(string("poll failed: ") + strerror(errno));
+        if(ready > 0 && _sourceGone(watch.fd))
+            stats.rotated = true;
+    }
+#endif
+}
@@ -0,0 +1,612 @@
+//
+// huf.cpp
+// Command line front end for the block container (block.h). The menu
+// driven program in mainprog.h keeps using the original single stream
+// format; this tool works on block containers and falls back to
+// decompress() for the original format.
+//
+// Build: g++ -std=c++17 -O2 -pthread huf.cpp hashmap.cpp -o huf
+//
+// Usage:
+//   huf compress [-j threads] [--block-size N] [--checksum crc32c|xxhash64]
+//                [--rle] [--filter auto|none|shuffle:S|delta:S|xor:S|float:S]
+//                [--csv comma|tab|C] [--logs] [--checkpoint seconds] file [out]
+//   huf decompress [--columns 0,2,...] file.huf [out]
+//   huf test [-j threads] file.huf...
+//   huf append [-j threads] [compress options] file.huf source
+//   huf follow [--latency ms] [--flush-size N] [compress options] file [out]
+//   huf stream [--sample file] < in > out
+//   huf unstream < in > out
+//   huf serve [--socket path] [-j workers] [--cache tables] [compress options]
+//   huf archive [-j threads] [--chunk-size N] [--no-dedup] [--solid]
+//               [compress options] archive.hufa path...
+//   huf extract archive.hufa [dir] [member...]
+//   huf list archive.hufa
+//   huf sync [-j files] [--memory N] [--out dir] [--manifest file]
+//            [--summary file] [compress options] path...
+//
+// append compresses only the part of source beyond what file.huf already
+// holds (for files that only grow) and adds it as new blocks. follow keeps
+// doing that as file grows (see follow.h) until interrupted or the file is
+// rotated away.
+// stream codes standard input as a sync stream (streaming.h), flushing
+// whatever each read returns so every piece is decodable on arrival;
+// unstream writes out what it can decode as soon as it arrives.
+// serve runs the compression daemon (service.h) until interrupted.
+// S is the filter stride (1, 2, 4 or 8); --filter auto picks per block.
+// --csv codes every column of delimited text as its own stream (not with
+// --rle or --filter); decompress --columns then writes only those columns.
+// --logs splits "timestamp level logger message" lines into fields with
+// their own models (see logs.h). compress -j encodes that many blocks at once.
+// --checkpoint saves progress that often (see checkpoint.h); running the
+// same command again after a crash resumes from the last checkpoint.
+// test decodes each file and checks its checksums and symbol counts while
+// discarding the output; files are checked in parallel. archive stores each
+// distinct content-defined chunk of the given files and directories once
+// (see archive.h) and prints a JSON summary; --solid packs the files into
+// shared blocks instead, so small files share one frequency header. sync
+// compresses only the files that changed since the last sync with the same
+// manifest (incremental.h) and reports what it did as JSON; --memory caps
+// the block buffers of all the files being compressed at once (see
+// scheduler.h).
+// HUF_TABLE_CACHE names a decode table cache file (tablecache.h) that
+// every huf run decoding blocks shares; HUF_TABLE_CACHE_SIZE sets its size
+// when it is created (64M by default). HUF_TRACE names a file to write a
+// Chrome trace of the run's pipeline stages to (see trace.h).
+//
+
+#include <iostream>
+#include <fstream>
+#include <atomic>
+#include <csignal>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <math.h>
+#include "hashmap.h"
+#include "bitstream.h"
+#include "util.h"
+#include "block.h"
+#include "archive.h"
+#include "incremental.h"
+#include "follow.h"
+#include "streaming.h"
+#include "checkpoint.h"
+#include "service.h"
+using namespace std;
+
+//
+// usage
+// Prints the command summary and returns the exit status for bad usage.
+//
+int usage() {
+    cerr << "Usage:" << endl;
+    cerr << "  huf compress [-j threads] [--block-size N] [--checksum crc32c|xxhash64]" << endl;
+    cerr << "               [--rle] [--filter auto|none|shuffle:S|delta:S|xor:S|float:S]" << endl;
+    cerr << "               [--csv comma|tab|C] [--logs] [--checkpoint seconds] file [out]" << endl;
+    cerr << "  huf decompress [--columns 0,2,...] file.huf [out]" << endl;
+    cerr << "  huf test [-j threads] file.huf..." << endl;
+    cerr << "  huf append [-j threads] [compress options] file.huf source" << endl;
+    cerr << "  huf follow [--latency ms] [--flush-size N] [compress options] file [out]" << endl;
+    cerr << "  huf stream [--sample file] < in > out" << endl;
+    cerr << "  huf unstream < in > out" << endl;
+    cerr << "  huf serve [--socket path] [-j workers] [--cache tables] [compress options]" << endl;
+    cerr << "  huf archive [-j threads] [--chunk-size N] [--no-dedup] [--solid]" << endl;
+    cerr << "              [compress options] archive.hufa path..." << endl;
+    cerr << "  huf extract archive.hufa [dir] [member...]" << endl;
+    cerr << "  huf list archive.hufa" << endl;
+    cerr << "  huf sync [-j files] [--memory N] [--out dir] [--manifest file] [--summary file]" << endl;
+    cerr << "           [compress options] path..." << endl;
+    return 2;
+}
+
+//
+// uncompressedName
+// Output name for a decompressed file, following the same convention as
+// decompress(): "dir/example.txt.huf" becomes "dir/example_unc.txt".
+//
+string uncompressedName(string filename) {
+    if(filename.size() > 4 && filename.compare(filename.size() - 4, 4, ".huf") == 0)
+        filename = filename.substr(0, filename.size() - 4);
+    size_t slash = filename.find_last_of('/');
+    size_t dot = filename.find_last_of('.');
+    if(dot == string::npos || (slash != string::npos && dot < slash))
+        return filename + "_unc";
+    return filename.substr(0, dot) + "_unc" + filename.substr(dot);
+}
+
+//
+// parseBlockSize
+// Accepts a byte count with an optional K/M/G suffix.
+//
+size_t parseBlockSize(string str) {
+    size_t multiplier = 1;
+    char unit = str.empty() ? 0 : toupper(str.back());
+    if(unit == 'K' || unit == 'M' || unit == 'G'){
+        multiplier = (unit == 'K') ? 1 << 10 : (unit == 'M') ? 1 << 20 : 1 << 30;
+        str.pop_back();
+    }
+    if(str.empty() || str.find_first_not_of("0123456789") != string::npos)
+        throw runtime_error("invalid block size");
+    return stoull(str) * multiplier;
+}
+
+//
+// parseChecksum
+// Maps a --checksum argument to its kind.
+//
+ChecksumKind parseChecksum(string kind) {
+    if(kind == "crc32c")
+        return CHECKSUM_CRC32C;
+    if(kind == "xxhash64")
+        return CHECKSUM_XXHASH64;
+    throw runtime_error("unknown checksum " + kind);
+}
+
+//
+// parseBlockOption
+// Handles one of the block coding options shared by compress and sync
+// at args[i], moving i past its value. Returns false for anything else.
+//
+bool parseBlockOption(vector<string> &args, size_t &i, BlockOptions &options) {
+    bool hasValue = i + 1 < args.size();
+    if(args[i] == "--block-size" && hasValue)
+        options.blockSize = parseBlockSize(args[++i]);
+    else if(args[i] == "--rle")
+        options.rle = true;
+    else if(args[i] == "--filter" && hasValue){
+        string filter = args[++i];
+        options.autoFilter = (filter == "auto");
+        options.filter = options.autoFilter ? 0 : parseFilter(filter);
+    }
+    else if(args[i] == "--csv" && hasValue)
+        options.delimiter = parseDelimiter(args[++i]);
+    else if(args[i] == "--logs")
+        options.logs = true;
+    else if(args[i] == "--checksum" && hasValue)
+        options.checksum = parseChecksum(args[++i]);
+    else
+        return false;
+    return true;
+}
+
+//
+// checkBlockOptions
+// Rejects combinations of block options that do not go together.
+//
+void checkBlockOptions(const BlockOptions &options) {
+    bool transforms = options.rle || options.filter != 0 || options.autoFilter;
+    if((options.delimiter != 0 || options.logs) && transforms)
+        throw runtime_error("--csv and --logs cannot be combined with --rle or --filter");
+    if(options.delimiter != 0 && options.logs)
+        throw runtime_error("--csv and --logs cannot be combined");
+}
+
+int doCompress(vector<string> &args) {
+    BlockOptions options;
+    options.threads = max(1u, thread::hardware_concurrency());
+    vector<string> files;
+    double checkpoint = -1;
+    for(size_t i = 0; i < args.size(); i++){
+        if(args[i] == "-j" && i + 1 < args.size())
+            options.threads = max(1, stoi(args[++i]));
+        else if(args[i] == "--checkpoint" && i + 1 < args.size())
+            checkpoint = stod(args[++i]);
+        else if(!parseBlockOption(args, i, options))
+            files.push_back(args[i]);
+    }
+    if(files.empty() || files.size() > 2)
+        return usage();
+    checkBlockOptions(options);
+    string out = files.size() == 2 ? files[1] : files[0] + ".huf";
+    long long size = 0;
+    if(checkpoint >= 0){
+        uint64_t resumedAt = 0;
+        size = compressWithCheckpoints(files[0], out, options, checkpoint, resumedAt);
+        if(resumedAt > 0)
+            cerr << files[0] << ": resumed from a checkpoint at byte " << resumedAt << endl;
+    }
+    else
+        size = compressBlocks(files[0], out, options);
+    cout << files[0] << " -> " << out << " (" << size << " bytes)" << endl;
+    return 0;
+}
+
+int doAppend(vector<string> &args) {
+    BlockOptions options;
+    options.threads = max(1u, thread::hardware_concurrency());
+    vector<string> files;
+    for(size_t i = 0; i < args.size(); i++){
+        if(args[i] == "-j" && i + 1 < args.size())
+            options.threads = max(1, stoi(args[++i]));
+        else if(!parseBlockOption(args, i, options))
+            files.push_back(args[i]);
+    }
+    if(files.size() != 2)
+        return usage();
+    checkBlockOptions(options);
+    if(!isBlockContainer(files[0]))
+        throw runtime_error(files[0] + " is not a block container");
+    if(!hasValidFooter(files[0])){
+        long long removed = recoverContainer(files[0]);
+        cerr << files[0] << ": removed " << removed << " bytes left by an interrupted append" << endl;
+    }
+    long long appended = appendBlocks(files[0], files[1], options);
+    cout << files[1] << " -> " << files[0] << " (" << appended << " new bytes)" << endl;
+    return 0;
+}
+
+atomic<bool> followStop(false);
+
+void stopFollowing(int) {
+    followStop = true;
+}
+
+int doFollow(vector<string> &args) {
+    FollowOptions options;
+    vector<string> files;
+    for(size_t i = 0; i < args.size(); i++){
+        if(args[i] == "--latency" && i + 1 < args.size())
+            options.latencyMs = stoi(args[++i]);
+        else if(args[i] == "--flush-size" && i + 1 < args.size())
+            options.flushBytes = parseBlockSize(args[++i]);
+        else if(!parseBlockOption(args, i, options.block))
+            files.push_back(args[i]);
+    }
+    if(files.empty() || files.size() > 2 || options.latencyMs <= 0)
+        return usage();
+    checkBlockOptions(options.block);
+    string out = files.size() == 2 ? files[1] : files[0] + ".huf";
+
+    // no SA_RESTART, so a signal also cuts the current wait short
+    struct sigaction action = {};
+    action.sa_handler = stopFollowing;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+    FollowStats stats = followFile(files[0], out, options, followStop);
+    cout << files[0] << " -> " << out << " (" << stats.rawBytes << " new bytes in " << stats.flushes
+         << " flushes" << (stats.rotated ? ", source rotated" : "") << ")" << endl;
+    return 0;
+}
+
+//
+// _writeAll
+// Writes all of data to a file descriptor.
+//
+void _writeAll(int fd, const string &data) {
+    for(size_t done = 0; done < data.size();){
+        ssize_t wrote = write(fd, data.data() + done, data.size() - done);
+        if(wrote < 0 && errno == EINTR)
+            continue;
+        if(wrote <= 0)
+            throw runtime_error("error writing output");
+        done += wrote;
+    }
+}
+
+int doStream(vector<string> &args, bool encoding) {
+    string sample;
+    for(size_t i = 0; i < args.size(); i++){
+        if(encoding && args[i] == "--sample" && i + 1 < args.size()){
+            ifstream input(args[++i], ios::binary);
+            if(!input)
+                throw runtime_error("cannot open " + args[i]);
+            sample.assign(istreambuf_iterator<char>(input), istreambuf_iterator<char>());
+        }
+        else
+            return usage();
+    }
+    SyncEncoder encoder(sample);
+    SyncDecoder decoder;
+    string buffer(64 * 1024, '\0');
+    while(true){
+        ssize_t got = read(0, &buffer[0], buffer.size());
+        if(got < 0 && errno == EINTR)
+            continue;
+        if(got < 0)
+            throw runtime_error("error reading input");
+        if(got == 0)
+            break;
+        if(encoding){
+            encoder.write(buffer.data(), got);
+            _writeAll(1, encoder.flush());
+        }
+        else
+            _writeAll(1, decoder.feed(buffer.data(), got));
+    }
+    if(encoding)
+        _writeAll(1, encoder.finish());
+    else if(!decoder.done())
+        throw runtime_error("sync stream ends without its EOF code");
+    return 0;
+}
+
+int doServe(vector<string> &args) {
+    ServiceOptions options;
+    options.workers = max(1u, thread::hardware_concurrency());
+    for(size_t i = 0; i < args.size(); i++){
+        if(args[i] == "--socket" && i + 1 < args.size())
+            options.socketPath = args[++i];
+        else if(args[i] == "-j" && i + 1 < args.size())
+            options.workers = max(1, stoi(args[++i]));
+        else if(args[i] == "--cache" && i + 1 < args.size())
+            options.cacheEntries = stoul(args[++i]);
+        else if(!parseBlockOption(args, i, options.block))
+            return usage();
+    }
+    checkBlockOptions(options.block);
+
+    // every thread leaves SIGINT and SIGTERM to the one that stops the service
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    CompressionService service(options);
+    thread stopper([&]() {
+        int signal;
+        sigwait(&signals, &signal);
+        service.stop();
+    });
+    thread announcer([&]() {
+        if(service.waitUntilListening())
+            cerr << "huf serve: listening on " << options.socketPath << endl;
+    });
+    try {
+        service.run();
+    }
+    catch(exception &) {
+        pthread_kill(stopper.native_handle(), SIGTERM);
+        stopper.join();
+        announcer.join();
+        throw;
+    }
+    // run() only returns once the stopper has stopped the service
+    stopper.join();
+    announcer.join();
+    return 0;
+}
+
+int doDecompress(vector<string> &args) {
+    vector<int> columns;
+    vector<string> files;
+    for(size_t i = 0; i < args.size(); i++){
+        if(args[i] == "--columns" && i + 1 < args.size())
+            columns = parseColumnList(args[++i]);
+        else
+            files.push_back(args[i]);
+    }
+    if(files.empty() || files.size() > 2)
+        return usage();
+    if(!isBlockContainer(files[0])){
+        if(!columns.empty())
+            throw runtime_error("--columns needs a container compressed with --csv");
+        if(files.size() == 2)
+            cerr << "Output name is fixed for the original format, ignoring " << files[1] << endl;
+        decompress(files[0]);
+        return 0;
+    }
+    string out = files.size() == 2 ? files[1] : uncompressedName(files[0]);
+    long long interrupted = 0;
+    long long size = decompressBlocks(files[0], out, columns, &interrupted);
+    if(interrupted > 0)
+        cerr << files[0] << ": ignored " << interrupted << " bytes left by an interrupted append"
+             << " (huf append removes them)" << endl;
+    cout << files[0] << " -> " << out << " (" << size << " bytes)" << endl;
+    return 0;
+}
+
+//
+// verifyFile
+// Checks one compressed file of either format. Returns an empty string when
+// it is intact, otherwise the reason it is not. note is set for an intact
+// container followed by the bytes of an interrupted append.
+//
+string verifyFile(string path, string &note) {
+    try {
+        if(isBlockContainer(path)){
+            long long interrupted = 0;
+            verifyBlocks(path, &interrupted);
+            if(interrupted > 0)
+                note = to_string(interrupted) + " bytes of an interrupted append ignored";
+            return "";
+        }
+        if(isArchive(path)){
+            verifyArchive(path);
+            return "";
+        }
+        string error;
+        verifyCompressed(path, error);
+        return error;
+    }
+    catch(exception &e) {
+        return e.what();
+    }
+}
+
+int doTest(vector<string> &args) {
+    unsigned threads = max(1u, thread::hardware_concurrency());
+    vector<string> files;
+    for(size_t i = 0; i < args.size(); i++){
+        if(args[i] == "-j" && i + 1 < args.size())
+            threads = max(1, stoi(args[++i]));
+        else
+            files.push_back(args[i]);
+    }
+    if(files.empty())
+        return usage();
+
+    vector<string> errors(files.size()), notes(files.size());
+    atomic<size_t> next(0);
+    vector<thread> workers;
+    for(unsigned t = 0; t < min<size_t>(threads, files.size()); t++){
+        workers.emplace_back([&]() {
+            for(size_t i = next++; i < files.size(); i = next++)
+                errors[i] = verifyFile(files[i], notes[i]);
+        });
+    }
+    for(thread &worker : workers)
+        worker.join();
+
+    int failed = 0;
+    for(size_t i = 0; i < files.size(); i++){
+        if(errors[i].empty())
+            cout << files[i] << ": OK" << (notes[i].empty() ? "" : " (" + notes[i] + ")") << endl;
+        else {
+            cout << files[i] << ": FAILED (" << errors[i] << ")" << endl;
+            failed++;
+        }
+    }
+    return failed > 0 ? 1 : 0;
+}
+
+int doArchive(vector<string> &args) {
+    ArchiveOptions options;
+    options.block.threads = max(1u, thread::hardware_concurrency());
+    vector<string> paths;
+    for(size_t i = 0; i < args.size(); i++){
+        if(args[i] == "-j" && i + 1 < args.size())
+            options.block.threads = max(1, stoi(args[++i]));
+        else if(args[i] == "--chunk-size" && i + 1 < args.size())
+            options.chunkSize = parseBlockSize(args[++i]);
+        else if(args[i] == "--no-dedup")
+            options.dedup = false;
+        else if(args[i] == "--solid")
+            options.solid = true;
+        else if(!parseBlockOption(args, i, options.block))
+            paths.push_back(args[i]);
+    }
+    if(paths.size() < 2)
+        return usage();
+    checkBlockOptions(options.block);
+    string out = paths[0];
+    paths.erase(paths.begin());
+
+    ArchiveWriter writer(out, options);
+    for(const string &file : archiveInputs(paths))
+        writer.addFile(file, archiveMemberName(file));
+    ArchiveStats stats = writer.finish();
+    cout << "{\"members\": " << stats.members
+         << ", \"raw_bytes\": " << stats.rawBytes << ", \"chunks\": " << stats.chunks
+         << ", \"unique_chunks\": " << stats.uniqueChunks
+         << ", \"stored_raw_bytes\": " << stats.storedRawBytes
+         << ", \"archive_bytes\": " << stats.archiveBytes << "}" << endl;
+    return 0;
+}
+
+int doSync(vector<string> &args) {
+    SyncOptions options;
+    options.jobs = max(1u, thread::hardware_concurrency());
+    string summaryPath;
+    size_t memory = 0;
+    vector<string> paths;
+    for(size_t i = 0; i < args.size(); i++){
+        if(args[i] == "-j" && i + 1 < args.size())
+            options.jobs = max(1, stoi(args[++i]));
+        else if(args[i] == "--memory" && i + 1 < args.size())
+            memory = parseBlockSize(args[++i]);
+        else if(args[i] == "--out" && i + 1 < args.size())
+            options.outDir = args[++i];
+        else if(args[i] == "--manifest" && i + 1 < args.size())
+            options.manifestPath = args[++i];
+        else if(args[i] == "--summary" && i + 1 < args.size())
+            summaryPath = args[++i];
+        else if(!parseBlockOption(args, i, options.block))
+            paths.push_back(args[i]);
+    }
+    if(paths.empty())
+        return usage();
+    checkBlockOptions(options.block);
+    BufferPool pool(memory);
+    if(memory > 0){
+        options.block.pool = &pool;
+        keepLargeBuffersMapped();
+    }
+
+    vector<string> removed;
+    vector<SyncResult> results = syncInputs(paths, options, removed);
+    string summary = syncSummaryJson(results, removed);
+    if(summaryPath.empty())
+        cout << summary;
+    else {
+        ofstream output(summaryPath, ios::trunc);
+        output << summary;
+        if(!output)
+            throw runtime_error("error writing " + summaryPath);
+    }
+    for(const SyncResult &result : results)
+        if(result.action == SYNC_FAILED)
+            return 1;
+    return 0;
+}
+
+int doExtract(vector<string> &args) {
+    if(args.empty())
+        return usage();
+    string destination = args.size() >= 2 ? args[1] : ".";
+    vector<string> names(args.begin() + min<size_t>(2, args.size()), args.end());
+    size_t written = extractArchive(args[0], destination, names);
+    if(written < names.size())
+        throw runtime_error("some members were not found in " + args[0]);
+    cout << args[0] << ": extracted " << written << " members to " << destination << endl;
+    return 0;
+}
+
+int doList(vector<string> &args) {
+    if(args.size() != 1)
+        return usage();
+    ArchiveReader reader(args[0]);
+    for(const ArchiveMember &member : reader.archiveIndex().members)
+        cout << member.size << "\t" << member.extents.size() << "\t" << member.name << endl;
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    if(argc < 2)
+        return usage();
+    string command = argv[1];
+    vector<string> args(argv + 2, argv + argc);
+    if(const char* path = getenv("HUF_TRACE"))
+        startTracing(path);
+    unique_ptr<PersistentTableCache> tableCache;
+    if(const char* path = getenv("HUF_TABLE_CACHE")){
+        // decoding works without it, so a cache that cannot be used is only a warning
+        try {
+            const char* size = getenv("HUF_TABLE_CACHE_SIZE");
+            tableCache.reset(new PersistentTableCache(path, size ? parseBlockSize(size) : DEFAULT_TABLE_CACHE_SIZE));
+            persistentTableCache = tableCache.get();
+        }
+        catch(exception &e) {
+            cerr << "huf: " << e.what() << endl;
+        }
+    }
+    try {
+        if(command == "compress")
+            return doCompress(args);
+        if(command == "decompress")
+            return doDecompress(args);
+        if(command == "test")
+            return doTest(args);
+        if(command == "append")
+            return doAppend(args);
+        if(command == "follow")
+            return doFollow(args);
+        if(command == "serve")
+            return doServe(args);
+        if(command == "stream" || command == "unstream")
+            return doStream(args, command == "stream");
+        if(command == "archive")
+            return doArchive(args);
+        if(command == "sync")
+            return doSync(args);
+        if(command == "extract")
+            return doExtract(args);
+        if(command == "list")
+            return doList(args);
+    }
+    catch(exception &e) {
+        cerr << "huf " << command << ": " << e.what() << endl;
+        return 1;
+    }
+    return usage();
+}
@@ -0,0 +1,191 @@
+//
+// huffstring.h
+// HuffmanString keeps text Huffman coded in memory and reads it without
+// decoding all of it. The codes are packed back to back as in records.h,
+// and the bit offset of every sampleEvery-th character is kept, so at(i)
+// starts at the sample at or before i and decodes at most sampleEvery
+// characters; substr and iteration decode only the part they read.
+// Samples are 8 bytes each, so the default of one per 128 characters
+// adds about a tenth to text that codes at 5 to 6 bits per character.
+//
+
+#pragma once
+
+#include <algorithm> // for max, min
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "block.h" // for scaledFrequencyMap, buildCodeTable and writeCode
+using namespace std;
+
+const size_t DEFAULT_SAMPLE_EVERY = 128;
+
+class HuffmanString {
+public:
+    //
+    // HuffmanString
+    // Codes text with its own table, keeping the bit offset of every
+    // sampleEvery-th character.
+    //
+    explicit HuffmanString(string_view text = "", size_t sampleEvery = DEFAULT_SAMPLE_EVERY)
+        : length(text.size()), sampleEvery(max((size_t)1, sampleEvery)) {
+        vector<long long> counts(256, 0);
+        for(char c : text)
+            counts[(unsigned char)c]++;
+        // PSEUDO_EOF keeps every code at least one bit long
+        hashmapF map = scaledFrequencyMap(counts);
+
+        HuffmanNode* root = buildEncodingTree(map);
+        vector<HuffmanCode> table = buildCodeTable(root, PSEUDO_EOF);
+        tree = make_shared<const DecodeTable>(root);
+
+        BitWriter writer;
+        samples.reserve(length / this->sampleEvery + 1);
+        for(size_t i = 0; i < length; i++){
+            if(i % this->sampleEvery == 0)
+                samples.push_back(writer.bitCount());
+            writeCode(writer, table[(unsigned char)text[i]]);
+        }
+        writer.flush();
+        bits = writer.bytes();
+    }
+
+    size_t size() const {
+        return length;
+    }
+
+    bool empty() const {
+        return length == 0;
+    }
+
+    //
+    // compressedSize
+    // Bytes held for the text: the coded bits and the samples.
+    //
+    size_t compressedSize() const {
+        return bits.size() + samples.size() * sizeof(uint64_t);
+    }
+
+    //
+    // at
+    // The character at i, decoding at most sampleEvery characters. Throws
+    // out_of_range past the end.
+    //
+    char at(size_t i) const {
+        if(i >= length)
+            throw out_of_range("HuffmanString::at");
+        return *const_iterator(this, i);
+    }
+
+    char operator[](size_t i) const {
+        return at(i);
+    }
+
+    //
+    // substr
+    // The characters from pos, at most n of them, like string::substr.
+    //
+    string substr(size_t pos = 0, size_t n = string::npos) const {
+        if(pos > length)
+            throw out_of_range("HuffmanString::substr");
+        n = min(n, length - pos);
+        string out;
+        out.reserve(n);
+        for(const_iterator it(this, pos); out.size() < n; ++it)
+            out += *it;
+        return out;
+    }
+
+    //
+    // str
+    // The whole text.
+    //
+    string str() const {
+        return substr();
+    }
+
+    //
+    // const_iterator
+    // Reads the text forward from any position, one code at a time.
+    //
+    class const_iterator {
+    public:
+        using iterator_category = input_iterator_tag;
+        using value_type = char;
+        using difference_type = ptrdiff_t;
+        using pointer = const char*;
+        using reference = char;
+
+        const_iterator(const HuffmanString* owner, size_t index)
+            : owner(owner), index(index), reader(owner->bits.data(), owner->bits.size()) {
+            if(index >= owner->length)
+                return;
+            // start at the sample at or before index and skip to it
+            size_t sample = index / owner->sampleEvery;
+            uint64_t offset = owner->samples[sample];
+            reader = BitReader(owner->bits.data() + offset / 8, owner->bits.size() - offset / 8);
+            for(uint64_t skip = offset % 8; skip > 0; skip--)
+                reader.readBit();
+            for(size_t i = sample * owner->sampleEvery; i < index; i++)
+                _decode();
+            current = _decode();
+        }
+
+        char operator*() const {
+            return current;
+        }
+
+        const_iterator &operator++() {
+            if(++index < owner->length)
+                current = _decode();
+            return *this;
+        }
+
+        const_iterator operator++(int) {
+            const_iterator before = *this;
+            ++*this;
+            return before;
+        }
+
+        bool operator==(const const_iterator &other) const {
+            return owner == other.owner && min(index, owner->length) == min(other.index, other.owner->length);
+        }
+
+        bool operator!=(const const_iterator &other) const {
+            return !(*this == other);
+        }
+
+    private:
+        // the next character's code; the tree has no other leaves than the
+        // characters of the text and PSEUDO_EOF, which is never written
+        char _decode() {
+            HuffmanNode* node = owner->tree->root;
+            while(node->character == NOT_A_CHAR)
+                node = reader.readBit() == 1 ? node->one : node->zero;
+            return (char)node->character;
+        }
+
+        const HuffmanString* owner;
+        size_t index;
+        BitReader reader;
+        char current = 0;
+    };
+
+    const_iterator begin() const {
+        return const_iterator(this, 0);
+    }
+
+    const_iterator end() const {
+        return const_iterator(this, length);
+    }
+
+private:
+    size_t length;
+    size_t sampleEvery;
+    shared_ptr<const DecodeTable> tree;
+    string bits;
+    vector<uint64_t> samples; // bit offset of character k * sampleEvery
+};
@@ -0,0 +1,335 @@
+//
+// incremental.h
+// Incremental compression of directory trees. A manifest remembers, for
+// every input, its size, modification time and content hash, where its
+// block container was written, and that output's size and modification
+// time. On the next run a file is skipped when
+//   - its size and mtime are unchanged and its output is untouched, or
+//   - its size or mtime changed but its content hash did not (a touch or a
+//     copy), in which case only the manifest entry is refreshed.
+// Everything else is compressed again, several files at a time. A change
+// of block options (an "options" key per entry) also forces recompression.
+//
+// The manifest is a text file, written to a temporary name and renamed so
+// an interrupted run leaves the previous manifest in place:
+//   huf-manifest 1
+//   path \t size \t mtime \t hash \t options \t output \t outputSize \t outputMtime
+// mtime is in file clock ticks (0 when it was too recent to trust), hash is
+// xxHash64 of the content in hex.
+//
+
+#pragma once
+
+#include <cstdio> // for rename
+#include <filesystem>
+#include <map>
+#include "archive.h" // for archiveInputs, archiveMemberName and parallelFor
+using namespace std;
+
+const char MANIFEST_MAGIC[] = "huf-manifest 1";
+
+struct ManifestEntry {
+    uint64_t size = 0;
+    long long mtime = 0;
+    uint64_t hash = 0;
+    string options;
+    string output;
+    uint64_t outputSize = 0;
+    long long outputMtime = 0;
+};
+
+typedef map<string, ManifestEntry> Manifest;
+
+enum SyncAction {
+    SYNC_COMPRESSED, // new or changed
+    SYNC_SKIPPED,    // unchanged
+    SYNC_TOUCHED,    // metadata changed, content did not
+    SYNC_FAILED
+};
+
+const char* const SYNC_ACTION_NAMES[] = {"compressed", "skipped", "touched", "failed"};
+
+struct SyncResult {
+    string path;
+    SyncAction action = SYNC_FAILED;
+    string error;
+    uint64_t size = 0;
+    long long outputBytes = 0;
+};
+
+struct SyncOptions {
+    BlockOptions block;
+    string outDir; // empty: next to each input as file.huf
+    string manifestPath = ".huf-manifest";
+    int jobs = 1; // files compressed at once
+};
+
+//
+// blockOptionsKey
+// The block options that change the output, as one manifest field.
+//
+string blockOptionsKey(const BlockOptions &options) {
+    stringstream key;
+    key << "bs=" << options.blockSize << ",ck=" << options.checksum << ",rle=" << options.rle
+        << ",filter=" << (options.autoFilter ? string("auto") : to_string(options.filter))
+        << ",csv=" << (int)(unsigned char)options.delimiter << ",logs=" << options.logs;
+    return key.str();
+}
+
+//
+// fileMtime
+// Modification time of path in file clock ticks.
+//
+long long fileMtime(const string &path) {
+    return filesystem::last_write_time(path).time_since_epoch().count();
+}
+
+//
+// _recordedMtime
+// The mtime to remember for an input. A file modified in the last couple
+// of seconds could change again within the same timestamp tick without
+// its mtime moving, so its mtime is recorded as 0 and the next run checks
+// its hash instead.
+//
+long long _recordedMtime(const string &path, long long mtime) {
+    filesystem::file_time_type modified = filesystem::last_write_time(path);
+    return filesystem::file_time_type::clock::now() - modified < chrono::seconds(2) ? 0 : mtime;
+}
+
+//
+// contentHash
+// xxHash64 of the whole file, read in 1 MB pieces.
+//
+uint64_t contentHash(const string &path) {
+    ifstream input(path, ios::binary);
+    if(!input)
+        throw runtime_error("cannot open " + path);
+    XXHash64 hash;
+    string buffer(1 << 20, '\0');
+    while(input.read(&buffer[0], buffer.size()) || input.gcount() > 0)
+        hash.update(buffer.data(), input.gcount());
+    if(input.bad())
+        throw runtime_error("error reading " + path);
+    return hash.digest();
+}
+
+//
+// loadManifest
+// Reads the manifest at path; a missing file is an empty manifest.
+//
+Manifest loadManifest(const string &path) {
+    Manifest manifest;
+    ifstream input(path);
+    if(!input)
+        return manifest;
+    string line;
+    if(!getline(input, line) || line != MANIFEST_MAGIC)
+        throw runtime_error(path + " is not a manifest");
+    while(getline(input, line)){
+        vector<string> fields;
+        size_t start = 0;
+        for(size_t tab = line.find('\t'); tab != string::npos; tab = line.find('\t', start)){
+            fields.push_back(line.substr(start, tab - start));
+            start = tab + 1;
+        }
+        fields.push_back(line.substr(start));
+        if(fields.size() != 8)
+            throw runtime_error("corrupt manifest line in " + path);
+        ManifestEntry entry;
+        try {
+            entry.size = stoull(fields[1]);
+            entry.mtime = stoll(fields[2]);
+            entry.hash = stoull(fields[3], nullptr, 16);
+            entry.outputSize = stoull(fields[6]);
+            entry.outputMtime = stoll(fields[7]);
+        }
+        catch(exception &) {
+            throw runtime_error("corrupt manifest line in " + path);
+        }
+        entry.options = fields[4];
+        entry.output = fields[5];
+        manifest[fields[0]] = entry;
+    }
+    return manifest;
+}
+
+//
+// saveManifest
+// Writes the manifest next to path and renames it into place.
+//
+void saveManifest(const string &path, const Manifest &manifest) {
+    string temporary = path + ".tmp";
+    {
+        ofstream output(temporary, ios::trunc);
+        output << MANIFEST_MAGIC << "\n";
+        for(const auto &item : manifest){
+            const ManifestEntry &entry = item.second;
+            char hash[17];
+            snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)entry.hash);
+            output << item.first << '\t' << entry.size << '\t' << entry.mtime << '\t' << hash << '\t'
+                   << entry.options << '\t' << entry.output << '\t' << entry.outputSize << '\t'
+                   << entry.outputMtime << "\n";
+        }
+        output.close();
+        if(!output)
+            throw runtime_error("error writing " + temporary);
+    }
+    if(rename(temporary.c_str(), path.c_str()) != 0)
+        throw runtime_error("cannot replace " + path);
+}
+
+//
+// _outputValid
+// True when the output recorded in entry is still the file that was written.
+//
+bool _outputValid(const ManifestEntry &entry) {
+    error_code error;
+    return filesystem::file_size(entry.output, error) == entry.outputSize && !error &&
+           filesystem::last_write_time(entry.output, error).time_since_epoch().count() ==
+               entry.outputMtime && !error;
+}
+
+//
+// _syncFile
+// Brings one input up to date, updating entry. See the top of this file.
+//
+SyncResult _syncFile(const string &path, ManifestEntry &entry, bool known, const SyncOptions &options) {
+    SyncResult result;
+    result.path = path;
+    if(path.find_first_of("\t\n") != string::npos)
+        throw runtime_error("path contains a tab or newline");
+    string key = blockOptionsKey(options.block);
+    uint64_t size = filesystem::file_size(path);
+    long long mtime = fileMtime(path);
+    result.size = size;
+    bool reusable = known && entry.options == key && _outputValid(entry);
+    if(reusable && entry.size == size && entry.mtime == mtime){
+        result.action = SYNC_SKIPPED;
+        return result;
+    }
+
+    uint64_t hash = contentHash(path);
+    if(reusable && entry.size == size && entry.hash == hash){
+        entry.mtime = _recordedMtime(path, mtime);
+        result.action = SYNC_TOUCHED;
+        return result;
+    }
+
+    string output = options.outDir.empty() ? path + ".huf"
+                                           : options.outDir + "/" + archiveMemberName(path) + ".huf";
+    filesystem::path parent = filesystem::path(output).parent_path();
+    if(!parent.empty())
+        filesystem::create_directories(parent);
+    result.outputBytes = compressBlocks(path, output, options.block);
+    entry.size = size;
+    entry.mtime = _recordedMtime(path, mtime);
+    entry.hash = hash;
+    entry.options = key;
+    entry.output = output;
+    entry.outputSize = result.outputBytes;
+    entry.outputMtime = fileMtime(output);
+    result.action = SYNC_COMPRESSED;
+    return result;
+}
+
+//
+// syncInputs
+// Runs one incremental pass over the files and directories in paths and
+// saves the manifest. Files that fail are reported and keep their old
+// manifest entry. removed gets the manifest entries under paths whose
+// inputs no longer exist; they are dropped from the manifest (their
+// outputs are left alone).
+//
+vector<SyncResult> syncInputs(const vector<string> &paths, const SyncOptions &options,
+                              vector<string> &removed) {
+    Manifest manifest = loadManifest(options.manifestPath);
+    // earlier outputs (and the manifest) may live under the same roots
+    vector<string> files;
+    for(const string &file : archiveInputs(paths)){
+        error_code error;
+        bool output = file.size() >= 4 && file.compare(file.size() - 4, 4, ".huf") == 0;
+        if(!output && !filesystem::equivalent(file, options.manifestPath, error))
+            files.push_back(file);
+    }
+    vector<SyncResult> results(files.size());
+    vector<ManifestEntry> entries(files.size());
+    vector<bool> known(files.size());
+    for(size_t i = 0; i < files.size(); i++){
+        auto found = manifest.find(files[i]);
+        known[i] = found != manifest.end();
+        if(known[i])
+            entries[i] = found->second;
+    }
+
+    parallelFor(files.size(), max(1, options.jobs), [&](size_t i) {
+        try {
+            results[i] = _syncFile(files[i], entries[i], known[i], options);
+        }
+        catch(exception &e) {
+            results[i].path = files[i];
+            results[i].action = SYNC_FAILED;
+            results[i].error = e.what();
+        }
+    });
+
+    for(size_t i = 0; i < files.size(); i++)
+        if(results[i].action != SYNC_FAILED)
+            manifest[files[i]] = entries[i];
+
+    // entries under one of the roots whose file is gone
+    vector<string> sorted(files);
+    sort(sorted.begin(), sorted.end());
+    for(auto it = manifest.begin(); it != manifest.end();){
+        bool underRoot = false;
+        for(const string &root : paths){
+            string prefix = root.back() == '/' ? root : root + "/";
+            underRoot = underRoot || it->first == root || it->first.compare(0, prefix.size(), prefix) == 0;
+        }
+        if(underRoot && !binary_search(sorted.begin(), sorted.end(), it->first)){
+            removed.push_back(it->first);
+            it = manifest.erase(it);
+        }
+        else
+            ++it;
+    }
+    saveManifest(options.manifestPath, manifest);
+    return results;
+}
+
+//
+// syncSummaryJson
+// Machine readable summary of a syncInputs pass.
+//
+string syncSummaryJson(const vector<SyncResult> &results, const vector<string> &removed) {
+    size_t counts[4] = {0, 0, 0, 0};
+    uint64_t compressedBytes = 0, skippedBytes = 0;
+    for(const SyncResult &result : results){
+        counts[result.action]++;
+        if(result.action == SYNC_COMPRESSED)
+            compressedBytes += result.size;
+        else if(result.action != SYNC_FAILED)
+            skippedBytes += result.size;
+    }
+    stringstream json;
+    json << "{\n  \"files\": " << results.size();
+    for(int action = SYNC_COMPRESSED; action <= SYNC_FAILED; action++)
+        json << ", \"" << SYNC_ACTION_NAMES[action] << "\": " << counts[action];
+    json << ", \"removed\": " << removed.size() << ",\n  \"compressed_bytes\": " << compressedBytes
+         << ", \"skipped_bytes\": " << skippedBytes << ",\n  \"entries\": [";
+    for(size_t i = 0; i < results.size(); i++){
+        const SyncResult &result = results[i];
+        json << (i > 0 ? "," : "") << "\n    {\"path\": \"" << jsonEscape(result.path)
+             << "\", \"action\": \"" << SYNC_ACTION_NAMES[result.action] << "\", \"size\": "
+             << result.size;
+        if(result.action == SYNC_COMPRESSED)
+            json << ", \"output_bytes\": " << result.outputBytes;
+        if(result.action == SYNC_FAILED)
+            json << ", \"error\": \"" << jsonEscape(result.error) << "\"";
+        json << "}";
+    }
+    json << "\n  ],\n  \"removed_paths\": [";
+    for(size_t i = 0; i < removed.size(); i++)
+        json << (i > 0 ? ", " : "") << "\"" << jsonEscape(removed[i]) << "\"";
+    json << "]\n}\n";
+    return json.str();
+}
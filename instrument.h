@@ -0,0 +1,196 @@
+//
+// instrument.h
+// Per-stage timing and counter instrumentation for compress() and
+// decompress(). The pipeline is templated on a stats policy:
+//   NoStats  - every call is an empty inline function, so the compiled
+//              code is identical to having no instrumentation at all
+//   RunStats - scoped wall clock timers per stage plus counters, reported
+//              as one summary line (or JSON) per run
+// Build with -DHUFFMAN_STATS to make compress()/decompress() use RunStats
+// and print a report to stderr after every run. Set HUFFMAN_STATS_FORMAT=json
+// in the environment for JSON instead of the summary line.
+//
+
+#pragma once
+
+#include <chrono> // for steady_clock
+#include <cstdlib> // for getenv
+#include <iostream>
+#include <sstream>
+#include <string>
+using namespace std;
+
+// pipeline stages with their own timer
+enum Stage {
+    STAGE_HEADER,     // writing or parsing the frequency map header
+    STAGE_FREQUENCY,  // buildFrequencyMap
+    STAGE_TREE,       // buildEncodingTree
+    STAGE_TABLE,      // buildEncodingMap
+    STAGE_ENCODE,     // encode
+    STAGE_DECODE,     // decode
+    NUM_STAGES
+};
+
+// event counters
+enum Counter {
+    BYTES_READ,       // input bytes consumed
+    BITS_WRITTEN,     // payload bits produced by encode
+    SYMBOLS_DECODED,  // characters produced by decode
+    TREE_DEPTH,       // depth of the encoding tree (longest code length)
+    ALLOCATIONS,      // HuffmanNode allocations for the encoding tree
+    NUM_COUNTERS
+};
+
+const char* const STAGE_NAMES[NUM_STAGES] = {"header", "frequency", "tree", "table",
+                                             "encode", "decode"};
+const char* const COUNTER_NAMES[NUM_COUNTERS] = {"bytes_read", "bits_written",
+                                                 "symbols_decoded", "tree_depth",
+                                                 "allocations"};
+
+//
+// jsonEscape
+// Escapes a string for use inside a JSON string literal. Control
+// characters become \u00XX escapes.
+//
+string jsonEscape(string str) {
+    static const char hex[] = "0123456789abcdef";
+    string escaped;
+    for(char ch : str){
+        if(ch == '"' || ch == '\\')
+            escaped += '\\';
+        if((unsigned char)ch < 0x20){
+            escaped += "\\u00";
+            escaped += hex[(unsigned char)ch >> 4];
+            escaped += hex[ch & 0xF];
+            continue;
+        }
+        escaped += ch;
+    }
+    return escaped;
+}
+
+//
+// NoStats
+// The disabled policy. Everything is empty and inlined away.
+//
+struct NoStats {
+    static const bool enabled = false;
+
+    struct Scope {
+        ~Scope() {} // user-provided so unused scopes do not warn
+    };
+
+    NoStats(string = "", string = "") {}
+    Scope scope(Stage) { return Scope(); }
+    void add(Counter, long long) {}
+    void set(Counter, long long) {}
+    void report() {}
+};
+
+//
+// RunStats
+// The enabled policy. Accumulates time per stage and counts per counter for
+// one compress or decompress run.
+//
+class RunStats {
+public:
+    static const bool enabled = true;
+
+    class Scope {
+    public:
+        Scope(RunStats* stats, Stage stage)
+            : stats(stats), stage(stage), start(chrono::steady_clock::now()) {}
+        Scope(const Scope&) = delete;
+        ~Scope() {
+            stats->seconds[stage] +=
+                chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        }
+    private:
+        RunStats* stats;
+        Stage stage;
+        chrono::steady_clock::time_point start;
+    };
+
+    RunStats(string operation = "", string filename = "")
+        : operation(operation), filename(filename) {}
+
+    //
+    // scope
+    // Returns a timer that charges its lifetime to stage.
+    //
+    Scope scope(Stage stage) {
+        return Scope(this, stage);
+    }
+
+    void add(Counter counter, long long value) {
+        counters[counter] += value;
+    }
+
+    void set(Counter counter, long long value) {
+        counters[counter] = value;
+    }
+
+    double stageSeconds(Stage stage) const {
+        return seconds[stage];
+    }
+
+    long long counter(Counter counter) const {
+        return counters[counter];
+    }
+
+    //
+    // summary
+    // One line: operation, file, the stages that ran in ms, then counters.
+    //
+    string summary() const {
+        stringstream line;
+        line << operation << " " << filename << ":";
+        for(int s = 0; s < NUM_STAGES; s++)
+            if(seconds[s] > 0)
+                line << " " << STAGE_NAMES[s] << "=" << seconds[s] * 1000 << "ms";
+        for(int c = 0; c < NUM_COUNTERS; c++)
+            line << " " << COUNTER_NAMES[c] << "=" << counters[c];
+        return line.str();
+    }
+
+    //
+    // json
+    // The same data as summary() as a single JSON object.
+    //
+    string json() const {
+        stringstream out;
+        out << "{\"operation\": \"" << jsonEscape(operation) << "\", \"file\": \"" << jsonEscape(filename)
+            << "\", \"ms\": {";
+        for(int s = 0; s < NUM_STAGES; s++)
+            out << (s > 0 ? ", " : "") << "\"" << STAGE_NAMES[s] << "\": " << seconds[s] * 1000;
+        out << "}";
+        for(int c = 0; c < NUM_COUNTERS; c++)
+            out << ", \"" << COUNTER_NAMES[c] << "\": " << counters[c];
+        out << "}";
+        return out.str();
+    }
+
+    //
+    // report
+    // Prints the run to stderr in the format chosen by HUFFMAN_STATS_FORMAT.
+    //
+    void report() const {
+        const char* format = getenv("HUFFMAN_STATS_FORMAT");
+        if(format != nullptr && string(format) == "json")
+            cerr << json() << endl;
+        else
+            cerr << summary() << endl;
+    }
+
+private:
+    string operation;
+    string filename;
+    double seconds[NUM_STAGES] = {};
+    long long counters[NUM_COUNTERS] = {};
+};
+
+#ifdef HUFFMAN_STATS
+typedef RunStats DefaultStats;
+#else
+typedef NoStats DefaultStats;
+#endif
@@ -0,0 +1,213 @@
+//
+// loadgen.cpp
+// Load generator for the compression daemon (service.h). Several clients,
+// each on its own connection, send requests back to back and the request
+// latencies are reported as one JSON line: p50, p99, mean and throughput.
+// Without --socket a daemon is started in this process on a temporary
+// socket, so -j and --cache (decode tables, 0 for none) can be compared
+// directly.
+//
+// --bulk-clients adds clients that compress --bulk-size payloads back to
+// back for as long as the measured clients run, to show how the small
+// requests fare under bulk load; --interactive-bytes 0 puts every request
+// in the bulk class, for the latencies without priority classes. The
+// daemon's per-class statistics are included as "classes".
+//
+// Build: g++ -std=c++17 -O2 -pthread loadgen.cpp hashmap.cpp -o loadgen
+//
+// Usage: loadgen [--socket path] [--clients C] [--requests N] [--size S]
+//                [--kind text|json|telemetry|random|constant]
+//                [--op compress|decompress|mixed] [-j workers] [--cache tables]
+//                [--block-size N] [--bulk-clients B] [--bulk-size S]
+//                [--interactive-bytes N]
+//
+
+#include <iostream>
+#include <fstream>
+#include <unordered_map>
+#include <algorithm>
+#include <vector>
+#include <atomic>
+#include <math.h>
+#include <unistd.h>
+#include "hashmap.h"
+#include "bitstream.h"
+#include "util.h"
+#include "bench.h"
+#include "service.h"
+using namespace std;
+
+struct LoadOptions {
+    string socketPath;
+    int clients = 4;
+    int requests = 200; // per client
+    long long size = 64 * 1024;
+    string kind = "text";
+    string op = "decompress";
+    int bulkClients = 0;
+    long long bulkSize = 16 << 20;
+    ServiceOptions service;
+};
+
+//
+// runClient
+// Sends options.requests requests over one connection and appends each
+// one's latency in milliseconds to latencies.
+//
+void runClient(const LoadOptions &options, const string &raw, const string &container,
+               int client, vector<double> &latencies) {
+    ServiceClient connection(options.socketPath);
+    for(int r = 0; r < options.requests; r++){
+        bool compressing = options.op == "compress" || (options.op == "mixed" && (r + client) % 2 == 0);
+        auto start = chrono::steady_clock::now();
+        string result = compressing ? connection.compress(raw) : connection.decompress(container);
+        latencies.push_back(secondsSince(start) * 1000);
+        if(!compressing && result.size() != raw.size())
+            throw runtime_error("decompressed size does not match");
+    }
+}
+
+//
+// runBulkClient
+// Compresses raw over one connection until done is set; returns how many
+// requests it completed.
+//
+long long runBulkClient(const LoadOptions &options, const string &raw, const atomic<bool> &done) {
+    ServiceClient connection(options.socketPath);
+    long long requests = 0;
+    for(; !done; requests++)
+        connection.compress(raw);
+    return requests;
+}
+
+int main(int argc, char* argv[]) {
+    LoadOptions options;
+    options.service.workers = max(1u, thread::hardware_concurrency());
+    for(int i = 1; i < argc; i++){
+        string arg = argv[i];
+        if(i + 1 >= argc){
+            cerr << "Missing value for " << arg << endl;
+            return 2;
+        }
+        string value = argv[++i];
+        if(arg == "--socket")
+            options.socketPath = value;
+        else if(arg == "--clients")
+            options.clients = max(1, stoi(value));
+        else if(arg == "--requests")
+            options.requests = max(1, stoi(value));
+        else if(arg == "--size")
+            options.size = parseSize(value);
+        else if(arg == "--kind")
+            options.kind = value;
+        else if(arg == "--op")
+            options.op = value;
+        else if(arg == "-j")
+            options.service.workers = max(1, stoi(value));
+        else if(arg == "--cache")
+            options.service.cacheEntries = stoul(value);
+        else if(arg == "--block-size")
+            options.service.block.blockSize = parseSize(value);
+        else if(arg == "--bulk-clients")
+            options.bulkClients = max(0, stoi(value));
+        else if(arg == "--bulk-size")
+            options.bulkSize = parseSize(value);
+        else if(arg == "--interactive-bytes")
+            options.service.interactiveBytes = parseSize(value);
+        else {
+            cerr << "Unknown option " << arg << endl;
+            return 2;
+        }
+    }
+    if(options.op != "compress" && options.op != "decompress" && options.op != "mixed"){
+        cerr << "Unknown op " << options.op << endl;
+        return 2;
+    }
+
+    unique_ptr<CompressionService> service;
+    thread serviceThread;
+    try {
+        if(options.socketPath.empty()){
+            options.socketPath = "/tmp/huf-loadgen-" + to_string(getpid()) + ".sock";
+            options.service.socketPath = options.socketPath;
+            service.reset(new CompressionService(options.service));
+            serviceThread = thread([&]() { service->run(); });
+            service->waitUntilListening();
+        }
+
+        string raw = generateCorpus(options.kind, options.size, 251);
+        string container = ServiceClient(options.socketPath).compress(raw);
+
+        string bulk = options.bulkClients > 0 ? generateCorpus(options.kind, options.bulkSize, 257) : "";
+
+        vector<vector<double>> latencies(options.clients);
+        vector<long long> bulkRequests(options.bulkClients);
+        atomic<bool> measured{false};
+        vector<thread> bulkThreads;
+        for(int b = 0; b < options.bulkClients; b++)
+            bulkThreads.emplace_back([&, b]() {
+                try {
+                    bulkRequests[b] = runBulkClient(options, bulk, measured);
+                }
+                catch(exception &e) {
+                    cerr << "loadgen: bulk client: " << e.what() << endl;
+                }
+            });
+        // let the bulk jobs fill the queue before measuring
+        if(options.bulkClients > 0)
+            this_thread::sleep_for(chrono::milliseconds(100));
+        auto start = chrono::steady_clock::now();
+        try {
+            parallelFor(options.clients, options.clients, [&](size_t c) {
+                runClient(options, raw, container, (int)c, latencies[c]);
+            });
+        }
+        catch(exception &) {
+            measured = true;
+            for(thread &bulkThread : bulkThreads)
+                bulkThread.join();
+            throw;
+        }
+        double seconds = secondsSince(start);
+        measured = true;
+        for(thread &bulkThread : bulkThreads)
+            bulkThread.join();
+        long long bulkTotal = 0;
+        for(long long requests : bulkRequests)
+            bulkTotal += requests;
+
+        vector<double> all;
+        for(const vector<double> &client : latencies)
+            all.insert(all.end(), client.begin(), client.end());
+        double mean = 0;
+        for(double latency : all)
+            mean += latency / all.size();
+
+        cout << "{\"op\": \"" << options.op << "\", \"kind\": \"" << options.kind
+             << "\", \"size\": " << options.size << ", \"clients\": " << options.clients
+             << ", \"requests\": " << all.size() << ", \"p50_ms\": " << latencyPercentile(all, 50)
+             << ", \"p99_ms\": " << latencyPercentile(all, 99) << ", \"mean_ms\": " << mean
+             << ", \"requests_per_second\": " << all.size() / seconds;
+        if(options.bulkClients > 0)
+            cout << ", \"bulk_clients\": " << options.bulkClients << ", \"bulk_size\": " << options.bulkSize
+                 << ", \"bulk_requests\": " << bulkTotal;
+        cout << ", \"classes\": " << ServiceClient(options.socketPath).stats();
+        if(service != nullptr){
+            cout << ", \"workers\": " << options.service.workers << ", \"table_cache_hits\": "
+                 << service->tableCache().hits() << ", \"table_cache_misses\": "
+                 << service->tableCache().misses();
+            service->stop();
+            serviceThread.join();
+        }
+        cout << "}" << endl;
+    }
+    catch(exception &e) {
+        cerr << "loadgen: " << e.what() << endl;
+        if(serviceThread.joinable()){
+            service->stop();
+            serviceThread.join();
+        }
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,395 @@
+//
+// logs.h
+// Field templates for application log lines. A log block (BLOCK_LOGS)
+// expects lines of the form
+//   <timestamp> <level> <logger> <message>
+// where the timestamp is "YYYY-MM-DD[T ]HH:MM:SS[.,]fraction[Z]" with up
+// to 6 fraction digits, and level and logger are single words. Each field
+// gets its own model:
+//   kind       - per line: LOG_RAW_LINE for lines that do not fit the
+//                template, else 1 + the timestamp format (_timestampFormat)
+//   time       - timestamp minus the previous line's, zigzag LEB128 bytes
+//   level      - index into the block's level dictionary
+//   logger     - index into the block's logger dictionary
+//   dictionary - the text of every dictionary entry, in the order entries
+//                are first used, each followed by CSV_FIELD_END
+//   message    - the rest of the line (or the whole of a raw line), each
+//                followed by CSV_FIELD_END
+// An index equal to the current dictionary size means "new entry": its
+// text is the next one in the dictionary stream. When the block does not
+// end with a newline the kind stream ends with LOG_NO_NEWLINE. Lines that
+// do not parse are kept verbatim, so any input round-trips.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio> // for snprintf
+#include <cstring> // for memchr
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "columns.h" // for CSV_FIELD_END and _putVarint
+using namespace std;
+
+// block flags
+const uint8_t BLOCK_LOGS = 0x80;
+
+const int LOG_RAW_LINE = 0;
+const int LOG_NO_NEWLINE = 255; // above every 1 + timestamp format
+// entries per dictionary per block; indexes are coded as one byte symbol,
+// so later new words make raw lines
+const size_t MAX_LOG_DICTIONARY = 256;
+const size_t MAX_LOG_TOKEN = 64; // longer levels or loggers make a raw line
+const int MAX_LOG_FRACTION = 6; // so the timestamp fits in an int64
+
+enum LogStream {
+    LOG_KIND,
+    LOG_TIME,
+    LOG_LEVEL,
+    LOG_LOGGER,
+    LOG_DICTIONARY,
+    LOG_MESSAGE,
+    NUM_LOG_STREAMS
+};
+
+//
+// _daysFromCivil / _civilFromDays
+// Days since 1970-01-01 for a proleptic Gregorian date, and back.
+//
+int64_t _daysFromCivil(int64_t year, int64_t month, int64_t day) {
+    year -= month <= 2;
+    int64_t era = (year >= 0 ? year : year - 399) / 400;
+    int64_t yearOfEra = year - era * 400;
+    int64_t dayOfYear = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    int64_t dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    return era * 146097 + dayOfEra - 719468;
+}
+
+void _civilFromDays(int64_t days, int64_t &year, int &month, int &day) {
+    days += 719468;
+    int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+    int64_t dayOfEra = days - era * 146097;
+    int64_t yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+    int64_t dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+    int64_t mp = (5 * dayOfYear + 2) / 153;
+    day = (int)(dayOfYear - (153 * mp + 2) / 5 + 1);
+    month = (int)(mp < 10 ? mp + 3 : mp - 9);
+    year = yearOfEra + era * 400 + (month <= 2);
+}
+
+//
+// _timestampFormat
+// Packs the layout of a timestamp into one symbol: bit 0 'T' (else space)
+// between date and time, bits 1-2 the fraction separator (none, '.', ','),
+// bits 3-5 the fraction digits, bit 6 a trailing 'Z'.
+//
+int _timestampFormat(bool t, int fractionSeparator, int digits, bool zulu) {
+    return (t ? 1 : 0) | (fractionSeparator << 1) | (digits << 3) | (zulu ? 0x40 : 0);
+}
+
+//
+// formatTimestamp
+// Writes value (in 10^-digits seconds since the epoch) in the given format.
+// Throws when it is out of the four digit year range.
+//
+string formatTimestamp(int64_t value, int format) {
+    int digits = (format >> 3) & 7;
+    int fractionSeparator = (format >> 1) & 3;
+    int64_t scale = 1;
+    for(int i = 0; i < digits; i++)
+        scale *= 10;
+    int64_t seconds = value / scale, fraction = value % scale;
+    if(fraction < 0){
+        fraction += scale;
+        seconds--;
+    }
+    int64_t days = seconds / 86400, secondOfDay = seconds % 86400;
+    if(secondOfDay < 0){
+        secondOfDay += 86400;
+        days--;
+    }
+    int64_t year;
+    int month, day;
+    _civilFromDays(days, year, month, day);
+    if(year < 0 || year > 9999 || digits > MAX_LOG_FRACTION || fractionSeparator == 3)
+        throw runtime_error("corrupt log block: bad timestamp");
+
+    char text[48];
+    int length = snprintf(text, sizeof(text), "%04d-%02d-%02d%c%02d:%02d:%02d", (int)year, month,
+                          day, (format & 1) ? 'T' : ' ', (int)(secondOfDay / 3600),
+                          (int)(secondOfDay / 60 % 60), (int)(secondOfDay % 60));
+    if(fractionSeparator != 0)
+        length += snprintf(text + length, sizeof(text) - length, "%c%0*lld",
+                           fractionSeparator == 1 ? '.' : ',', digits, (long long)fraction);
+    if(format & 0x40)
+        text[length++] = 'Z';
+    return string(text, length);
+}
+
+//
+// _digits
+// Parses n decimal digits at p into value; false if any is not a digit.
+//
+bool _digits(const char* p, int n, int64_t &value) {
+    value = 0;
+    for(int i = 0; i < n; i++){
+        if(p[i] < '0' || p[i] > '9')
+            return false;
+        value = value * 10 + (p[i] - '0');
+    }
+    return true;
+}
+
+//
+// parseTimestamp
+// Parses a timestamp at the start of p[0..n). On success sets value,
+// format and length (the bytes used); it only succeeds when
+// formatTimestamp gives back exactly the same text.
+//
+bool parseTimestamp(const char* p, size_t n, int64_t &value, int &format, size_t &length) {
+    int64_t year, month, day, hour, minute, second;
+    if(n < 19 || p[4] != '-' || p[7] != '-' || (p[10] != 'T' && p[10] != ' ') ||
+       p[13] != ':' || p[16] != ':')
+        return false;
+    if(!_digits(p, 4, year) || !_digits(p + 5, 2, month) || !_digits(p + 8, 2, day) ||
+       !_digits(p + 11, 2, hour) || !_digits(p + 14, 2, minute) || !_digits(p + 17, 2, second))
+        return false;
+    if(month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 || minute > 59 || second > 59)
+        return false;
+
+    length = 19;
+    int fractionSeparator = 0, digits = 0;
+    int64_t fraction = 0;
+    if(length < n && (p[length] == '.' || p[length] == ',')){
+        fractionSeparator = p[length] == '.' ? 1 : 2;
+        length++;
+        while(length + digits < n && p[length + digits] >= '0' && p[length + digits] <= '9')
+            digits++;
+        if(digits == 0 || digits > MAX_LOG_FRACTION)
+            return false;
+        _digits(p + length, digits, fraction);
+        length += digits;
+    }
+    bool zulu = length < n && p[length] == 'Z';
+    if(zulu)
+        length++;
+
+    int64_t scale = 1;
+    for(int i = 0; i < digits; i++)
+        scale *= 10;
+    value = ((_daysFromCivil(year, month, day) * 86400) + hour * 3600 + minute * 60 + second) *
+            scale + fraction;
+    format = _timestampFormat(p[10] == 'T', fractionSeparator, digits, zulu);
+    // rejects dates like 02-30 that would come back as a different day
+    return formatTimestamp(value, format).compare(0, length, p, length) == 0;
+}
+
+//
+// _token
+// Length of the word at p[0..n) if it is followed by a space and is at
+// most MAX_LOG_TOKEN bytes, else 0.
+//
+size_t _token(const char* p, size_t n) {
+    size_t length = 0;
+    while(length < n && length <= MAX_LOG_TOKEN && p[length] != ' ')
+        length++;
+    return (length < n && length <= MAX_LOG_TOKEN) ? length : 0;
+}
+
+//
+// LogDictionary
+// The per-block dictionary of levels or loggers on the encoding side.
+//
+struct LogDictionary {
+    unordered_map<string, int> index;
+
+    //
+    // fits
+    // True when word is already in the dictionary or there is room for it.
+    //
+    bool fits(const string &word) const {
+        return index.size() < MAX_LOG_DICTIONARY || index.count(word) > 0;
+    }
+
+    //
+    // code
+    // Appends word's index (or the new entry index and its text) to the
+    // streams.
+    //
+    void code(const string &word, vector<int> &indexes, vector<int> &text) {
+        auto found = index.find(word);
+        if(found != index.end()){
+            indexes.push_back(found->second);
+            return;
+        }
+        int next = index.size();
+        index[word] = next;
+        indexes.push_back(next);
+        text.insert(text.end(), (const unsigned char*)word.data(),
+                    (const unsigned char*)word.data() + word.size());
+        text.push_back(CSV_FIELD_END);
+    }
+};
+
+//
+// splitLogLines
+// Splits raw into the NUM_LOG_STREAMS symbol streams described at the top
+// of this file.
+//
+vector<vector<int>> splitLogLines(const string &raw) {
+    vector<vector<int>> streams(NUM_LOG_STREAMS);
+    LogDictionary levels, loggers;
+    int64_t previous = 0;
+    const char* data = raw.data();
+    size_t start = 0;
+    while(start < raw.size()){
+        const char* newline = (const char*)memchr(data + start, '\n', raw.size() - start);
+        size_t end = newline ? newline - data : raw.size();
+        const char* line = data + start;
+        size_t n = end - start;
+
+        int64_t value = 0;
+        int format = 0;
+        size_t length = 0, levelLength = 0, loggerLength = 0;
+        string level, logger;
+        bool templated = parseTimestamp(line, n, value, format, length) && length < n &&
+                         line[length] == ' ';
+        if(templated){
+            length++;
+            levelLength = _token(line + length, n - length);
+            templated = levelLength > 0;
+        }
+        if(templated){
+            level.assign(line + length, levelLength);
+            length += levelLength + 1;
+            loggerLength = _token(line + length, n - length);
+            templated = loggerLength > 0;
+        }
+        if(templated){
+            logger.assign(line + length, loggerLength);
+            length += loggerLength + 1;
+            templated = levels.fits(level) && loggers.fits(logger);
+        }
+
+        vector<int> &message = streams[LOG_MESSAGE];
+        if(templated){
+            streams[LOG_KIND].push_back(1 + format);
+            int64_t delta = value - previous;
+            _putVarint(streams[LOG_TIME], ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+            previous = value;
+            levels.code(level, streams[LOG_LEVEL], streams[LOG_DICTIONARY]);
+            loggers.code(logger, streams[LOG_LOGGER], streams[LOG_DICTIONARY]);
+            message.insert(message.end(), (const unsigned char*)line + length,
+                           (const unsigned char*)line + n);
+        }
+        else {
+            streams[LOG_KIND].push_back(LOG_RAW_LINE);
+            message.insert(message.end(), (const unsigned char*)line, (const unsigned char*)line + n);
+        }
+        message.push_back(CSV_FIELD_END);
+        if(!newline)
+            streams[LOG_KIND].push_back(LOG_NO_NEWLINE);
+        start = end + 1;
+    }
+    return streams;
+}
+
+//
+// _LogReader
+// Cursor over one decoded log stream that throws instead of running off
+// the end.
+//
+struct _LogReader {
+    const vector<int> &symbols;
+    size_t next = 0;
+
+    int symbol() {
+        if(next == symbols.size())
+            throw runtime_error("corrupt log block: stream ends early");
+        return symbols[next++];
+    }
+
+    void text(string &out) {
+        for(int symbol = this->symbol(); symbol != CSV_FIELD_END; symbol = this->symbol()){
+            if(symbol > 0xFF)
+                throw runtime_error("corrupt log block: symbol out of range");
+            out += (char)symbol;
+        }
+    }
+
+    uint64_t varint() {
+        uint64_t value = 0;
+        for(int shift = 0; shift < 64; shift += 7){
+            int byte = symbol();
+            if(byte > 0xFF)
+                throw runtime_error("corrupt log block: symbol out of range");
+            value |= (uint64_t)(byte & 0x7F) << shift;
+            if((byte & 0x80) == 0)
+                return value;
+        }
+        throw runtime_error("corrupt log block: varint too long");
+    }
+
+    bool done() const {
+        return next == symbols.size();
+    }
+};
+
+//
+// _dictionaryWord
+// Looks up (or, for the new entry index, reads and adds) a dictionary word.
+//
+const string &_dictionaryWord(vector<string> &words, int index, _LogReader &text) {
+    if(index == (int)words.size() && words.size() < MAX_LOG_DICTIONARY){
+        words.emplace_back();
+        text.text(words.back());
+    }
+    if(index < 0 || index >= (int)words.size())
+        throw runtime_error("corrupt log block: bad dictionary index");
+    return words[index];
+}
+
+//
+// joinLogLines
+// Inverse of splitLogLines.
+//
+string joinLogLines(const vector<vector<int>> &streams, size_t sizeHint) {
+    if(streams.size() != NUM_LOG_STREAMS)
+        throw runtime_error("corrupt log block: wrong number of streams");
+    _LogReader kinds{streams[LOG_KIND]}, times{streams[LOG_TIME]}, levelIndexes{streams[LOG_LEVEL]},
+        loggerIndexes{streams[LOG_LOGGER]}, dictionary{streams[LOG_DICTIONARY]},
+        messages{streams[LOG_MESSAGE]};
+    vector<string> levels, loggers;
+    int64_t previous = 0;
+    string raw;
+    raw.reserve(sizeHint);
+    while(!kinds.done()){
+        int kind = kinds.symbol();
+        if(kind != LOG_RAW_LINE){
+            if(kind < 1 || kind >= LOG_NO_NEWLINE)
+                throw runtime_error("corrupt log block: bad line kind");
+            uint64_t zigzag = times.varint();
+            previous += (int64_t)((zigzag >> 1) ^ (0 - (zigzag & 1)));
+            raw += formatTimestamp(previous, kind - 1);
+            raw += ' ';
+            raw += _dictionaryWord(levels, levelIndexes.symbol(), dictionary);
+            raw += ' ';
+            raw += _dictionaryWord(loggers, loggerIndexes.symbol(), dictionary);
+            raw += ' ';
+        }
+        messages.text(raw);
+        if(!kinds.done() && streams[LOG_KIND][kinds.next] == LOG_NO_NEWLINE){
+            kinds.next++;
+            if(!kinds.done())
+                throw runtime_error("corrupt log block: line kinds after the last line");
+        }
+        else
+            raw += '\n';
+    }
+    if(!times.done() || !levelIndexes.done() || !loggerIndexes.done() || !dictionary.done() ||
+       !messages.done())
+        throw runtime_error("corrupt log block: streams have extra symbols");
+    return raw;
+}
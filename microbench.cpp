@@ -0,0 +1,267 @@
+//
+// microbench.cpp
+// Microbenchmarks for the primitives the compression hot paths depend on:
+//   hashmap - hashmap get/put/containsKey vs std::unordered_map vs a flat array
+//   tree    - buildEncodingTree across alphabet sizes and distributions
+//   bitio   - ofbitstream::writeBit / ifbitstream::readBit vs BitWriter/BitReader
+// Each one runs in isolation and prints one JSON line per measurement.
+//
+// Build: g++ -std=c++17 -O2 microbench.cpp hashmap.cpp -o microbench
+//
+// Usage: microbench <hashmap|tree|bitio|all> [--n ops] [--alphabet A]
+//                   [--dist uniform|zipf|geometric] [--reps R]
+//
+
+#include <iostream>
+#include <fstream>
+#include <unordered_map>
+#include <algorithm>
+#include <vector>
+#include <math.h>
+#include "hashmap.h"
+#include "bitstream.h"
+#include "util.h"
+#include "bench.h"
+#include "bitbuffer.h"
+using namespace std;
+
+struct MicroOptions {
+    long long n = 1000000;
+    int alphabet = 256;
+    string dist = "zipf";
+    int reps = 5;
+};
+
+// keeps results alive so the optimizer cannot drop the measured work
+volatile long long sink;
+
+//
+// drawSymbols
+// Returns n symbols in [0, alphabet) drawn from the named distribution.
+//
+vector<int> drawSymbols(long long n, int alphabet, string dist, unsigned seed) {
+    mt19937_64 rng(seed);
+    vector<int> symbols(n);
+    for(long long i = 0; i < n; i++){
+        if(dist == "uniform")
+            symbols[i] = rng() % alphabet;
+        else if(dist == "geometric")
+            symbols[i] = min(alphabet - 1, (int)__builtin_ctzll(rng() | (1ULL << 63)));
+        else
+            symbols[i] = _zipfIndex(rng, alphabet);
+    }
+    return symbols;
+}
+
+//
+// bestOf
+// Runs body reps times and returns the fastest time in seconds.
+//
+template <typename Body>
+double bestOf(int reps, Body body) {
+    double best = 1e30;
+    for(int r = 0; r < reps; r++){
+        auto start = chrono::steady_clock::now();
+        body();
+        best = min(best, secondsSince(start));
+    }
+    return best;
+}
+
+//
+// report
+// Prints one measurement as a JSON line.
+//
+void report(string bench, string impl, MicroOptions &opt, double seconds, long long ops) {
+    cout << "{\"bench\": \"" << bench << "\", \"impl\": \"" << impl << "\""
+         << ", \"n\": " << opt.n << ", \"alphabet\": " << opt.alphabet
+         << ", \"dist\": \"" << opt.dist << "\""
+         << ", \"ns_per_op\": " << (ops > 0 ? seconds * 1e9 / ops : 0) << "}" << endl;
+}
+
+//
+// benchHashmap
+// Times the frequency counting access pattern (containsKey, get, put) and a
+// read-only get pass on each map implementation.
+//
+void benchHashmap(MicroOptions &opt) {
+    vector<int> keys = drawSymbols(opt.n, opt.alphabet, opt.dist, 1);
+
+    double t = bestOf(opt.reps, [&]() {
+        hashmap map;
+        for(int key : keys){
+            if(map.containsKey(key))
+                map.put(key, map.get(key) + 1);
+            else
+                map.put(key, 1);
+        }
+        sink = map.size();
+    });
+    report("hashmap.count", "hashmap", opt, t, opt.n);
+
+    t = bestOf(opt.reps, [&]() {
+        unordered_map<int, int> map;
+        for(int key : keys)
+            map[key]++;
+        sink = map.size();
+    });
+    report("hashmap.count", "unordered_map", opt, t, opt.n);
+
+    t = bestOf(opt.reps, [&]() {
+        vector<int> counts(opt.alphabet, 0);
+        for(int key : keys)
+            counts[key]++;
+        sink = counts[0];
+    });
+    report("hashmap.count", "flat_array", opt, t, opt.n);
+
+    hashmap map;
+    unordered_map<int, int> umap;
+    vector<int> counts(opt.alphabet, 0);
+    for(int key : keys){
+        map.put(key, key);
+        umap[key] = key;
+        counts[key] = key;
+    }
+
+    t = bestOf(opt.reps, [&]() {
+        long long sum = 0;
+        for(int key : keys)
+            sum += map.get(key);
+        sink = sum;
+    });
+    report("hashmap.get", "hashmap", opt, t, opt.n);
+
+    t = bestOf(opt.reps, [&]() {
+        long long sum = 0;
+        for(int key : keys)
+            sum += umap.find(key)->second;
+        sink = sum;
+    });
+    report("hashmap.get", "unordered_map", opt, t, opt.n);
+
+    t = bestOf(opt.reps, [&]() {
+        long long sum = 0;
+        for(int key : keys)
+            sum += counts[key];
+        sink = sum;
+    });
+    report("hashmap.get", "flat_array", opt, t, opt.n);
+}
+
+//
+// benchTree
+// Times buildEncodingTree on frequency maps with alphabets from 2 symbols up
+// to the requested alphabet size, growing 4 times each step and always
+// ending with the requested size itself.
+//
+void benchTree(MicroOptions &opt) {
+    int maxAlphabet = opt.alphabet;
+    for(int alphabet = 2; alphabet <= maxAlphabet; alphabet = min(alphabet * 4, maxAlphabet)){
+        MicroOptions cur = opt;
+        cur.alphabet = alphabet;
+        vector<int> symbols = drawSymbols(cur.n, alphabet, cur.dist, 2);
+        hashmapF map;
+        vector<int> counts(alphabet, 0);
+        for(int symbol : symbols)
+            counts[symbol]++;
+        // skip over the PSEUDO_EOF and NOT_A_CHAR values for large alphabets
+        for(int symbol = 0; symbol < alphabet; symbol++)
+            if(counts[symbol] > 0)
+                map.put(symbol < PSEUDO_EOF ? symbol : symbol + 2, counts[symbol]);
+        map.put(PSEUDO_EOF, 1);
+
+        const int builds = max(1, (int)(200000 / alphabet));
+        double t = bestOf(cur.reps, [&]() {
+            for(int i = 0; i < builds; i++){
+                HuffmanNode* tree = buildEncodingTree(map);
+                sink = tree->count;
+                freeTree(tree);
+            }
+        });
+        report("buildEncodingTree", "priority_queue", cur, t, builds);
+        if(alphabet == maxAlphabet)
+            break;
+    }
+}
+
+//
+// benchBitIO
+// Times per-bit writes and reads through the file bitstreams and through
+// the in-memory word-level BitWriter/BitReader.
+//
+void benchBitIO(MicroOptions &opt) {
+    vector<int> bits = drawSymbols(opt.n, 2, "uniform", 3);
+    string path = "microbench_bits.tmp";
+
+    double t = bestOf(opt.reps, [&]() {
+        ofbitstream output(path);
+        for(int bit : bits)
+            output.writeBit(bit);
+        output.close();
+    });
+    report("bitio.write", "ofbitstream", opt, t, opt.n);
+
+    t = bestOf(opt.reps, [&]() {
+        ifbitstream input(path);
+        long long sum = 0;
+        for(long long i = 0; i < opt.n; i++)
+            sum += input.readBit();
+        sink = sum;
+    });
+    report("bitio.read", "ifbitstream", opt, t, opt.n);
+    remove(path.c_str());
+
+    string bytes;
+    t = bestOf(opt.reps, [&]() {
+        BitWriter writer;
+        for(int bit : bits)
+            writer.writeBit(bit);
+        writer.flush();
+        bytes = writer.bytes();
+    });
+    report("bitio.write", "BitWriter", opt, t, opt.n);
+
+    t = bestOf(opt.reps, [&]() {
+        BitReader reader(bytes.data(), bytes.size());
+        long long sum = 0;
+        for(long long i = 0; i < opt.n; i++)
+            sum += reader.readBit();
+        sink = sum;
+    });
+    report("bitio.read", "BitReader", opt, t, opt.n);
+}
+
+int main(int argc, char* argv[]) {
+    if(argc < 2){
+        cerr << "Usage: microbench <hashmap|tree|bitio|all> [--n ops] [--alphabet A]"
+             << " [--dist uniform|zipf|geometric] [--reps R]" << endl;
+        return 2;
+    }
+    string which = argv[1];
+    MicroOptions opt;
+    for(int i = 2; i + 1 < argc; i += 2){
+        string arg = argv[i];
+        string value = argv[i + 1];
+        if(arg == "--n")
+            opt.n = stoll(value);
+        else if(arg == "--alphabet")
+            opt.alphabet = stoi(value);
+        else if(arg == "--dist")
+            opt.dist = value;
+        else if(arg == "--reps")
+            opt.reps = stoi(value);
+        else {
+            cerr << "Unknown option " << arg << endl;
+            return 2;
+        }
+    }
+
+    if(which == "hashmap" || which == "all")
+        benchHashmap(opt);
+    if(which == "tree" || which == "all")
+        benchTree(opt);
+    if(which == "bitio" || which == "all")
+        benchBitIO(opt);
+    return 0;
+}
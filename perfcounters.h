@@ -0,0 +1,191 @@
+//
+// perfcounters.h
+// Hardware performance counters through Linux perf_event_open, used by the
+// benchmark harness to tell whether a stage is bound by branch misses (the
+// decode() tree walk) or cache misses (table lookups). Each counter is
+// opened on its own, so a CPU or kernel that lacks one event still reports
+// the rest, and when perf events are not permitted at all (for example
+// kernel.perf_event_paranoid > 2, or inside many containers) every value
+// reads as -1 and the benchmark carries on without them. Counters opened
+// on their own are multiplexed when the PMU has too few slots, so each
+// count is scaled by the time its event was enabled over the time it was
+// actually counting.
+//
+
+#pragma once
+
+#include <cerrno>
+#include <cstring> // for memset, strerror
+#include <string>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+using namespace std;
+
+enum PerfEvent {
+    PERF_EV_CYCLES,
+    PERF_EV_INSTRUCTIONS,
+    PERF_EV_BRANCH_MISSES,
+    PERF_EV_L1D_MISSES,
+    PERF_EV_LLC_MISSES,
+    NUM_PERF_EVENTS
+};
+
+const char* const PERF_EVENT_NAMES[NUM_PERF_EVENTS] = {"cycles", "instructions",
+                                                       "branch_misses", "l1d_misses",
+                                                       "llc_misses"};
+
+class PerfCounters {
+public:
+    PerfCounters() {
+        for(int e = 0; e < NUM_PERF_EVENTS; e++){
+            fds[e] = -1;
+            values[e] = -1;
+        }
+    }
+
+    ~PerfCounters() {
+#ifdef __linux__
+        for(int e = 0; e < NUM_PERF_EVENTS; e++)
+            if(fds[e] >= 0)
+                close(fds[e]);
+#endif
+    }
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    //
+    // open
+    // Opens every counter this process is allowed to use. Returns false (and
+    // sets error) when none of them could be opened.
+    //
+    bool open() {
+#ifdef __linux__
+        const unsigned long long cacheMiss = PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                                             PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+        const pair<unsigned, unsigned long long> config[NUM_PERF_EVENTS] = {
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+            {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+            {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | cacheMiss},
+            {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | cacheMiss}};
+
+        int opened = 0;
+        for(int e = 0; e < NUM_PERF_EVENTS; e++){
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = config[e].first;
+            attr.config = config[e].second;
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            fds[e] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+            if(fds[e] >= 0)
+                opened++;
+            else if(error.empty())
+                error = string("perf_event_open: ") + strerror(errno);
+        }
+        if(opened > 0)
+            error.clear();
+        return opened > 0;
+#else
+        error = "perf events are only supported on Linux";
+        return false;
+#endif
+    }
+
+    //
+    // available
+    // True when at least one counter is open.
+    //
+    bool available() const {
+        for(int e = 0; e < NUM_PERF_EVENTS; e++)
+            if(fds[e] >= 0)
+                return true;
+        return false;
+    }
+
+    //
+    // start
+    // Zeroes and enables every open counter. The enabled and running times
+    // are not reset, so they are noted here for stop().
+    //
+    void start() {
+#ifdef __linux__
+        for(int e = 0; e < NUM_PERF_EVENTS; e++){
+            if(fds[e] >= 0){
+                ioctl(fds[e], PERF_EVENT_IOC_RESET, 0);
+                _Reading reading;
+                if(!_read(fds[e], reading))
+                    reading = {0, 0, 0};
+                startEnabled[e] = reading.enabled;
+                startRunning[e] = reading.running;
+                ioctl(fds[e], PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+#endif
+    }
+
+    //
+    // stop
+    // Disables the counters and latches their values for value(), scaled
+    // up for the time each was multiplexed out. A counter that never got
+    // to run reads as -1.
+    //
+    void stop() {
+#ifdef __linux__
+        for(int e = 0; e < NUM_PERF_EVENTS; e++){
+            values[e] = -1;
+            if(fds[e] >= 0){
+                ioctl(fds[e], PERF_EVENT_IOC_DISABLE, 0);
+                _Reading reading;
+                if(!_read(fds[e], reading))
+                    continue;
+                unsigned long long enabled = reading.enabled - startEnabled[e];
+                unsigned long long running = reading.running - startRunning[e];
+                if(running == 0)
+                    continue;
+                values[e] = running >= enabled ? (long long)reading.count :
+                            (long long)((long double)reading.count * enabled / running);
+            }
+        }
+#endif
+    }
+
+    //
+    // value
+    // The count from the last start()/stop() pair, or -1 if unavailable.
+    //
+    long long value(PerfEvent event) const {
+        return values[event];
+    }
+
+    string error;
+
+private:
+    // what read() returns with the read_format set in open()
+    struct _Reading {
+        unsigned long long count;
+        unsigned long long enabled;
+        unsigned long long running;
+    };
+
+    static bool _read(int fd, _Reading &reading) {
+#ifdef __linux__
+        return read(fd, &reading, sizeof(reading)) == sizeof(reading);
+#else
+        return false;
+#endif
+    }
+
+    int fds[NUM_PERF_EVENTS];
+    long long values[NUM_PERF_EVENTS];
+    unsigned long long startEnabled[NUM_PERF_EVENTS] = {};
+    unsigned long long startRunning[NUM_PERF_EVENTS] = {};
+};
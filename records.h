@@ -0,0 +1,148 @@
+//
+// records.h
+// Batch coding of many short strings (database column values, keys,
+// log fields) with one shared table. Coding each record on its own pays
+// for a frequency header per record, which for short values is larger
+// than the value; compress() on a string that is not a file name codes
+// one string and writes it to disk. compressRecords() builds one
+// histogram over the whole batch and packs every record's codes back to
+// back into one buffer:
+//
+//   header  - the frequency map as hashmap's << writes it (as in block.h),
+//             with PSEUDO_EOF so every code is at least one bit long
+//   bits    - the records' codes, each starting at the bit where the one
+//             before it ends; no EOF code and no padding between records
+//   offsets - the bit where each record starts, plus the total bit count,
+//             so record i is bits [offsets[i], offsets[i + 1])
+//
+// Any record decodes on its own from its bit range; RecordDecoder builds
+// the tree once (through decodeTableFor, so the table caches apply) for
+// decoding many of them.
+//
+
+#pragma once
+
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "block.h" // for scaledFrequencyMap, buildCodeTable, writeCode and decodeTableFor
+using namespace std;
+
+struct RecordBatch {
+    string header;
+    string bits;
+    vector<uint64_t> offsets; // records + 1 entries
+
+    size_t size() const {
+        return offsets.empty() ? 0 : offsets.size() - 1;
+    }
+};
+
+//
+// compressRecords
+// Codes every record with one table built from all of them.
+//
+RecordBatch compressRecords(const vector<string_view> &records) {
+    vector<long long> counts(256, 0);
+    for(string_view record : records)
+        for(char c : record)
+            counts[(unsigned char)c]++;
+    hashmapF map = scaledFrequencyMap(counts);
+
+    HuffmanNode* root = buildEncodingTree(map);
+    vector<HuffmanCode> table = buildCodeTable(root, PSEUDO_EOF);
+    freeTree(root);
+
+    RecordBatch batch;
+    stringstream header;
+    header << map;
+    batch.header = header.str();
+    batch.offsets.reserve(records.size() + 1);
+    BitWriter writer;
+    for(string_view record : records){
+        batch.offsets.push_back(writer.bitCount());
+        for(char c : record)
+            writeCode(writer, table[(unsigned char)c]);
+    }
+    batch.offsets.push_back(writer.bitCount());
+    writer.flush();
+    batch.bits = writer.bytes();
+    return batch;
+}
+
+class RecordDecoder {
+public:
+    //
+    // RecordDecoder
+    // Builds (or finds) the table of batch, which must outlive the decoder.
+    // Throws runtime_error when the header or the offsets are malformed.
+    //
+    explicit RecordDecoder(const RecordBatch &batch) : batch(batch), tree(decodeTableFor(batch.header)) {
+        for(size_t i = 0; i + 1 < batch.offsets.size(); i++)
+            if(batch.offsets[i] > batch.offsets[i + 1])
+                throw runtime_error("corrupt record batch: offsets go backwards");
+        if(!batch.offsets.empty() && batch.offsets.back() > (uint64_t)batch.bits.size() * 8)
+            throw runtime_error("corrupt record batch: offsets past the end of the bits");
+    }
+
+    size_t size() const {
+        return batch.size();
+    }
+
+    //
+    // record
+    // Decodes record i alone. Throws out_of_range for a bad index and
+    // runtime_error when its bits do not end on a code boundary.
+    //
+    string record(size_t i) const {
+        if(i >= batch.size())
+            throw out_of_range("record index out of range");
+        uint64_t start = batch.offsets[i], end = batch.offsets[i + 1];
+        size_t firstByte = start / 8;
+        BitReader reader(batch.bits.data() + firstByte, (end + 7) / 8 - firstByte);
+        for(uint64_t skip = start % 8; skip > 0; skip--)
+            reader.readBit();
+
+        string out;
+        uint64_t length = end - start;
+        HuffmanNode* node = tree->root;
+        while((uint64_t)(reader.bitPosition() - start % 8) < length){
+            node = reader.readBit() ? node->one : node->zero;
+            if(node == nullptr)
+                throw runtime_error("corrupt record batch: code leaves the encoding tree");
+            if(node->character == NOT_A_CHAR)
+                continue;
+            if(node->character == PSEUDO_EOF)
+                throw runtime_error("corrupt record batch: EOF code inside a record");
+            out += (char)node->character;
+            node = tree->root;
+        }
+        if(node != tree->root)
+            throw runtime_error("corrupt record batch: record ends inside a code");
+        return out;
+    }
+
+    string operator[](size_t i) const {
+        return record(i);
+    }
+
+private:
+    const RecordBatch &batch;
+    shared_ptr<const DecodeTable> tree;
+};
+
+//
+// decompressRecords
+// Decodes every record of batch, in order.
+//
+vector<string> decompressRecords(const RecordBatch &batch) {
+    RecordDecoder decoder(batch);
+    vector<string> records;
+    records.reserve(decoder.size());
+    for(size_t i = 0; i < decoder.size(); i++)
+        records.push_back(decoder.record(i));
+    return records;
+}
@@ -0,0 +1,129 @@
+//
+// scheduler.h
+// A shared memory budget for running many block compressions at once
+// (huf sync -j N --memory M). Every batch of blocks a compression reads
+// and encodes first takes its working memory from a BufferPool, and gives
+// it back once the blocks are written. When the budget is used up,
+// compressions wait instead of allocating, so running more of them at
+// once slows each one down rather than running the machine out of memory.
+//
+// A compression that has already written blocks is in flight; its
+// requests are served before any compression waiting to start, so
+// files that are under way finish first and their memory returns to the
+// pool for good. Only the first block of a batch is waited for; more
+// blocks are added to the batch only while memory is free, so under
+// pressure each file goes one block at a time.
+//
+
+#pragma once
+
+#include <algorithm> // for min
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#ifdef __GLIBC__
+#include <malloc.h> // for mallopt
+#endif
+using namespace std;
+
+//
+// keepLargeBuffersMapped
+// glibc serves a large allocation from mmap only until the first one is
+// freed; after that it raises the threshold and keeps freed block buffers
+// in each thread's heap, so memory handed back to a BufferPool is not
+// handed back to the system and the process grows past the budget.
+// Fixing the threshold keeps every block sized buffer in its own mapping.
+//
+void keepLargeBuffersMapped() {
+#ifdef __GLIBC__
+    mallopt(M_MMAP_THRESHOLD, 1 << 20);
+#endif
+}
+
+class BufferPool {
+public:
+    explicit BufferPool(size_t budget) : budget(budget) {}
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    //
+    // acquire
+    // Waits until bytes fit in the budget and takes them. inFlight marks
+    // a compression that has written blocks already (see the top of this
+    // file). A request larger than the whole budget is cut down to the
+    // budget, so it runs alone instead of never. Returns the bytes taken,
+    // to be handed back to release().
+    //
+    size_t acquire(size_t bytes, bool inFlight) {
+        bytes = min(bytes, budget);
+        unique_lock<mutex> guard(lock);
+        if(inFlight)
+            inFlightWaiting++;
+        changed.wait(guard, [&]() {
+            return used + bytes <= budget && (inFlight || inFlightWaiting == 0);
+        });
+        if(inFlight)
+            inFlightWaiting--;
+        used += bytes;
+        peakUsed = max(peakUsed, used);
+        return bytes;
+    }
+
+    //
+    // tryAcquire
+    // Takes bytes only when they fit right now and nobody in flight is
+    // waiting for memory.
+    //
+    bool tryAcquire(size_t bytes) {
+        lock_guard<mutex> guard(lock);
+        if(used + bytes > budget || inFlightWaiting > 0)
+            return false;
+        used += bytes;
+        peakUsed = max(peakUsed, used);
+        return true;
+    }
+
+    //
+    // release
+    // Hands back bytes taken with acquire or tryAcquire.
+    //
+    void release(size_t bytes) {
+        {
+            lock_guard<mutex> guard(lock);
+            used -= bytes;
+        }
+        changed.notify_all();
+    }
+
+    //
+    // peak
+    // The most memory that was taken at once.
+    //
+    size_t peak() {
+        lock_guard<mutex> guard(lock);
+        return peakUsed;
+    }
+
+private:
+    mutex lock;
+    condition_variable changed;
+    size_t budget;
+    size_t used = 0;
+    size_t peakUsed = 0;
+    int inFlightWaiting = 0;
+};
+
+//
+// PoolLease
+// Memory taken from a BufferPool, released when it goes out of scope
+// (also when encoding throws).
+//
+struct PoolLease {
+    BufferPool* pool = nullptr;
+    size_t bytes = 0;
+    ~PoolLease() {
+        if(pool != nullptr && bytes > 0)
+            pool->release(bytes);
+    }
+};
@@ -0,0 +1,603 @@
+//
+// service.h
+// A long running compression daemon on a Unix domain socket (huf serve),
+// and the client library that talks to it. One process keeps its worker
+// threads and its decode table cache (tablecache.h) warm across requests,
+// so a request pays neither for starting a process nor, for headers it
+// has seen before, for parsing them and building their trees.
+//
+//   request  := op:u8 length:u64 payload     op 'C' compress, 'D' decompress
+//   response := status:u8 length:u64 payload status 0 ok, 1 error (payload
+//                                            is then the message)
+//
+// Compress turns the payload into a block container with the server's
+// block options; decompress takes a block container. Each connection has
+// a thread that reads requests and writes responses, in order; the work
+// itself is done by a fixed pool of worker threads that take jobs from a
+// queue one block at a time, so a large job shares the workers with
+// everything queued after it instead of holding one until it is done.
+//
+// Requests come in two priority classes, by payload size: interactive
+// (up to ServiceOptions::interactiveBytes) and bulk. Each class has its
+// own queue, and a worker that finishes a block takes the next step from
+// the interactive queue, so a small request waits for at most the blocks
+// already being worked on rather than for every bulk job ahead of it.
+// Bulk jobs still get one block in every bulkShare steps while both
+// classes are waiting, so they slow down under interactive load but never
+// stop. Request 'S' returns the per-class queue depths and latencies as
+// JSON.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath> // for ceil
+#include <condition_variable>
+#include <cstring> // for strcpy, strerror
+#include <deque>
+#include <iomanip> // for setprecision
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "block.h"
+using namespace std;
+
+const char SERVICE_COMPRESS = 'C';
+const char SERVICE_DECOMPRESS = 'D';
+const char SERVICE_STATS = 'S';
+const size_t MAX_SERVICE_PAYLOAD = 1u << 30;
+
+struct ServiceOptions {
+    string socketPath = "/tmp/huf.sock";
+    int workers = 1;            // jobs worked on at once
+    size_t cacheEntries = 4096; // decode tables kept; 0 turns the cache off
+    BlockOptions block;         // for compress requests
+    size_t interactiveBytes = 1 << 20; // larger payloads are bulk; 0 puts everything in bulk
+    int bulkShare = 8;          // one bulk block per this many steps while both classes wait
+};
+
+enum ServiceClass { SERVICE_INTERACTIVE, SERVICE_BULK, SERVICE_CLASSES };
+const char* const SERVICE_CLASS_NAMES[SERVICE_CLASSES] = {"interactive", "bulk"};
+// latencies kept per class for the percentiles
+const size_t SERVICE_LATENCY_SAMPLES = 4096;
+
+//
+// _sendAll
+// Writes all n bytes to a socket; false when the peer has gone.
+//
+bool _sendAll(int fd, const char* data, size_t n) {
+    while(n > 0){
+        ssize_t sent = send(fd, data, n, MSG_NOSIGNAL);
+        if(sent < 0 && errno == EINTR)
+            continue;
+        if(sent <= 0)
+            return false;
+        data += sent;
+        n -= sent;
+    }
+    return true;
+}
+
+//
+// _receiveAll
+// Reads exactly n bytes from a socket; false when it closes first.
+//
+bool _receiveAll(int fd, char* data, size_t n) {
+    while(n > 0){
+        ssize_t got = recv(fd, data, n, 0);
+        if(got < 0 && errno == EINTR)
+            continue;
+        if(got <= 0)
+            return false;
+        data += got;
+        n -= got;
+    }
+    return true;
+}
+
+//
+// _sendMessage
+// Sends one request or response: a type byte, the length and the payload.
+//
+bool _sendMessage(int fd, char type, const string &payload) {
+    string head(1, type);
+    putLE(head, payload.size(), 8);
+    return _sendAll(fd, head.data(), head.size()) && _sendAll(fd, payload.data(), payload.size());
+}
+
+//
+// _receiveMessage
+// Receives one request or response; false when the socket closes.
+//
+bool _receiveMessage(int fd, char &type, string &payload) {
+    char head[9];
+    if(!_receiveAll(fd, head, sizeof(head)))
+        return false;
+    type = head[0];
+    uint64_t length = getLE(head + 1, 8);
+    if(length > MAX_SERVICE_PAYLOAD)
+        throw runtime_error("service message too large");
+    payload.resize(length);
+    return _receiveAll(fd, &payload[0], length);
+}
+
+//
+// latencyPercentile
+// The p-th percentile (0 to 100) of a set of latencies, by nearest rank.
+//
+double latencyPercentile(vector<double> latencies, double p) {
+    if(latencies.empty())
+        return 0;
+    sort(latencies.begin(), latencies.end());
+    size_t rank = (size_t)ceil(p / 100 * latencies.size());
+    return latencies[min(latencies.size() - 1, rank > 0 ? rank - 1 : 0)];
+}
+
+//
+// ServiceClassStats
+// Requests of one priority class: how many are in the service now (queued
+// or being worked on), the most there have been at once, how many have
+// completed, and the latencies of the last SERVICE_LATENCY_SAMPLES of
+// them, from being queued to being done, in milliseconds.
+//
+struct ServiceClassStats {
+    size_t depth = 0;
+    size_t peakDepth = 0;
+    long long completed = 0;
+    vector<double> latencies;
+    size_t nextSample = 0;
+
+    void record(double milliseconds) {
+        completed++;
+        if(latencies.size() < SERVICE_LATENCY_SAMPLES)
+            latencies.push_back(milliseconds);
+        else
+            latencies[nextSample] = milliseconds;
+        nextSample = (nextSample + 1) % SERVICE_LATENCY_SAMPLES;
+    }
+};
+
+//
+// ServiceJob
+// One request and its progress. step() does one block's worth of work.
+//
+struct ServiceJob {
+    char op;
+    ServiceClass priority = SERVICE_BULK;
+    chrono::steady_clock::time_point queued;
+    istringstream input;
+    ostringstream output;
+    BlockOptions options;
+    unique_ptr<ContainerReader> reader; // decompress
+    string carry;                       // compress
+    Trailer trailer;
+    vector<uint64_t> checksums;
+    bool started = false;
+    bool done = false;
+    string error;
+    mutex lock;
+    condition_variable finished;
+
+    ServiceJob(char op, string payload, const BlockOptions &options)
+        : op(op), input(move(payload)), options(options) {}
+
+    //
+    // step
+    // Compresses or decompresses the next block. Returns true when the job
+    // is complete (or failed, with error set).
+    //
+    bool step() {
+        try {
+            return op == SERVICE_COMPRESS ? _compressStep() : _decompressStep();
+        }
+        catch(exception &e) {
+            error = e.what();
+            return true;
+        }
+    }
+
+private:
+    bool _compressStep() {
+        if(!started){
+            writeContainerHeader(output, options.checksum);
+            started = true;
+        }
+        string raw;
+        readBlockInput(input, options, carry, raw);
+        if(raw.empty()){
+            trailer.checksum = fileChecksum(checksums, options.checksum);
+            output << encodeTrailer(trailer, output.tellp());
+            return true;
+        }
+        string block = encodeBlock(raw, options);
+        trailer.index.push_back({(uint64_t)output.tellp(), (uint32_t)raw.size()});
+        trailer.totalRaw += raw.size();
+        checksums.push_back(getLE(&block[6], 8));
+        output.write(block.data(), block.size());
+        return false;
+    }
+
+    bool _decompressStep() {
+        if(reader == nullptr)
+            reader.reset(new ContainerReader(input));
+        string raw;
+        if(!reader->next(raw))
+            return true;
+        output.write(raw.data(), raw.size());
+        return false;
+    }
+};
+
+class CompressionService {
+public:
+    explicit CompressionService(const ServiceOptions &options) : options(options), cache(options.cacheEntries) {
+        if(options.cacheEntries > 0)
+            decodeTableCache = &cache;
+    }
+
+    ~CompressionService() {
+        stop();
+        if(decodeTableCache == &cache)
+            decodeTableCache = nullptr;
+    }
+
+    CompressionService(const CompressionService&) = delete;
+    CompressionService& operator=(const CompressionService&) = delete;
+
+    //
+    // run
+    // Listens on the socket and serves connections until stop() is called.
+    // A stale socket file from an earlier run is replaced; throws when the
+    // path is anything else or another server still listens on it.
+    //
+    void run() {
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if(options.socketPath.size() >= sizeof(address.sun_path))
+            throw runtime_error("socket path too long");
+        strcpy(address.sun_path, options.socketPath.c_str());
+        _removeStaleSocket(address);
+        listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if(listenFd < 0 || ::bind(listenFd, (sockaddr*)&address, sizeof(address)) != 0 ||
+           listen(listenFd, 128) != 0)
+            throw runtime_error("cannot listen on " + options.socketPath + ": " + strerror(errno));
+
+        for(int i = 0; i < max(1, options.workers); i++)
+            workers.emplace_back([this]() { _work(); });
+        {
+            lock_guard<mutex> guard(lock);
+            listening = true;
+        }
+        changed.notify_all();
+
+        while(!stopping){
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+            if(fd < 0){
+                if(errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                break;
+            }
+            lock_guard<mutex> guard(lock);
+            _joinFinishedConnections();
+            openConnections.insert(fd);
+            thread connection([this, fd]() { _serveConnection(fd); });
+            connectionThreads[connection.get_id()] = move(connection);
+        }
+        stop();
+        {
+            unique_lock<mutex> guard(lock);
+            changed.wait(guard, [&]() { return openConnections.empty(); });
+            _joinFinishedConnections();
+        }
+        for(thread &worker : workers)
+            worker.join();
+        workers.clear();
+        close(listenFd);
+        unlink(options.socketPath.c_str());
+    }
+
+    //
+    // waitUntilListening
+    // Blocks until run() accepts connections (for a service run on a thread)
+    // or the service is stopped. Returns whether it listens.
+    //
+    bool waitUntilListening() {
+        unique_lock<mutex> guard(lock);
+        changed.wait(guard, [&]() { return listening || stopping; });
+        return listening;
+    }
+
+    //
+    // stop
+    // Makes run() return once the connections have closed; jobs in the
+    // queue are failed.
+    //
+    void stop() {
+        lock_guard<mutex> guard(lock);
+        if(stopping.exchange(true))
+            return;
+        if(listenFd >= 0)
+            shutdown(listenFd, SHUT_RDWR);
+        for(int fd : openConnections)
+            shutdown(fd, SHUT_RDWR);
+        changed.notify_all();
+    }
+
+    //
+    // execute
+    // Queues a job in its class and waits until the workers have finished it.
+    //
+    void execute(shared_ptr<ServiceJob> job) {
+        {
+            lock_guard<mutex> guard(lock);
+            if(stopping)
+                throw runtime_error("service is stopping");
+            job->queued = chrono::steady_clock::now();
+            ServiceClassStats &counts = stats[job->priority];
+            counts.depth++;
+            counts.peakDepth = max(counts.peakDepth, counts.depth);
+            queues[job->priority].push_back(job);
+        }
+        changed.notify_one();
+        unique_lock<mutex> guard(job->lock);
+        job->finished.wait(guard, [&]() { return job->done; });
+    }
+
+    //
+    // classOf
+    // The priority class of a request with payloadSize bytes.
+    //
+    ServiceClass classOf(size_t payloadSize) const {
+        return payloadSize <= options.interactiveBytes ? SERVICE_INTERACTIVE : SERVICE_BULK;
+    }
+
+    //
+    // statsJson
+    // Per-class queue depth and latency, as one JSON object.
+    //
+    string statsJson() {
+        lock_guard<mutex> guard(lock);
+        ostringstream out;
+        out << fixed << setprecision(3) << "{";
+        for(int c = 0; c < SERVICE_CLASSES; c++){
+            const ServiceClassStats &counts = stats[c];
+            double mean = 0;
+            for(double latency : counts.latencies)
+                mean += latency / counts.latencies.size();
+            out << (c > 0 ? ", " : "") << "\"" << SERVICE_CLASS_NAMES[c] << "\": {\"depth\": "
+                << counts.depth << ", \"peak_depth\": " << counts.peakDepth << ", \"completed\": "
+                << counts.completed << ", \"p50_ms\": " << latencyPercentile(counts.latencies, 50)
+                << ", \"p99_ms\": " << latencyPercentile(counts.latencies, 99)
+                << ", \"mean_ms\": " << mean << "}";
+        }
+        out << "}";
+        return out.str();
+    }
+
+    DecodeTableCache &tableCache() {
+        return cache;
+    }
+
+private:
+    //
+    // _removeStaleSocket
+    // Unlinks the socket file at address only when it is a socket that
+    // nothing accepts connections on (left by a run that crashed).
+    //
+    void _removeStaleSocket(const sockaddr_un &address) {
+        const string &path = options.socketPath;
+        struct stat info;
+        if(lstat(path.c_str(), &info) != 0){
+            if(errno == ENOENT)
+                return;
+            throw runtime_error("cannot check " + path + ": " + strerror(errno));
+        }
+        if(!S_ISSOCK(info.st_mode))
+            throw runtime_error(path + " exists and is not a socket");
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if(probe < 0)
+            throw runtime_error(string("cannot create a socket: ") + strerror(errno));
+        int connected = connect(probe, (const sockaddr*)&address, sizeof(address));
+        int error = errno;
+        close(probe);
+        if(connected == 0)
+            throw runtime_error("another server is listening on " + path);
+        if(error != ECONNREFUSED)
+            throw runtime_error("cannot check " + path + ": " + strerror(error));
+        if(unlink(path.c_str()) != 0 && errno != ENOENT)
+            throw runtime_error("cannot remove " + path + ": " + strerror(errno));
+    }
+
+    // the class to take the next step from; caller holds lock
+    int _nextClass() {
+        bool interactive = !queues[SERVICE_INTERACTIVE].empty();
+        bool bulk = !queues[SERVICE_BULK].empty();
+        if(interactive && (!bulk || interactiveRun + 1 < options.bulkShare)){
+            interactiveRun++;
+            return SERVICE_INTERACTIVE;
+        }
+        interactiveRun = 0;
+        return bulk ? SERVICE_BULK : SERVICE_INTERACTIVE;
+    }
+
+    // worker thread: one block of the job at the front of the chosen
+    // class's queue, then to the back of it
+    void _work() {
+        setTraceThreadName("service worker");
+        while(true){
+            shared_ptr<ServiceJob> job;
+            {
+                unique_lock<mutex> guard(lock);
+                changed.wait(guard, [&]() {
+                    return stopping || !queues[SERVICE_INTERACTIVE].empty() || !queues[SERVICE_BULK].empty();
+                });
+                if(queues[SERVICE_INTERACTIVE].empty() && queues[SERVICE_BULK].empty())
+                    return;
+                deque<shared_ptr<ServiceJob>> &queue = queues[_nextClass()];
+                job = queue.front();
+                queue.pop_front();
+            }
+            bool complete = stopping || job->step();
+            if(!complete){
+                {
+                    lock_guard<mutex> guard(lock);
+                    queues[job->priority].push_back(job);
+                }
+                changed.notify_one();
+                continue;
+            }
+            if(stopping && job->error.empty())
+                job->error = "service is stopping";
+            {
+                lock_guard<mutex> guard(lock);
+                ServiceClassStats &counts = stats[job->priority];
+                counts.depth--;
+                counts.record(chrono::duration<double, milli>(chrono::steady_clock::now() - job->queued).count());
+            }
+            {
+                lock_guard<mutex> guard(job->lock);
+                job->done = true;
+            }
+            job->finished.notify_all();
+        }
+    }
+
+    // connection thread: requests in, responses out, one at a time
+    void _serveConnection(int fd) {
+        setTraceThreadName("service connection");
+        try {
+            char op;
+            string payload;
+            while(_receiveMessage(fd, op, payload)){
+                if(op == SERVICE_STATS){
+                    if(!_sendMessage(fd, 0, statsJson()))
+                        break;
+                    continue;
+                }
+                if(op != SERVICE_COMPRESS && op != SERVICE_DECOMPRESS){
+                    _sendMessage(fd, 1, string("unknown request ") + op);
+                    break;
+                }
+                ServiceClass priority = classOf(payload.size());
+                auto job = make_shared<ServiceJob>(op, move(payload), options.block);
+                job->priority = priority;
+                execute(job);
+                bool sent = job->error.empty() ? _sendMessage(fd, 0, job->output.str())
+                                               : _sendMessage(fd, 1, job->error);
+                if(!sent)
+                    break;
+            }
+        }
+        catch(exception &) {
+            // a broken client only loses its own connection
+        }
+        // notified under the lock: once it is released run() may return
+        lock_guard<mutex> guard(lock);
+        openConnections.erase(fd);
+        close(fd);
+        finishedConnections.push_back(this_thread::get_id());
+        changed.notify_all();
+    }
+
+    // joins the connection threads that have finished; called with lock held
+    void _joinFinishedConnections() {
+        for(thread::id id : finishedConnections){
+            connectionThreads[id].join();
+            connectionThreads.erase(id);
+        }
+        finishedConnections.clear();
+    }
+
+    ServiceOptions options;
+    DecodeTableCache cache;
+    int listenFd = -1;
+    atomic<bool> stopping{false};
+    bool listening = false;
+    mutex lock;
+    condition_variable changed;
+    deque<shared_ptr<ServiceJob>> queues[SERVICE_CLASSES];
+    ServiceClassStats stats[SERVICE_CLASSES];
+    int interactiveRun = 0; // interactive steps since the last bulk one
+    vector<thread> workers;
+    set<int> openConnections;
+    map<thread::id, thread> connectionThreads;
+    vector<thread::id> finishedConnections; // not yet joined
+};
+
+class ServiceClient {
+public:
+    //
+    // ServiceClient
+    // Connects to the daemon listening on socketPath.
+    //
+    explicit ServiceClient(const string &socketPath) {
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if(socketPath.size() >= sizeof(address.sun_path))
+            throw runtime_error("socket path too long");
+        strcpy(address.sun_path, socketPath.c_str());
+        if(fd < 0 || connect(fd, (sockaddr*)&address, sizeof(address)) != 0){
+            if(fd >= 0)
+                close(fd);
+            throw runtime_error("cannot connect to " + socketPath + ": " + strerror(errno));
+        }
+    }
+
+    ~ServiceClient() {
+        close(fd);
+    }
+
+    ServiceClient(const ServiceClient&) = delete;
+    ServiceClient& operator=(const ServiceClient&) = delete;
+
+    //
+    // compress
+    // Returns raw as a block container.
+    //
+    string compress(const string &raw) {
+        return _call(SERVICE_COMPRESS, raw);
+    }
+
+    //
+    // decompress
+    // Returns the raw bytes of a block container.
+    //
+    string decompress(const string &container) {
+        return _call(SERVICE_DECOMPRESS, container);
+    }
+
+    //
+    // stats
+    // The daemon's per-class queue depths and latencies, as JSON.
+    //
+    string stats() {
+        return _call(SERVICE_STATS, "");
+    }
+
+private:
+    string _call(char op, const string &payload) {
+        char status;
+        string response;
+        if(!_sendMessage(fd, op, payload) || !_receiveMessage(fd, status, response))
+            throw runtime_error("compression service closed the connection");
+        if(status != 0)
+            throw runtime_error("compression service: " + response);
+        return response;
+    }
+
+    int fd;
+};
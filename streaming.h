@@ -0,0 +1,212 @@
+//
+// streaming.h
+// Huffman coding for interactive streams, where every message has to be
+// decodable as soon as it arrives instead of once PSEUDO_EOF ends the
+// whole payload. The table is fixed up front, from a sample of typical
+// traffic with every byte value given a count of at least one, so any
+// message can be coded without a second pass:
+//
+//   sync-stream := "HUFS" frequencyMap payload
+//
+// frequencyMap is written as hashmap's << writes it (as in block.h).
+// SyncEncoder::flush() ends what has been written so far with the
+// SYNC_FLUSH code and pads it with zero bits to a byte boundary, like
+// zlib's Z_SYNC_FLUSH: the bytes handed out up to that point decode to
+// exactly the data written before it, and the receiver skips the padding
+// when it reads the SYNC_FLUSH code. finish() ends the stream with the
+// PSEUDO_EOF code the same way.
+//
+
+#pragma once
+
+#include <algorithm> // for fill, max
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "block.h" // for scaledFrequencyMap, buildCodeTable and writeCode
+using namespace std;
+
+const char SYNC_STREAM_MAGIC[] = "HUFS";
+// marks a flush point; above CSV_FIELD_END in the int alphabet
+const int SYNC_FLUSH = CSV_FIELD_END + 1;
+// longest frequency map a decoder waits for before giving up
+const size_t MAX_SYNC_HEADER = 64 * 1024;
+
+//
+// syncStreamMap
+// The frequency map for a stream: byte counts from sample plus one for
+// every byte value, and SYNC_FLUSH as often as sample has newlines (the
+// usual end of a message), at least once.
+//
+hashmapF syncStreamMap(const string &sample) {
+    vector<long long> counts(SYNC_FLUSH + 1, 0);
+    fill(counts.begin(), counts.begin() + 256, 1);
+    long long newlines = 0;
+    for(char c : sample){
+        counts[(unsigned char)c]++;
+        newlines += c == '\n';
+    }
+    counts[SYNC_FLUSH] = max(1LL, newlines);
+    return scaledFrequencyMap(counts);
+}
+
+class SyncEncoder {
+public:
+    //
+    // SyncEncoder
+    // Builds the table from sample (see syncStreamMap). The stream header
+    // goes out with the first flush.
+    //
+    explicit SyncEncoder(const string &sample = "") {
+        hashmapF map = syncStreamMap(sample);
+        stringstream text;
+        text << map;
+        header = SYNC_STREAM_MAGIC + text.str();
+        HuffmanNode* root = buildEncodingTree(map);
+        table = buildCodeTable(root, SYNC_FLUSH);
+        freeTree(root);
+    }
+
+    //
+    // write
+    // Codes n bytes of data. Nothing is handed out until the next flush.
+    //
+    void write(const char* data, size_t n) {
+        if(finished)
+            throw runtime_error("write after the end of a sync stream");
+        for(size_t i = 0; i < n; i++)
+            writeCode(writer, table[(unsigned char)data[i]]);
+    }
+
+    void write(const string &data) {
+        write(data.data(), data.size());
+    }
+
+    //
+    // flush
+    // Ends the data written so far at a sync point and returns the bytes
+    // to send, which the receiver can decode completely on arrival.
+    //
+    string flush() {
+        return _end(SYNC_FLUSH);
+    }
+
+    //
+    // finish
+    // Ends the stream and returns its last bytes.
+    //
+    string finish() {
+        string out = _end(PSEUDO_EOF);
+        finished = true;
+        return out;
+    }
+
+private:
+    // writes the closing code, pads, and hands out everything pending
+    string _end(int symbol) {
+        if(finished)
+            throw runtime_error("sync stream already finished");
+        writeCode(writer, table[symbol]);
+        writer.flush();
+        string out = header + writer.bytes();
+        header.clear();
+        writer = BitWriter();
+        return out;
+    }
+
+    vector<HuffmanCode> table;
+    BitWriter writer;
+    string header; // until the first flush
+    bool finished = false;
+};
+
+class SyncDecoder {
+public:
+    SyncDecoder() = default;
+    ~SyncDecoder() {
+        freeTree(root);
+    }
+    SyncDecoder(const SyncDecoder&) = delete;
+    SyncDecoder& operator=(const SyncDecoder&) = delete;
+
+    //
+    // feed
+    // Takes the next n bytes of the stream and returns every byte they
+    // complete. Bytes can arrive in any pieces; a piece that ends at a
+    // flush point always returns everything written before that flush.
+    // Throws runtime_error on a malformed stream.
+    //
+    string feed(const char* data, size_t n) {
+        string out;
+        size_t i = 0;
+        if(root == nullptr)
+            i = _readHeader(data, n);
+        for(; i < n; i++){
+            if(finished)
+                throw runtime_error("corrupt sync stream: data after the end");
+            unsigned char byte = (unsigned char)data[i];
+            for(int bit = 0; bit < 8; bit++){
+                node = (byte >> bit) & 1 ? node->one : node->zero;
+                if(node == nullptr)
+                    throw runtime_error("corrupt sync stream: code leaves the encoding tree");
+                if(node->character == NOT_A_CHAR)
+                    continue;
+                int symbol = node->character;
+                node = root;
+                if(symbol == SYNC_FLUSH || symbol == PSEUDO_EOF){
+                    // the rest of this byte is padding
+                    finished = symbol == PSEUDO_EOF;
+                    break;
+                }
+                out += (char)symbol;
+            }
+        }
+        return out;
+    }
+
+    string feed(const string &data) {
+        return feed(data.data(), data.size());
+    }
+
+    //
+    // done
+    // True once the PSEUDO_EOF code has been read.
+    //
+    bool done() const {
+        return finished;
+    }
+
+private:
+    // collects the magic and frequency map; returns how much of data it used
+    size_t _readHeader(const char* data, size_t n) {
+        const char* close = (const char*)memchr(data, '}', n);
+        size_t used = close ? close - data + 1 : n;
+        header.append(data, used);
+        if(header.size() > MAX_SYNC_HEADER)
+            throw runtime_error("corrupt sync stream: frequency header too long");
+        if(close == nullptr)
+            return used;
+        if(header.compare(0, 4, SYNC_STREAM_MAGIC) != 0 || header[4] != '{')
+            throw runtime_error("not a sync stream");
+
+        hashmapF map;
+        stringstream text(header.substr(4));
+        text >> map;
+        int symbols = 0;
+        for(int key : map.keys()){
+            if(key < 0 || (key > 0xFF && key != PSEUDO_EOF && key != SYNC_FLUSH) || map.get(key) <= 0)
+                throw runtime_error("corrupt sync stream: bad frequency header entry");
+            symbols++;
+        }
+        if(symbols < 2 || !map.containsKey(PSEUDO_EOF))
+            throw runtime_error("corrupt sync stream: frequency header has no EOF");
+        root = node = buildEncodingTree(map);
+        return used;
+    }
+
+    string header;
+    HuffmanNode* root = nullptr;
+    HuffmanNode* node = nullptr;
+    bool finished = false;
+};
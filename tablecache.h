@@ -0,0 +1,429 @@
+//
+// tablecache.h
+// Cache of built decode tables, keyed by a hash of the frequency header
+// they were built from. Files from the same generator tend to repeat the
+// same headers, and a long running process (the daemon in service.h)
+// decodes many of them, so a hit skips both parsing the header with >>
+// and buildEncodingTree(). Tables are immutable once built and handed out
+// as shared_ptr, so any number of threads can decode with one table while
+// the cache evicts it. Eviction is least recently used, by entry count.
+//
+// PersistentTableCache keeps tables across processes, in a file that
+// every process maps (MAP_SHARED), so repeated decompressions of files
+// with the same model skip the parsing and the tree building too; loading
+// a table is a copy of its flattened nodes. The file is a fixed number of
+// sets of TABLE_CACHE_WAYS slots, chosen when it is created from the size
+// cap:
+//
+//   file := "HUFT" version:u32 sets:u32 ways:u32 slotBytes:u32 pad:u32
+//           clock:u64 pad:32 slot*
+//   slot := hashLow:u64 hashHigh:u64 lastUsed:u64 headerLength:u32
+//           nodeCount:u32 crc:u32 pad:u32 header node*
+//   node := character:u16 zero:u16 one:u16     (preorder, 0 for no child)
+//
+// Fields are in the machine's byte order; a cache is local to one machine.
+// A header's hash picks its set; a new table replaces the least recently
+// used slot of that set. Processes take a shared flock to look tables up
+// and an exclusive one to insert; threads within a process also share a
+// mutex, since flock does not separate threads using one descriptor. A
+// slot's hash is written last and its crc covers the rest, so a process
+// that dies while writing leaves a miss rather than a bad table.
+//
+
+#pragma once
+
+#include <cerrno>
+#include <cstring> // for memcmp, memcpy, strerror
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <sys/file.h> // for flock
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "checksum.h" // for murmur3_128 and crc32c
+using namespace std;
+
+//
+// DecodeTable
+// A decode tree built from one frequency header; frees it when the last
+// user lets go. A tree loaded from a PersistentTableCache lives in nodes
+// instead of separate allocations.
+//
+struct DecodeTable {
+    HuffmanNode* root;
+    vector<HuffmanNode> nodes;
+    explicit DecodeTable(HuffmanNode* root) : root(root) {}
+    explicit DecodeTable(vector<HuffmanNode> flat) : nodes(move(flat)) { root = &nodes[0]; }
+    ~DecodeTable() {
+        if(nodes.empty())
+            freeTree(root);
+    }
+    DecodeTable(const DecodeTable&) = delete;
+    DecodeTable& operator=(const DecodeTable&) = delete;
+};
+
+class DecodeTableCache {
+public:
+    explicit DecodeTableCache(size_t capacity) : capacity(capacity) {}
+
+    //
+    // find
+    // The table built from header, or null. A hit becomes the most
+    // recently used entry.
+    //
+    shared_ptr<const DecodeTable> find(const string &header) {
+        Hash128 key = murmur3_128(header.data(), header.size());
+        lock_guard<mutex> guard(lock);
+        auto found = entries.find(key);
+        // the header is compared too, so a hash collision is only a miss
+        if(found == entries.end() || found->second->header != header){
+            missCount++;
+            return nullptr;
+        }
+        order.splice(order.begin(), order, found->second);
+        hitCount++;
+        return found->second->table;
+    }
+
+    //
+    // insert
+    // Adds the table built from header, evicting the least recently used
+    // entries beyond capacity.
+    //
+    void insert(const string &header, shared_ptr<const DecodeTable> table) {
+        if(capacity == 0)
+            return;
+        Hash128 key = murmur3_128(header.data(), header.size());
+        lock_guard<mutex> guard(lock);
+        auto found = entries.find(key);
+        if(found != entries.end())
+            order.erase(found->second);
+        order.push_front({key, header, table});
+        entries[key] = order.begin();
+        while(order.size() > capacity){
+            entries.erase(order.back().key);
+            order.pop_back();
+        }
+    }
+
+    long long hits() {
+        lock_guard<mutex> guard(lock);
+        return hitCount;
+    }
+
+    long long misses() {
+        lock_guard<mutex> guard(lock);
+        return missCount;
+    }
+
+private:
+    struct Entry {
+        Hash128 key;
+        string header;
+        shared_ptr<const DecodeTable> table;
+    };
+
+    mutex lock;
+    size_t capacity;
+    list<Entry> order; // most recently used first
+    unordered_map<Hash128, list<Entry>::iterator, Hash128Hasher> entries;
+    long long hitCount = 0;
+    long long missCount = 0;
+};
+
+const char TABLE_CACHE_MAGIC[] = "HUFT";
+const uint32_t TABLE_CACHE_VERSION = 1;
+const uint32_t TABLE_CACHE_WAYS = 8;
+// fits the longest frequency header and tree of the int alphabet
+const uint32_t TABLE_CACHE_SLOT_BYTES = 16 * 1024;
+const size_t TABLE_CACHE_FILE_HEADER = 64;
+const size_t TABLE_CACHE_SLOT_HEADER = 40;
+const size_t DEFAULT_TABLE_CACHE_SIZE = 64 << 20;
+
+//
+// _loadField / _storeField
+// Unaligned reads and writes of the cache file's fields.
+//
+template<typename T>
+T _loadField(const unsigned char* p) {
+    T value;
+    memcpy(&value, p, sizeof(T));
+    return value;
+}
+
+template<typename T>
+void _storeField(unsigned char* p, T value) {
+    memcpy(p, &value, sizeof(T));
+}
+
+class PersistentTableCache {
+public:
+    //
+    // PersistentTableCache
+    // Opens the cache file at path, creating it with about maxBytes of
+    // slots when it does not exist (or is empty). An existing cache keeps
+    // the size it was created with. Throws runtime_error when path is not
+    // a cache; such a file is left as it is.
+    //
+    PersistentTableCache(const string &path, size_t maxBytes = DEFAULT_TABLE_CACHE_SIZE) {
+        fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+        if(fd < 0 && errno == ENOENT)
+            fd = _create(path, maxBytes);
+        if(fd < 0)
+            throw runtime_error("cannot open table cache " + path + ": " + strerror(errno));
+        try {
+            _map(path, maxBytes);
+        }
+        catch(...) {
+            close(fd);
+            throw;
+        }
+    }
+
+    ~PersistentTableCache() {
+        munmap(base, length);
+        close(fd);
+    }
+
+    PersistentTableCache(const PersistentTableCache&) = delete;
+    PersistentTableCache& operator=(const PersistentTableCache&) = delete;
+
+    //
+    // find
+    // The table built from header, or null. A hit becomes the most
+    // recently used entry of its set.
+    //
+    shared_ptr<const DecodeTable> find(const string &header) {
+        Hash128 key = murmur3_128(header.data(), header.size());
+        lock_guard<mutex> guard(lock);
+        _FileLock fileLock(fd, LOCK_SH);
+        unsigned char* slot = _findSlot(key, header);
+        if(slot == nullptr){
+            missCount++;
+            return nullptr;
+        }
+        // a relaxed store: readers racing here all write a recent time
+        __atomic_store_n((uint64_t*)(slot + 16), _tick(), __ATOMIC_RELAXED);
+        uint32_t count = _loadField<uint32_t>(slot + 28);
+        const unsigned char* p = slot + TABLE_CACHE_SLOT_HEADER + header.size();
+        vector<HuffmanNode> nodes(count);
+        for(uint32_t i = 0; i < count; i++, p += 6){
+            uint16_t zero = _loadField<uint16_t>(p + 2), one = _loadField<uint16_t>(p + 4);
+            nodes[i].character = _loadField<uint16_t>(p);
+            nodes[i].count = 0;
+            nodes[i].zero = zero ? &nodes[zero] : nullptr;
+            nodes[i].one = one ? &nodes[one] : nullptr;
+        }
+        hitCount++;
+        return make_shared<const DecodeTable>(move(nodes));
+    }
+
+    //
+    // insert
+    // Stores the table built from header in place of the least recently
+    // used entry of its set. Tables too large for a slot are not kept.
+    //
+    void insert(const string &header, const DecodeTable &table) {
+        string flat;
+        uint32_t count = 0;
+        _flatten(table.root, flat, count);
+        size_t needed = TABLE_CACHE_SLOT_HEADER + header.size() + flat.size();
+        if(needed > slotBytes || count > 0xFFFF)
+            return;
+
+        Hash128 key = murmur3_128(header.data(), header.size());
+        lock_guard<mutex> guard(lock);
+        _FileLock fileLock(fd, LOCK_EX);
+        if(_findSlot(key, header) != nullptr)
+            return;
+        unsigned char* set = _set(key);
+        unsigned char* victim = set;
+        for(uint32_t way = 0; way < ways; way++){
+            unsigned char* slot = set + (size_t)way * slotBytes;
+            if(_loadField<uint64_t>(slot + 16) < _loadField<uint64_t>(victim + 16))
+                victim = slot;
+        }
+
+        // invalid until the hash goes in last
+        memset(victim, 0, TABLE_CACHE_SLOT_HEADER);
+        _storeField<uint64_t>(victim + 16, _tick());
+        _storeField<uint32_t>(victim + 24, header.size());
+        _storeField<uint32_t>(victim + 28, count);
+        memcpy(victim + TABLE_CACHE_SLOT_HEADER, header.data(), header.size());
+        memcpy(victim + TABLE_CACHE_SLOT_HEADER + header.size(), flat.data(), flat.size());
+        _storeField<uint32_t>(victim + 32, _slotCrc(victim, needed));
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        _storeField<uint64_t>(victim, key.low);
+        _storeField<uint64_t>(victim + 8, key.high);
+    }
+
+    long long hits() {
+        lock_guard<mutex> guard(lock);
+        return hitCount;
+    }
+
+    long long misses() {
+        lock_guard<mutex> guard(lock);
+        return missCount;
+    }
+
+private:
+    struct _FileLock {
+        int fd;
+        _FileLock(int fd, int operation) : fd(fd) {
+            while(flock(fd, operation) != 0)
+                if(errno != EINTR)
+                    throw runtime_error(string("cannot lock table cache: ") + strerror(errno));
+        }
+        ~_FileLock() { flock(fd, LOCK_UN); }
+    };
+
+    // sizes the empty file fd as a cache of about maxBytes and writes its
+    // header, the magic last
+    static bool _initialize(int fd, size_t maxBytes) {
+        size_t setBytes = (size_t)TABLE_CACHE_WAYS * TABLE_CACHE_SLOT_BYTES;
+        size_t setCount = max((size_t)1, (maxBytes - min(maxBytes, TABLE_CACHE_FILE_HEADER)) / setBytes);
+        unsigned char init[TABLE_CACHE_FILE_HEADER] = {};
+        _storeField<uint32_t>(init + 4, TABLE_CACHE_VERSION);
+        _storeField<uint32_t>(init + 8, setCount);
+        _storeField<uint32_t>(init + 12, TABLE_CACHE_WAYS);
+        _storeField<uint32_t>(init + 16, TABLE_CACHE_SLOT_BYTES);
+        return ftruncate(fd, TABLE_CACHE_FILE_HEADER + setCount * setBytes) == 0 &&
+               pwrite(fd, init, sizeof(init), 0) == (ssize_t)sizeof(init) &&
+               pwrite(fd, TABLE_CACHE_MAGIC, 4, 0) == 4;
+    }
+
+    // builds a new cache under a name of its own (O_EXCL) and links it into
+    // place, so path never names a half made cache and a file that appears
+    // at path meanwhile is used, not replaced; returns its descriptor or -1
+    static int _create(const string &path, size_t maxBytes) {
+        string temporary = path + ".tmp" + to_string(getpid());
+        int created = open(temporary.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if(created < 0)
+            return -1;
+        bool linked = _initialize(created, maxBytes) && link(temporary.c_str(), path.c_str()) == 0;
+        int error = errno;
+        unlink(temporary.c_str());
+        if(linked)
+            return created;
+        close(created);
+        if(error != EEXIST){
+            errno = error;
+            return -1;
+        }
+        return open(path.c_str(), O_RDWR | O_CLOEXEC);
+    }
+
+    // maps the cache; an empty file becomes a new cache, anything else
+    // has to be one already
+    void _map(const string &path, size_t maxBytes) {
+        _FileLock fileLock(fd, LOCK_EX);
+        struct stat info;
+        if(fstat(fd, &info) != 0)
+            throw runtime_error("cannot stat table cache " + path);
+        if(info.st_size == 0){
+            if(!_initialize(fd, maxBytes) || fstat(fd, &info) != 0)
+                throw runtime_error("cannot create table cache " + path + ": " + strerror(errno));
+        }
+        unsigned char head[TABLE_CACHE_FILE_HEADER] = {};
+        if(pread(fd, head, sizeof(head), 0) != (ssize_t)sizeof(head) ||
+           memcmp(head, TABLE_CACHE_MAGIC, 4) != 0)
+            throw runtime_error(path + " is not a table cache");
+        if(_loadField<uint32_t>(head + 4) != TABLE_CACHE_VERSION)
+            throw runtime_error("table cache " + path + " has an unsupported version");
+        sets = _loadField<uint32_t>(head + 8);
+        ways = _loadField<uint32_t>(head + 12);
+        slotBytes = _loadField<uint32_t>(head + 16);
+        length = TABLE_CACHE_FILE_HEADER + (size_t)sets * ways * slotBytes;
+        if(sets == 0 || ways == 0 || slotBytes < TABLE_CACHE_SLOT_HEADER || (off_t)length > info.st_size)
+            throw runtime_error("corrupt table cache " + path);
+        void* mapped = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if(mapped == MAP_FAILED)
+            throw runtime_error("cannot map table cache " + path + ": " + strerror(errno));
+        base = (unsigned char*)mapped;
+    }
+
+    // the next value of the file's use clock
+    uint64_t _tick() {
+        return __atomic_add_fetch((uint64_t*)(base + 24), 1, __ATOMIC_RELAXED);
+    }
+
+    unsigned char* _set(const Hash128 &key) {
+        return base + TABLE_CACHE_FILE_HEADER + (size_t)(key.low % sets) * ways * slotBytes;
+    }
+
+    // the valid slot holding header, or null; caller holds the file lock
+    unsigned char* _findSlot(const Hash128 &key, const string &header) {
+        unsigned char* set = _set(key);
+        for(uint32_t way = 0; way < ways; way++){
+            unsigned char* slot = set + (size_t)way * slotBytes;
+            if(_loadField<uint64_t>(slot) != key.low || _loadField<uint64_t>(slot + 8) != key.high)
+                continue;
+            uint64_t headerLength = _loadField<uint32_t>(slot + 24), count = _loadField<uint32_t>(slot + 28);
+            size_t used = TABLE_CACHE_SLOT_HEADER + headerLength + count * 6;
+            if(headerLength != header.size() || count == 0 || used > slotBytes ||
+               memcmp(slot + TABLE_CACHE_SLOT_HEADER, header.data(), header.size()) != 0 ||
+               _slotCrc(slot, used) != _loadField<uint32_t>(slot + 32) ||
+               !_validTree(slot + TABLE_CACHE_SLOT_HEADER + headerLength, count))
+                continue;
+            return slot;
+        }
+        return nullptr;
+    }
+
+    // covers the lengths, the header and the nodes (not lastUsed, which
+    // lookups change without the exclusive lock)
+    static uint32_t _slotCrc(const unsigned char* slot, size_t used) {
+        uint32_t crc = crc32c(0, slot + 24, 8);
+        return crc32c(crc, slot + TABLE_CACHE_SLOT_HEADER, used - TABLE_CACHE_SLOT_HEADER);
+    }
+
+    // children come after their parent, so the nodes form a tree; leaves
+    // are symbols and inner nodes have both children
+    static bool _validTree(const unsigned char* p, uint32_t count) {
+        for(uint32_t i = 0; i < count; i++, p += 6){
+            uint32_t character = _loadField<uint16_t>(p);
+            uint32_t zero = _loadField<uint16_t>(p + 2), one = _loadField<uint16_t>(p + 4);
+            bool leaf = zero == 0 && one == 0;
+            if(leaf ? character == NOT_A_CHAR : (character != NOT_A_CHAR || zero <= i || one <= i ||
+                                                 zero >= count || one >= count))
+                return false;
+        }
+        return true;
+    }
+
+    // appends node and its subtree in preorder; returns node's index
+    static uint32_t _flatten(const HuffmanNode* node, string &out, uint32_t &count) {
+        uint32_t index = count++;
+        size_t at = out.size();
+        out.resize(at + 6);
+        uint16_t zero = node->zero ? _flatten(node->zero, out, count) : 0;
+        uint16_t one = node->one ? _flatten(node->one, out, count) : 0;
+        unsigned char* entry = (unsigned char*)&out[at];
+        _storeField<uint16_t>(entry, node->character);
+        _storeField<uint16_t>(entry + 2, zero);
+        _storeField<uint16_t>(entry + 4, one);
+        return index;
+    }
+
+    mutex lock;
+    int fd = -1;
+    unsigned char* base = nullptr;
+    size_t length = 0;
+    uint32_t sets = 0;
+    uint32_t ways = 0;
+    uint32_t slotBytes = 0;
+    long long hitCount = 0;
+    long long missCount = 0;
+};
+
+// The caches readStream consults, or null (the default) to build every
+// table afresh. Set them before any decoding threads start.
+DecodeTableCache* decodeTableCache = nullptr;
+PersistentTableCache* persistentTableCache = nullptr;
@@ -0,0 +1,43 @@
+#!/bin/sh
+#
+# checkpoint_resume.sh
+# huf compress --checkpoint killed with SIGKILL part way through, then run
+# again with the same command, must resume from its checkpoint and write
+# the same bytes as a run that was never interrupted. The kill comes as
+# soon as the first checkpoint is on disk; checkpointing after every batch
+# keeps the run slow enough for that.
+#
+# Usage: HUF=path/to/huf sh tests/checkpoint_resume.sh
+#
+
+set -e
+HUF=${HUF:-./huf}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+fail() {
+    echo "FAIL: $*"
+    exit 1
+}
+
+awk 'BEGIN { for(i = 0; i < 600000; i++) printf "2024-01-01T00:00:%06d INFO app.worker request %d done in %d ms\n", i, i * 7, i % 97 }' > "$DIR/in.log"
+
+for checksum in crc32c xxhash64; do
+    "$HUF" compress --block-size 4K --checksum $checksum "$DIR/in.log" "$DIR/whole.huf" > /dev/null
+    rm -f "$DIR/out.huf" "$DIR/out.huf.ckpt"
+    "$HUF" compress --block-size 4K --checksum $checksum --checkpoint 0 "$DIR/in.log" "$DIR/out.huf" > /dev/null 2>&1 &
+    pid=$!
+    while [ ! -s "$DIR/out.huf.ckpt" ] && kill -0 $pid 2> /dev/null; do
+        sleep 0.01
+    done
+    kill -KILL $pid 2> /dev/null || fail "$checksum: compression finished before the first checkpoint"
+    wait $pid 2> /dev/null || true
+    [ -s "$DIR/out.huf.ckpt" ] || fail "$checksum: no checkpoint left by the killed run"
+
+    "$HUF" compress --block-size 4K --checksum $checksum --checkpoint 0 "$DIR/in.log" "$DIR/out.huf" > /dev/null 2> "$DIR/resume.err" ||
+        fail "$checksum: the resumed run failed"
+    grep -q "resumed from a checkpoint" "$DIR/resume.err" || fail "$checksum: the second run did not resume"
+    [ ! -e "$DIR/out.huf.ckpt" ] || fail "$checksum: the checkpoint was not removed"
+    cmp -s "$DIR/out.huf" "$DIR/whole.huf" || fail "$checksum: resumed output differs from an uninterrupted run"
+done
+echo "checkpoint_resume: OK"
@@ -0,0 +1,57 @@
+#!/bin/sh
+#
+# interrupted_append.sh
+# A container cut off part way through an append (as a crash during huf
+# append or huf follow leaves it) must still decompress and test up to its
+# last complete trailer, with the rest reported, and the next huf append
+# must recover it. Cuts are tried at several points inside the appended
+# blocks and inside the new trailer, for both checksum kinds.
+#
+# Usage: HUF=path/to/huf sh tests/interrupted_append.sh
+#
+
+set -e
+HUF=${HUF:-./huf}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+fail() {
+    echo "FAIL: $*"
+    exit 1
+}
+
+# a growing log, first in two parts
+awk 'BEGIN { for(i = 0; i < 60000; i++) printf "2024-01-01T00:00:%05d INFO app.worker request %d done in %d ms\n", i, i * 7, i % 97 }' > "$DIR/full.log"
+head -c 1500000 "$DIR/full.log" > "$DIR/part1.log"
+head -c 3000000 "$DIR/full.log" > "$DIR/part2.log"
+
+for checksum in crc32c xxhash64; do
+    cp "$DIR/part1.log" "$DIR/src.log"
+    "$HUF" compress --block-size 256K --checksum $checksum "$DIR/src.log" "$DIR/base.huf" > /dev/null
+    cp "$DIR/part2.log" "$DIR/src.log"
+    "$HUF" append --block-size 256K "$DIR/base.huf" "$DIR/src.log" > /dev/null
+    before=$(wc -c < "$DIR/base.huf")
+    cp "$DIR/full.log" "$DIR/src.log"
+    cp "$DIR/base.huf" "$DIR/whole.huf"
+    "$HUF" append --block-size 256K "$DIR/whole.huf" "$DIR/src.log" > /dev/null
+    after=$(wc -c < "$DIR/whole.huf")
+
+    # just after the old footer, inside the new blocks, inside the new trailer
+    for cut in 1 30 $(( (after - before) / 2 )) $(( after - before - 40 )) $(( after - before - 1 )); do
+        cp "$DIR/whole.huf" "$DIR/cut.huf"
+        truncate -s $(( before + cut )) "$DIR/cut.huf"
+
+        "$HUF" test "$DIR/cut.huf" > "$DIR/test.out" || fail "$checksum cut $cut: huf test rejected the container"
+        grep -q "OK (.*interrupted append" "$DIR/test.out" || fail "$checksum cut $cut: huf test did not report the interrupted append"
+        "$HUF" decompress "$DIR/cut.huf" "$DIR/cut.out" > /dev/null 2> "$DIR/decompress.err" ||
+            fail "$checksum cut $cut: huf decompress failed"
+        grep -q "interrupted append" "$DIR/decompress.err" || fail "$checksum cut $cut: decompress did not report the interrupted append"
+        cmp -s "$DIR/cut.out" "$DIR/part2.log" || fail "$checksum cut $cut: decompressed data is not the data before the append"
+
+        "$HUF" append --block-size 256K "$DIR/cut.huf" "$DIR/src.log" > /dev/null 2>&1 || fail "$checksum cut $cut: huf append did not recover"
+        "$HUF" decompress "$DIR/cut.huf" "$DIR/cut.out" > /dev/null
+        cmp -s "$DIR/cut.out" "$DIR/full.log" || fail "$checksum cut $cut: recovered container does not hold the whole source"
+        "$HUF" test "$DIR/cut.huf" | grep -q "OK$" || fail "$checksum cut $cut: recovered container does not test clean"
+    done
+done
+echo "interrupted_append: OK"
@@ -0,0 +1,32 @@
+#!/bin/sh
+#
+# log_dictionary.sh
+# A log block with more distinct loggers than a dictionary holds must
+# still round-trip: once the dictionary is full, lines with new loggers
+# are kept as raw lines. Tried with one block holding every logger and
+# with several blocks.
+#
+# Usage: HUF=path/to/huf sh tests/log_dictionary.sh
+#
+
+set -e
+HUF=${HUF:-./huf}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+fail() {
+    echo "FAIL: $*"
+    exit 1
+}
+
+# 1000 distinct loggers, each used a few times, and 300 distinct levels
+awk 'BEGIN { for(i = 0; i < 20000; i++) printf "2024-01-01T00:00:%02d.%03dZ LEVEL%d logger%d request %d done\n", i % 60, i % 1000, i % 300, i % 1000, i }' > "$DIR/many.log"
+
+for size in 4M 64K; do
+    "$HUF" compress --logs --block-size $size "$DIR/many.log" "$DIR/many.huf" > /dev/null ||
+        fail "block size $size: huf compress --logs failed"
+    "$HUF" test "$DIR/many.huf" | grep -q "OK$" || fail "block size $size: huf test rejected the container"
+    "$HUF" decompress "$DIR/many.huf" "$DIR/many.out" > /dev/null || fail "block size $size: huf decompress failed"
+    cmp -s "$DIR/many.out" "$DIR/many.log" || fail "block size $size: decompressed data differs"
+done
+echo "log_dictionary: OK"
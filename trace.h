@@ -0,0 +1,217 @@
+//
+// trace.h
+// Span recording for the compression pipeline, exported as Chrome trace
+// JSON (loadable in chrome://tracing or ui.perfetto.dev). Every thread
+// records into its own fixed size ring buffer, so recording a span takes
+// no lock; the buffers are only walked when the trace is written out.
+//
+// Usage:
+//   startTracing("trace.json");      // once, e.g. from main; dumps at exit
+//   { TraceSpan span("encode"); ... } // anywhere, on any thread
+//
+// A ring is handed back when its thread exits and reused by the next new
+// thread, so code that starts threads per call (parallelFor) holds only as
+// many rings as it ever ran threads at once.
+//
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib> // for atexit
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+using namespace std;
+
+// events kept per thread; older events are overwritten once it wraps
+const size_t TRACE_RING_SIZE = 1 << 16;
+
+struct TraceEvent {
+    const char* name; // must point at a string literal or other static storage
+    int64_t startNs;
+    int64_t durationNs;
+};
+
+struct TraceRing {
+    int tid;
+    string threadName;
+    vector<TraceEvent> events = vector<TraceEvent>(TRACE_RING_SIZE);
+    atomic<uint64_t> head{0}; // total events ever recorded by the owner
+};
+
+//
+// TraceState
+// Process wide tracing state: the on/off switch, the output path, the
+// registry of per thread rings and the rings no live thread owns (only
+// locked when a thread first traces or exits).
+//
+struct TraceState {
+    atomic<bool> enabled{false};
+    string path;
+    chrono::steady_clock::time_point epoch = chrono::steady_clock::now();
+    mutex registryLock;
+    vector<shared_ptr<TraceRing>> rings;
+    vector<shared_ptr<TraceRing>> idle;
+};
+
+TraceState& traceState() {
+    static TraceState state;
+    return state;
+}
+
+//
+// _RingLease
+// Holds a thread's ring and hands it back to the idle list when the
+// thread exits; its events stay registered for writeTrace.
+//
+struct _RingLease {
+    shared_ptr<TraceRing> ring;
+    ~_RingLease() {
+        if(!ring)
+            return;
+        TraceState &state = traceState();
+        lock_guard<mutex> guard(state.registryLock);
+        state.idle.push_back(ring);
+    }
+};
+
+//
+// _defaultThreadName
+// The name a ring has until its thread sets one.
+//
+string _defaultThreadName(int tid) {
+    return tid == 1 ? "main" : "worker " + to_string(tid - 1);
+}
+
+//
+// _threadRing
+// Returns the calling thread's ring, taking an idle one or registering a
+// new one on first use. An idle ring keeps the name of its last thread
+// until then, so the trace shows it, but the new thread starts unnamed.
+//
+TraceRing& _threadRing() {
+    thread_local _RingLease lease;
+    if(!lease.ring){
+        TraceState &state = traceState();
+        lock_guard<mutex> guard(state.registryLock);
+        if(!state.idle.empty()){
+            lease.ring = state.idle.back();
+            lease.ring->threadName = _defaultThreadName(lease.ring->tid);
+            state.idle.pop_back();
+        }
+        else {
+            lease.ring = make_shared<TraceRing>();
+            lease.ring->tid = state.rings.size() + 1;
+            lease.ring->threadName = _defaultThreadName(lease.ring->tid);
+            state.rings.push_back(lease.ring);
+        }
+    }
+    return *lease.ring;
+}
+
+int64_t _traceNowNs() {
+    return chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now() - traceState().epoch).count();
+}
+
+//
+// traceEnabled
+// True once startTracing has been called.
+//
+bool traceEnabled() {
+    return traceState().enabled.load(memory_order_relaxed);
+}
+
+//
+// recordSpan
+// Appends one complete span to the calling thread's ring.
+//
+void recordSpan(const char* name, int64_t startNs, int64_t durationNs) {
+    TraceRing &ring = _threadRing();
+    uint64_t head = ring.head.load(memory_order_relaxed);
+    ring.events[head % TRACE_RING_SIZE] = {name, startNs, durationNs};
+    ring.head.store(head + 1, memory_order_release);
+}
+
+//
+// setTraceThreadName
+// Names the calling thread in the trace viewer. Does nothing while tracing
+// is off, so threads that never trace get no ring.
+//
+void setTraceThreadName(string name) {
+    if(!traceEnabled())
+        return;
+    TraceRing &ring = _threadRing();
+    lock_guard<mutex> guard(traceState().registryLock);
+    ring.threadName = name;
+}
+
+//
+// TraceSpan
+// Records the lifetime of the object as a span named name. Costs one
+// relaxed atomic load when tracing is off.
+//
+class TraceSpan {
+public:
+    TraceSpan(const char* name) : name(name), active(traceEnabled()) {
+        if(active)
+            start = _traceNowNs();
+    }
+    TraceSpan(const TraceSpan&) = delete;
+    ~TraceSpan() {
+        if(active)
+            recordSpan(name, start, _traceNowNs() - start);
+    }
+private:
+    const char* name;
+    bool active;
+    int64_t start = 0;
+};
+
+//
+// writeTrace
+// Writes every recorded span as Chrome trace JSON to path. Call once the
+// worker threads have finished (it reads their rings without locking them).
+//
+bool writeTrace(string path) {
+    TraceState &state = traceState();
+    ofstream output(path);
+    if(!output)
+        return false;
+    output << "{\"traceEvents\": [";
+    bool first = true;
+    lock_guard<mutex> guard(state.registryLock);
+    for(auto &ring : state.rings){
+        output << (first ? "" : ",") << "\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": "
+               << ring->tid << ", \"args\": {\"name\": \"" << ring->threadName << "\"}}";
+        first = false;
+        uint64_t head = ring->head.load(memory_order_acquire);
+        uint64_t begin = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+        for(uint64_t i = begin; i < head; i++){
+            TraceEvent &event = ring->events[i % TRACE_RING_SIZE];
+            output << ",\n{\"name\": \"" << event.name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": "
+                   << ring->tid << ", \"ts\": " << event.startNs / 1000.0
+                   << ", \"dur\": " << event.durationNs / 1000.0 << "}";
+        }
+    }
+    output << "\n]}\n";
+    return true;
+}
+
+//
+// startTracing
+// Turns span recording on and writes the trace to path when the process
+// exits normally.
+//
+void startTracing(string path) {
+    TraceState &state = traceState();
+    state.path = path;
+    _threadRing(); // the caller becomes "main"
+    if(!state.enabled.exchange(true))
+        atexit([]() { writeTrace(traceState().path); });
+}
+
@@ -0,0 +1,375 @@
+//
+// transform.h
+// Optional transforms applied to a block before it is Huffman coded, and
+// undone after it is decoded. Each one is recorded in the block's flags.
+// A byte filter (if any) runs first, then the run-length pass.
+//
+// Run-length pre-pass (BLOCK_RLE)
+// Huffman coding needs at least one bit per symbol, so long runs of one byte
+// still cost an eighth of their size. With RLE on, a run of RLE_MIN_RUN or
+// more copies of byte b becomes the literal b followed by the extra repeat
+// count (run length - 1) written as base 256 digits, least significant
+// first, using the symbols RLE_DIGIT_BASE..RLE_DIGIT_BASE+255. These sit
+// above PSEUDO_EOF and NOT_A_CHAR in the int alphabet, so they get their own
+// Huffman codes next to the literal bytes.
+//
+
+#pragma once
+
+#include <algorithm> // for copy
+#include <cmath> // for log2
+#include <cstdint>
+#include <cstdlib> // for atoi
+#include <cstring> // for memcpy
+#include <stdexcept>
+#include <string>
+#include <vector>
+#if defined(__x86_64__)
+#include <immintrin.h> // for the AVX2 run scanner
+#endif
+using namespace std;
+
+// block flags
+const uint8_t BLOCK_RLE = 0x01;
+
+const int RLE_DIGIT_BASE = 258;
+const size_t RLE_MIN_RUN = 4;
+
+//
+// _runLengthPortable
+// Length of the run of p[0] at the start of p[0..n), eight bytes at a time.
+//
+size_t _runLengthPortable(const unsigned char* p, size_t n) {
+    uint64_t pattern = 0x0101010101010101ULL * p[0];
+    size_t i = 0;
+    while(i + 8 <= n){
+        uint64_t word;
+        memcpy(&word, p + i, 8);
+        uint64_t diff = word ^ pattern;
+        if(diff != 0)
+            return i + __builtin_ctzll(diff) / 8; // assumes a little-endian host
+        i += 8;
+    }
+    while(i < n && p[i] == p[0])
+        i++;
+    return i;
+}
+
+#if defined(__x86_64__)
+//
+// _runLengthAvx2
+// Same as _runLengthPortable, comparing 32 bytes per step.
+//
+__attribute__((target("avx2")))
+size_t _runLengthAvx2(const unsigned char* p, size_t n) {
+    __m256i pattern = _mm256_set1_epi8((char)p[0]);
+    size_t i = 0;
+    while(i + 32 <= n){
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)(p + i));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, pattern));
+        if(mask != 0xFFFFFFFFu)
+            return i + __builtin_ctz(~mask);
+        i += 32;
+    }
+    if(i == n || p[i] != p[0])
+        return i;
+    return i + _runLengthPortable(p + i, n - i);
+}
+#endif
+
+//
+// runLength
+// Length of the run of data[0] at the start of data[0..n), n >= 1.
+//
+size_t runLength(const char* data, size_t n) {
+    const unsigned char* p = (const unsigned char*)data;
+    // most positions in ordinary data are not runs at all
+    if(n < 2 || p[1] != p[0])
+        return 1;
+#if defined(__x86_64__)
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    if(avx2)
+        return _runLengthAvx2(p, n);
+#endif
+    return _runLengthPortable(p, n);
+}
+
+//
+// rleEncode
+// Turns raw bytes into literal and run count symbols.
+//
+vector<int> rleEncode(const string &raw) {
+    vector<int> symbols;
+    symbols.reserve(raw.size());
+    size_t i = 0;
+    while(i < raw.size()){
+        int literal = (unsigned char)raw[i];
+        size_t run = runLength(raw.data() + i, raw.size() - i);
+        if(run >= RLE_MIN_RUN){
+            symbols.push_back(literal);
+            for(uint64_t extra = run - 1; extra > 0; extra >>= 8)
+                symbols.push_back(RLE_DIGIT_BASE + (int)(extra & 0xFF));
+        }
+        else
+            symbols.insert(symbols.end(), run, literal);
+        i += run;
+    }
+    return symbols;
+}
+
+//
+// rleDecode
+// Inverse of rleEncode. limit is the expected output size; a corrupt run
+// count that would exceed it throws instead of allocating.
+//
+string rleDecode(const vector<int> &symbols, size_t limit) {
+    string raw;
+    raw.reserve(limit);
+    size_t i = 0;
+    while(i < symbols.size()){
+        int symbol = symbols[i++];
+        if(symbol > 0xFF)
+            throw runtime_error("corrupt block: run count without a literal");
+        raw += (char)symbol;
+
+        uint64_t extra = 0;
+        int shift = 0;
+        while(i < symbols.size() && symbols[i] >= RLE_DIGIT_BASE && symbols[i] < RLE_DIGIT_BASE + 256){
+            if(shift > 32)
+                throw runtime_error("corrupt block: run count too long");
+            extra |= (uint64_t)(symbols[i++] - RLE_DIGIT_BASE) << shift;
+            shift += 8;
+        }
+        if(raw.size() + extra > limit)
+            throw runtime_error("corrupt block: run exceeds block size");
+        raw.append(extra, (char)symbol);
+    }
+    return raw;
+}
+
+//
+// Byte filters (BLOCK_FILTER_MASK / BLOCK_STRIDE_MASK)
+// Arrays of little-endian integers and floats have poor order-0 byte
+// statistics, because the low and high bytes of each value mix in one
+// histogram. A filter rearranges the block before the run-length pass and
+// Huffman coding:
+//   shuffle    - byte-plane split: all byte 0s of each stride-wide value,
+//                then all byte 1s, ... Each plane is Huffman coded as its
+//                own stream, since one order-0 table would see the same
+//                histogram as before the split.
+//   delta      - every byte minus the byte one stride earlier
+//   xor        - every byte xor the byte one stride earlier
+//   float      - shuffle, then delta along each plane (sign/exponent bytes
+//                of neighbouring floats are usually equal)
+// The strides are 1, 2, 4 and 8. The loops are written so the compiler
+// vectorizes the forward filters; undoing delta is a serial dependency.
+//
+
+const uint8_t BLOCK_FILTER_MASK = 0x0E;
+const uint8_t BLOCK_STRIDE_MASK = 0x30;
+
+enum FilterKind {
+    FILTER_NONE = 0,
+    FILTER_SHUFFLE = 1,
+    FILTER_DELTA = 2,
+    FILTER_XOR_DELTA = 3,
+    FILTER_FLOAT_SPLIT = 4
+};
+
+const char* const FILTER_NAMES[] = {"none", "shuffle", "delta", "xor", "float"};
+
+// how much of a block chooseFilter looks at
+const size_t FILTER_SAMPLE_SIZE = 64 * 1024;
+
+//
+// filterFlags
+// Block flag bits for a filter kind and stride (1, 2, 4 or 8).
+//
+uint8_t filterFlags(FilterKind kind, int stride) {
+    int strideBits = stride == 8 ? 3 : stride == 4 ? 2 : stride == 2 ? 1 : 0;
+    return (uint8_t)((kind << 1) | (strideBits << 4));
+}
+
+FilterKind filterKind(uint8_t flags) {
+    return (FilterKind)((flags & BLOCK_FILTER_MASK) >> 1);
+}
+
+int filterStride(uint8_t flags) {
+    return 1 << ((flags & BLOCK_STRIDE_MASK) >> 4);
+}
+
+//
+// parseFilter
+// Parses "none", "shuffle:4", "delta:2", "xor:8", "float:4", ... into block
+// flags. Throws on anything else.
+//
+uint8_t parseFilter(string spec) {
+    size_t colon = spec.find(':');
+    string name = spec.substr(0, colon);
+    int stride = colon == string::npos ? 1 : atoi(spec.c_str() + colon + 1);
+    if(stride != 1 && stride != 2 && stride != 4 && stride != 8)
+        throw runtime_error("filter stride must be 1, 2, 4 or 8");
+    for(int kind = FILTER_NONE; kind <= FILTER_FLOAT_SPLIT; kind++)
+        if(name == FILTER_NAMES[kind])
+            return kind == FILTER_NONE ? 0 : filterFlags((FilterKind)kind, stride);
+    throw runtime_error("unknown filter " + name);
+}
+
+//
+// _shuffle / _unshuffle
+// Byte-plane split of n / stride whole values; the leftover tail bytes are
+// copied unchanged.
+//
+string _shuffle(const string &in, int stride) {
+    size_t values = in.size() / stride;
+    string out(in.size(), '\0');
+    for(int plane = 0; plane < stride; plane++){
+        char* dst = &out[plane * values];
+        const char* src = in.data() + plane;
+        for(size_t i = 0; i < values; i++)
+            dst[i] = src[i * stride];
+    }
+    copy(in.begin() + values * stride, in.end(), out.begin() + values * stride);
+    return out;
+}
+
+string _unshuffle(const string &in, int stride) {
+    size_t values = in.size() / stride;
+    string out(in.size(), '\0');
+    for(int plane = 0; plane < stride; plane++){
+        const char* src = in.data() + plane * values;
+        char* dst = &out[plane];
+        for(size_t i = 0; i < values; i++)
+            dst[i * stride] = src[i];
+    }
+    copy(in.begin() + values * stride, in.end(), out.begin() + values * stride);
+    return out;
+}
+
+//
+// _delta / _undelta
+// Byte-wise difference (or xor) against the byte stride positions earlier.
+//
+string _delta(const string &in, int stride, bool useXor) {
+    string out(in);
+    const unsigned char* src = (const unsigned char*)in.data();
+    unsigned char* dst = (unsigned char*)&out[0];
+    for(size_t i = stride; i < in.size(); i++)
+        dst[i] = useXor ? (src[i] ^ src[i - stride]) : (unsigned char)(src[i] - src[i - stride]);
+    return out;
+}
+
+string _undelta(const string &in, int stride, bool useXor) {
+    string out(in);
+    unsigned char* p = (unsigned char*)&out[0];
+    for(size_t i = stride; i < out.size(); i++)
+        p[i] = useXor ? (p[i] ^ p[i - stride]) : (unsigned char)(p[i] + p[i - stride]);
+    return out;
+}
+
+//
+// applyFilter
+// Runs the filter selected by the block flags over raw.
+//
+string applyFilter(const string &raw, uint8_t flags) {
+    int stride = filterStride(flags);
+    switch(filterKind(flags)){
+        case FILTER_NONE: return raw;
+        case FILTER_SHUFFLE: return _shuffle(raw, stride);
+        case FILTER_DELTA: return _delta(raw, stride, false);
+        case FILTER_XOR_DELTA: return _delta(raw, stride, true);
+        case FILTER_FLOAT_SPLIT: return _delta(_shuffle(raw, stride), 1, false);
+    }
+    throw runtime_error("unknown filter in block flags");
+}
+
+//
+// undoFilter
+// Inverse of applyFilter for the same flags.
+//
+string undoFilter(const string &filtered, uint8_t flags) {
+    int stride = filterStride(flags);
+    switch(filterKind(flags)){
+        case FILTER_NONE: return filtered;
+        case FILTER_SHUFFLE: return _unshuffle(filtered, stride);
+        case FILTER_DELTA: return _undelta(filtered, stride, false);
+        case FILTER_XOR_DELTA: return _undelta(filtered, stride, true);
+        case FILTER_FLOAT_SPLIT: return _unshuffle(_undelta(filtered, 1, false), stride);
+    }
+    throw runtime_error("unknown filter in block flags");
+}
+
+//
+// isPlaneSplit
+// True for the filters whose output is coded as one stream per byte plane.
+//
+bool isPlaneSplit(uint8_t flags) {
+    FilterKind kind = filterKind(flags);
+    return kind == FILTER_SHUFFLE || kind == FILTER_FLOAT_SPLIT;
+}
+
+//
+// planeSizes
+// Sizes of the parts a filtered block of size bytes is coded as: the byte
+// planes and the leftover tail for plane-split filters, else the whole block.
+//
+vector<size_t> planeSizes(size_t size, uint8_t flags) {
+    if(!isPlaneSplit(flags))
+        return {size};
+    int stride = filterStride(flags);
+    vector<size_t> sizes(stride, size / stride);
+    sizes.push_back(size % stride);
+    return sizes;
+}
+
+//
+// estimateHuffmanBits
+// Order-0 entropy of the bytes, a close lower bound on the Huffman coded
+// size in bits.
+//
+double estimateHuffmanBits(const string &data) {
+    size_t counts[256] = {};
+    for(unsigned char ch : data)
+        counts[ch]++;
+    double bits = 0;
+    for(size_t count : counts)
+        if(count > 0)
+            bits -= count * log2((double)count / data.size());
+    return bits;
+}
+
+//
+// chooseFilter
+// Tries every filter and stride on a sample of the block and returns the
+// flags of the one with the smallest estimated size, or 0 when none beats
+// the unfiltered data by at least 2%.
+//
+uint8_t chooseFilter(const string &raw) {
+    // a sample from the middle of the block avoids file headers
+    size_t sampleSize = min(raw.size(), FILTER_SAMPLE_SIZE);
+    size_t start = (raw.size() - sampleSize) / 2;
+    start -= start % 8; // keep values aligned for every stride
+    string sample = raw.substr(start, sampleSize);
+
+    double bestBits = estimateHuffmanBits(sample) * 0.98;
+    uint8_t best = 0;
+    for(int kind = FILTER_SHUFFLE; kind <= FILTER_FLOAT_SPLIT; kind++){
+        for(int stride = 1; stride <= 8; stride *= 2){
+            if(stride == 1 && (kind == FILTER_SHUFFLE || kind == FILTER_FLOAT_SPLIT))
+                continue; // same as no filter / plain delta
+            uint8_t flags = filterFlags((FilterKind)kind, stride);
+            string filtered = applyFilter(sample, flags);
+            double bits = 0;
+            size_t offset = 0;
+            for(size_t size : planeSizes(filtered.size(), flags)){
+                bits += estimateHuffmanBits(filtered.substr(offset, size));
+                offset += size;
+            }
+            if(bits < bestBits){
+                bestBits = bits;
+                best = flags;
+            }
+        }
+    }
+    return best;
+}
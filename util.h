@@ -13,6 +13,7 @@
 
 #include <fstream> // for file reading
 #include <queue> // for priority_queue
+#include "instrument.h" // for the stats policies used by compress/decompress
 
 typedef hashmap hashmapF;
 typedef unordered_map <int, string> hashmapE;
@@ -148,6 +149,31 @@ hashmapE buildEncodingMap(HuffmanNode* tree) {
     return encodingMap;
 }
 
+//
+// *This function encodes the data in the input stream into the output stream
+// using the encodingMap and returns the number of bits written, the EOF code
+// included. When bits is given, the code of every character is also appended
+// to it as '0' and '1' characters; without it the memory used does not grow
+// with the input.
+//
+long long encodeStream(istream& input, hashmapE &encodingMap, ofbitstream& output,
+                       string* bits = nullptr) {
+    long long size = 0;
+    char cur;
+    auto put = [&](const string &code) {
+        for(char bit : code)
+            output.writeBit(bit == '1' ? 1 : 0);
+        size += code.size();
+        if(bits != nullptr)
+            *bits += code; // the output as a string, for testing
+    };
+    // for each character in the input stream, then the EOF encoding
+    while(input.get(cur))
+        put(encodingMap.at(cur));
+    put(encodingMap.at(PSEUDO_EOF));
+    return size;
+}
+
 //
 // *This function encodes the data in the input stream into the output stream
 // using the encodingMap.  This function calculates the number of bits
@@ -158,51 +184,30 @@ hashmapE buildEncodingMap(HuffmanNode* tree) {
 string encode(ifstream& input, hashmapE &encodingMap, ofbitstream& output,
               int &size, bool makeFile) {
     string buildString;
-    char cur;
-
-    if(makeFile){
-        // for each character in the input stream
-        while(input.get(cur)){
-            string encode = encodingMap.at(cur); // get the encoding and write each bit to the output stream
-            for(char &bit : encode){
-                if(bit == '0')
-                    output.writeBit(0);
-                if(bit == '1')
-                    output.writeBit(1);
-                size++;
-            }
-            buildString += encode; // add encoding to the output string for testing
-        }
-        // add each bit from the EOF encoding
-        string eof = encodingMap.at(PSEUDO_EOF);
-        for(char &bit : eof){
-            if(bit == '0')
-                output.writeBit(0);
-            if(bit == '1')
-                output.writeBit(1);
-            size++;
-        }
-        buildString += eof;// add encoding to the output string for testing
-    }
+    if(makeFile)
+        size += encodeStream(input, encodingMap, output, &buildString);
     return buildString;
 }
 
-
 //
 // *This function decodes the input stream and writes the result to the output
-// stream using the encodingTree.  This function also returns a string
-// representation of the output file, which is particularly useful for testing.
+// stream using the encodingTree. When decoded is given, the characters are
+// also appended to it; without it the memory used does not grow with the
+// input.
 //
-string decode(ifbitstream &input, HuffmanNode* encodingTree, ofstream &output) {
-    string buildString;
+void decodeStream(ifbitstream &input, HuffmanNode* encodingTree, ostream &output,
+                  string* decoded = nullptr) {
     HuffmanNode* curNode = encodingTree;
 
     while(!input.eof()) { // keep taking in characters until the end of file
+        if(curNode == nullptr) // corrupt input walked off the tree, stop here
+            break;
         if(curNode->character == PSEUDO_EOF) // once it reaches the eof encoding, ends the loop
             break;
         // when the node is a character encoding, adds to the output and reset tree
         if (curNode->character != NOT_A_CHAR) {
-            buildString += curNode->character;
+            if(decoded != nullptr)
+                *decoded += curNode->character;
             output.put(curNode->character);
             curNode = encodingTree;
         }
@@ -213,18 +218,100 @@ string decode(ifbitstream &input, HuffmanNode* encodingTree, ofstream &output) {
         else if (bit == 1)
             curNode = curNode->one;
     }
+}
 
-    return buildString;  // TO DO: update this return
+//
+// *This function decodes the input stream and writes the result to the output
+// stream using the encodingTree.  This function also returns a string
+// representation of the output file, which is particularly useful for testing.
+//
+string decode(ifbitstream &input, HuffmanNode* encodingTree, ofstream &output) {
+    string buildString;
+    decodeStream(input, encodingTree, output, &buildString);
+    return buildString;
 }
 
 //
-// *This function completes the entire compression process.  Given a file,
-// filename, this function (1) builds a frequency map; (2) builds an encoding
-// tree; (3) builds an encoding map; (4) encodes the file.  This function
-// creates a compressed file named (filename + ".huf") and also
-// returns a string version of the bit pattern.
+// *This function checks that filename (a ".huf" file made by compress) decodes
+// cleanly, without creating an output file or building the decoded string.
+// The walk must reach the EOF code without leaving the tree, and the number
+// of times each character decodes must match the frequency map header. An
+// empty file's header holds only PSEUDO_EOF, whose tree is a single leaf
+// and whose code is empty, as in decode().
+// Returns false and sets error when the file is damaged.
 //
-string compress(string filename) {
+bool verifyCompressed(string filename, string &error) {
+    ifbitstream input(filename);
+    if(!input.is_open()){
+        error = "cannot open " + filename;
+        return false;
+    }
+    hashmapF frequencyMap;
+    input >> frequencyMap;
+    if(!input || !frequencyMap.containsKey(PSEUDO_EOF)){
+        error = "bad frequency map header";
+        return false;
+    }
+
+    HuffmanNode* root = buildEncodingTree(frequencyMap);
+    unordered_map<int, int> decodedCounts;
+    HuffmanNode* curNode = root;
+    while(true){
+        if(curNode == nullptr){
+            error = "code leaves the encoding tree";
+            break;
+        }
+        if(curNode->character == PSEUDO_EOF)
+            break;
+        if(curNode->character != NOT_A_CHAR){
+            decodedCounts[curNode->character]++;
+            curNode = root;
+        }
+        int bit = input.readBit();
+        if(bit != 0 && bit != 1){
+            error = "file ends before the EOF code";
+            break;
+        }
+        curNode = (bit == 0) ? curNode->zero : curNode->one;
+    }
+    _freeTree(root);
+    if(!error.empty())
+        return false;
+
+    for(int key : frequencyMap.keys()){
+        if(key != PSEUDO_EOF && decodedCounts[key] != frequencyMap.get(key)){
+            error = "decoded character counts do not match the header";
+            return false;
+        }
+    }
+    return true;
+}
+
+//
+// *Returns the depth of the tree, which is also the longest code length.
+//
+int treeDepth(HuffmanNode* node) {
+    if(node == nullptr || node->character != NOT_A_CHAR)
+        return 0;
+    return 1 + max(treeDepth(node->zero), treeDepth(node->one));
+}
+
+//
+// *Returns the number of nodes in the tree.
+//
+int countNodes(HuffmanNode* node) {
+    if(node == nullptr)
+        return 0;
+    return 1 + countNodes(node->zero) + countNodes(node->one);
+}
+
+//
+// *Compression pipeline shared by both compress() overloads. Stats is one of
+// the policies from instrument.h; with NoStats the timers and counters
+// compile away entirely.
+//
+template <typename Stats>
+string _compress(string filename, Stats &stats) {
     // opens the file and tests if the file is openable
     bool isFile = false;
     ifstream inFile(filename);
@@ -233,35 +320,85 @@ string compress(string filename) {
 
     // builds the frequency map
     hashmapF map;
-    buildFrequencyMap(filename, isFile, map);
+    {
+        auto timer = stats.scope(STAGE_FREQUENCY);
+        buildFrequencyMap(filename, isFile, map);
+    }
 
     // builds the encodingTree and encodingMap
-    HuffmanNode* root = buildEncodingTree(map);
-    hashmapE encodingMap = buildEncodingMap(root);
+    HuffmanNode* root;
+    {
+        auto timer = stats.scope(STAGE_TREE);
+        root = buildEncodingTree(map);
+    }
+    hashmapE encodingMap;
+    {
+        auto timer = stats.scope(STAGE_TABLE);
+        encodingMap = buildEncodingMap(root);
+    }
 
     // creates the input and new output streams for the encoding
     ifstream input(filename);
     ofbitstream output(filename + ".huf");
-    output << map;
+    {
+        auto timer = stats.scope(STAGE_HEADER);
+        output << map;
+    }
     int size = 0;
 
-    string encodedMessage = encode(input, encodingMap, output, size, true);
+    string encodedMessage;
+    {
+        auto timer = stats.scope(STAGE_ENCODE);
+        encodedMessage = encode(input, encodingMap, output, size, true);
+    }
+
+    if(Stats::enabled){
+        long long bytesRead = 0;
+        for(int key : map.keys())
+            if(key != PSEUDO_EOF)
+                bytesRead += map.get(key);
+        stats.add(BYTES_READ, bytesRead);
+        stats.add(BITS_WRITTEN, size);
+        stats.set(TREE_DEPTH, treeDepth(root));
+        stats.add(ALLOCATIONS, countNodes(root));
+    }
     _freeTree(root);
     return encodedMessage; // encode the file and return
 }
 
 //
-// *This function completes the entire decompression process.  Given the file,
-// filename (which should end with ".huf"), (1) extract the header and build
-// the frequency map; (2) build an encoding tree from the frequency map; (3)
-// using the encoding tree to decode the file.  This function creates a
-// compressed file using the following convention.
-// If filename = "example.txt.huf", then the uncompressed file should be named
-// "example_unc.txt".  The function returns a string version of the
-// uncompressed file.  Note: this function reverses the compression function
+// *This function completes the entire compression process.  Given a file,
+// filename, this function (1) builds a frequency map; (2) builds an encoding
+// tree; (3) builds an encoding map; (4) encodes the file.  This function
+// creates a compressed file named (filename + ".huf") and also
+// returns a string version of the bit pattern.
 //
-string decompress(string filename) {
+string compress(string filename) {
+    DefaultStats stats("compress", filename);
+    string encodedMessage = _compress(filename, stats);
+    stats.report();
+    return encodedMessage;
+}
+
+//
+// *Same as compress(filename), filling in stats with per-stage timings and
+// counters for the run.
+//
+string compress(string filename, RunStats &stats) {
+    return _compress(filename, stats);
+}
+
+//
+// *Decompression pipeline shared by both decompress() overloads.
+//
+template <typename Stats>
+string _decompress(string filename, Stats &stats) {
     ifbitstream input(filename);
+    if(Stats::enabled){
+        ifstream sizeCheck(filename, ios::binary | ios::ate);
+        if(sizeCheck)
+            stats.add(BYTES_READ, sizeCheck.tellg());
+    }
 
     // string parsing to correctly name the output file
     int pos = filename.find(".huf");
@@ -276,12 +413,54 @@ string decompress(string filename) {
 
     // get the frequency map from the first part of encoded file
     hashmapF frequencyMap;
-    input >> frequencyMap;
+    {
+        auto timer = stats.scope(STAGE_HEADER);
+        input >> frequencyMap;
+    }
 
     // build the encoding tree
-    HuffmanNode* root = buildEncodingTree(frequencyMap);
+    HuffmanNode* root;
+    {
+        auto timer = stats.scope(STAGE_TREE);
+        root = buildEncodingTree(frequencyMap);
+    }
+
+    string decodedMessage;
+    {
+        auto timer = stats.scope(STAGE_DECODE);
+        decodedMessage = decode(input, root, output);
+    }
 
-    string decodedMessage = decode(input, root, output);
+    if(Stats::enabled){
+        stats.add(SYMBOLS_DECODED, decodedMessage.size());
+        stats.set(TREE_DEPTH, treeDepth(root));
+        stats.add(ALLOCATIONS, countNodes(root));
+    }
     _freeTree(root);
     return decodedMessage; // decode the file and return
 }
+
+//
+// *This function completes the entire decompression process.  Given the file,
+// filename (which should end with ".huf"), (1) extract the header and build
+// the frequency map; (2) build an encoding tree from the frequency map; (3)
+// using the encoding tree to decode the file.  This function creates a
+// compressed file using the following convention.
+// If filename = "example.txt.huf", then the uncompressed file should be named
+// "example_unc.txt".  The function returns a string version of the
+// uncompressed file.  Note: this function reverses the compression function
+//
+string decompress(string filename) {
+    DefaultStats stats("decompress", filename);
+    string decodedMessage = _decompress(filename, stats);
+    stats.report();
+    return decodedMessage;
+}
+
+//
+// *Same as decompress(filename), filling in stats with per-stage timings and
+// counters for the run.
+//
+string decompress(string filename, RunStats &stats) {
+    return _decompress(filename, stats);
+}